@@ -0,0 +1,278 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "../src/dag.hpp"
+#include "../src/input.hpp"
+#include "../src/layout.hpp"
+#include "../src/svg.hpp"
+
+//
+// Allocation counting
+//
+static std::atomic<size_t> allocationCount(0);
+
+void* operator new(size_t size) {
+    allocationCount++;
+    if (auto memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+/**
+ * Generated input for a single benchmark run
+ */
+struct Workload {
+    std::string generator;
+    std::string text;
+    size_t nodes;
+    size_t edges;
+};
+
+/**
+ * Append a single dependency line
+ */
+void _append_edge(Workload& workload, size_t from, size_t to) {
+    workload.text += "node" + std::to_string(from) + ">node" + std::to_string(to) + "\n";
+    workload.edges++;
+}
+
+/**
+ * n0 > n1 > ... > nN
+ */
+Workload generate_chain(size_t size, std::mt19937&) {
+    Workload workload { "chain", "", size, 0 };
+    for (size_t i = 1; i < size; i++) {
+        _append_edge(workload, i - 1, i);
+    }
+    return workload;
+}
+
+/**
+ * One root fanning out to all nodes, which fan in to one sink
+ */
+Workload generate_fan(size_t size, std::mt19937&) {
+    Workload workload { "fan", "", size, 0 };
+    for (size_t i = 1; i + 1 < size; i++) {
+        _append_edge(workload, 0, i);
+        _append_edge(workload, i, size - 1);
+    }
+    return workload;
+}
+
+/**
+ * Chain of diamonds; The number of paths doubles with every diamond
+ */
+Workload generate_diamonds(size_t size, std::mt19937&) {
+    Workload workload { "diamonds", "", 0, 0 };
+    size_t diamonds = size / 3;
+    for (size_t i = 0; i < diamonds; i++) {
+        auto top = 3 * i;
+        _append_edge(workload, top, top + 1);
+        _append_edge(workload, top, top + 2);
+        _append_edge(workload, top + 1, top + 3);
+        _append_edge(workload, top + 2, top + 3);
+    }
+    workload.nodes = 3 * diamonds + 1;
+    return workload;
+}
+
+/**
+ * Random dag with layers of equal width; Every node depends on nodes of the next layers
+ */
+Workload generate_layered(size_t size, std::mt19937& random) {
+    Workload workload { "layered", "", size, 0 };
+    const size_t WIDTH = 100;
+    const size_t EDGES_PER_NODE = 3;
+    const size_t MAX_SKIP = 3;
+
+    for (size_t i = 0; i + WIDTH < size; i++) {
+        auto layer = i / WIDTH;
+        for (size_t j = 0; j < EDGES_PER_NODE; j++) {
+            auto targetLayer = layer + 1 + random() % MAX_SKIP;
+            auto target = targetLayer * WIDTH + random() % WIDTH;
+            if (target < size) {
+                _append_edge(workload, i, target);
+            }
+        }
+    }
+    return workload;
+}
+
+/**
+ * Preferential attachment; Popular libraries collect most dependents
+ */
+Workload generate_power_law(size_t size, std::mt19937& random) {
+    Workload workload { "powerlaw", "", size, 0 };
+    const size_t EDGES_PER_NODE = 3;
+    std::vector<size_t> endpoints { 0 };
+
+    for (size_t i = 1; i < size; i++) {
+        for (size_t j = 0; j < EDGES_PER_NODE && j < i; j++) {
+            auto target = endpoints[random() % endpoints.size()];
+            _append_edge(workload, i, target);
+            endpoints.push_back(target);
+        }
+        endpoints.push_back(i);
+    }
+    return workload;
+}
+
+/**
+ * Peak resident set size of the process in kilobytes
+ */
+long _peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * Run a stage and print one json line with its cost
+ */
+void measure(const Workload& workload, const std::string& stage, const std::function<void()>& run) {
+    auto allocations = allocationCount.load();
+    auto start = std::chrono::steady_clock::now();
+
+    run();
+
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    allocations = allocationCount.load() - allocations;
+
+    std::cout << "{\"generator\":\"" << workload.generator << "\""
+        << ",\"nodes\":" << workload.nodes
+        << ",\"edges\":" << workload.edges
+        << ",\"stage\":\"" << stage << "\""
+        << ",\"ns\":" << nanoseconds
+        << ",\"ns_per_edge\":" << (workload.edges ? static_cast<double>(nanoseconds) / workload.edges : 0.0)
+        << ",\"allocations\":" << allocations
+        << ",\"peak_rss_kb\":" << _peak_rss_kb()
+        << "}" << std::endl;
+}
+
+/**
+ * Time every stage of the pipeline on the given workload
+ */
+void run_workload(const Workload& workload, bool legacy) {
+    const std::string SVG_FILE = "dag_bench.svg";
+    dag::InternedDependencies interned;
+    dag::Graph graph;
+
+    measure(workload, "parse_dependencies", [&]() {
+        interned = dag::parse_dependencies(workload.text);
+    });
+    measure(workload, "build_graph", [&]() {
+        graph = dag::build_graph(interned);
+    });
+    measure(workload, "layout_tree", [&]() {
+        dag::LayoutOptions options;
+        dag::layout_graph(graph, options);
+    });
+    measure(workload, "layout_layered", [&]() {
+        dag::LayoutOptions options;
+        options.engine = dag::LayoutEngine::Layered;
+        dag::layout_graph(graph, options);
+    });
+    measure(workload, "get_node_count", [&]() {
+        dag::get_node_count(graph);
+    });
+    measure(workload, "write_svg", [&]() {
+        write_svg(graph, SVG_FILE);
+    });
+    std::remove(SVG_FILE.c_str());
+
+    // The shared_ptr based interface for comparison with older releases
+    if (legacy) {
+        std::vector<std::string> lines;
+        dag::dependency_vec dependencies;
+        dag::node_vec startNodes;
+
+        measure(workload, "convert_dependencies", [&]() {
+            std::string line;
+            for (auto c: workload.text) {
+                if (c == '\n') {
+                    lines.push_back(line);
+                    line.clear();
+                } else {
+                    line += c;
+                }
+            }
+            dependencies = dag::convert_dependencies(lines);
+        });
+        measure(workload, "build_dag", [&]() {
+            dag::build_dag(dependencies, startNodes);
+        });
+    }
+}
+
+/**
+ * Print command line usage to stderr
+ */
+void print_usage() {
+    std::cerr << "Usage: dag_bench [--size N] [--generator NAME] [--legacy]" << std::endl;
+    std::cerr << "  --size N          Number of nodes per generated graph (default 10000)" << std::endl;
+    std::cerr << "  --generator NAME  chain, fan, diamonds, layered or powerlaw (default all)" << std::endl;
+    std::cerr << "  --legacy          Also time convert_dependencies and build_dag" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    size_t size = 10000;
+    std::string only;
+    bool legacy = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument(argv[i]);
+
+        if (argument == "--size" && i + 1 < argc) {
+            size = std::strtoul(argv[++i], nullptr, 10);
+        } else if (argument == "--generator" && i + 1 < argc) {
+            only = argv[++i];
+        } else if (argument == "--legacy") {
+            legacy = true;
+        } else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    const std::vector<std::pair<std::string, std::function<Workload(size_t, std::mt19937&)>>> generators {
+        { "chain", generate_chain },
+        { "fan", generate_fan },
+        { "diamonds", generate_diamonds },
+        { "layered", generate_layered },
+        { "powerlaw", generate_power_law }
+    };
+
+    bool found = false;
+    for (const auto& generator: generators) {
+        if (only != "" && only != generator.first) continue;
+        found = true;
+
+        // Fixed seed keeps runs comparable
+        std::mt19937 random(42);
+        run_workload(generator.second(size, random), legacy);
+    }
+
+    if (!found) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
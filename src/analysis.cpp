@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <string>
+#include <vector>
+#include "analysis.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    /**
+     * Earliest and latest start of every node in one forward and one backward pass over the topological order
+     */
+    CriticalPath analyze_critical_path(const Graph& graph) {
+        TRACE_SCOPE("analyze_critical_path");
+        const auto nodeCount = graph.size();
+        CriticalPath analysis;
+
+        // 1. A node starts as soon as all its ancestors are finished
+        analysis.earliestStart.assign(nodeCount, 0);
+        for (auto node: graph.topologicalOrder) {
+            const auto finish = analysis.earliestStart[node] + graph.costs[node];
+            analysis.length = std::max(analysis.length, finish);
+
+            for (auto child: graph.children(node)) {
+                analysis.earliestStart[child] = std::max(analysis.earliestStart[child], finish);
+            }
+        }
+
+        // 2. A node must finish before the earliest latest start of its children
+        analysis.latestStart.assign(nodeCount, 0);
+        analysis.slack.assign(nodeCount, 0);
+        for (auto i = graph.topologicalOrder.size(); i-- > 0;) {
+            const auto node = graph.topologicalOrder[i];
+            auto latestFinish = analysis.length;
+
+            for (auto child: graph.children(node)) {
+                latestFinish = std::min(latestFinish, analysis.latestStart[child]);
+            }
+            analysis.latestStart[node] = latestFinish - graph.costs[node];
+            analysis.slack[node] = std::max(0.0, analysis.latestStart[node] - analysis.earliestStart[node]);
+        }
+
+        // 3. Critical edges connect critical nodes without a gap in between
+        const auto tolerance = 1e-9 * std::max(1.0, analysis.length);
+        auto critical = [&](node_id node) {
+            return analysis.slack[node] <= tolerance;
+        };
+
+        analysis.criticalEdges.assign(graph.edge_count(), false);
+        TRACE_COUNT(EdgesVisited, 2 * graph.edge_count());
+        for (node_id node = 0; node < nodeCount; node++) {
+            if (!critical(node)) continue;
+
+            const auto finish = analysis.earliestStart[node] + graph.costs[node];
+            for (auto i = graph.childOffsets[node]; i < graph.childOffsets[node + 1]; i++) {
+                const auto child = graph.childIds[i];
+                analysis.criticalEdges[i] = critical(child) && std::fabs(analysis.earliestStart[child] - finish) <= tolerance;
+            }
+        }
+
+        // 4. Follow the first critical edge from the first critical start node
+        for (auto startNode: graph.startNodes) {
+            if (!critical(startNode)) continue;
+
+            for (node_id node = startNode; node != NO_NODE;) {
+                analysis.path.push_back(node);
+
+                auto next = NO_NODE;
+                for (auto i = graph.childOffsets[node]; i < graph.childOffsets[node + 1] && next == NO_NODE; i++) {
+                    if (analysis.criticalEdges[i]) next = graph.childIds[i];
+                }
+                node = next;
+            }
+            break;
+        }
+
+        analysis.levelWidths.assign(graph.depth, 0);
+        for (node_id node = 0; node < nodeCount; node++) {
+            analysis.levelWidths[graph.layers[node]]++;
+        }
+
+        return analysis;
+    }
+
+    /**
+     * Node ids ordered by earliest start; Ties keep the id order
+     */
+    id_vec _schedule_order(const CriticalPath& analysis) {
+        id_vec order(analysis.earliestStart.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](node_id a, node_id b) {
+            return analysis.earliestStart[a] < analysis.earliestStart[b];
+        });
+        return order;
+    }
+
+    /**
+     * Print the critical path, the level widths and the schedule of every node
+     */
+    void write_analysis_text(const Graph& graph, const CriticalPath& analysis, std::ostream& stream) {
+        stream << "Critical path length: " << analysis.length << std::endl;
+        stream << "Critical path:";
+        for (size_t i = 0; i < analysis.path.size(); i++) {
+            stream << (i ? " > " : " ") << graph.name(analysis.path[i]);
+        }
+        stream << std::endl;
+
+        uint32_t widest = 0;
+        stream << "Level widths:";
+        for (auto width: analysis.levelWidths) {
+            stream << " " << width;
+            widest = std::max(widest, width);
+        }
+        stream << std::endl << "Maximum parallelism: " << widest << std::endl << std::endl;
+
+        char line[128];
+        snprintf(line, sizeof(line), "%12s %12s %12s %12s  %s\n", "cost", "earliest", "latest", "slack", "node");
+        stream << line;
+
+        const auto tolerance = 1e-9 * std::max(1.0, analysis.length);
+        for (auto node: _schedule_order(analysis)) {
+            snprintf(line, sizeof(line), "%12g %12g %12g %12g %s ", graph.costs[node], analysis.earliestStart[node],
+                analysis.latestStart[node], analysis.slack[node], analysis.slack[node] <= tolerance ? "*" : " ");
+            stream << line << graph.name(node) << std::endl;
+        }
+    }
+
+    /**
+     * Append the text as a quoted json string
+     */
+    void write_json_string(std::ostream& stream, std::string_view text) {
+        stream << '"';
+        for (auto c: text) {
+            switch (c) {
+                case '"': stream << "\\\""; break;
+                case '\\': stream << "\\\\"; break;
+                case '\n': stream << "\\n"; break;
+                case '\t': stream << "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char escaped[8];
+                        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                        stream << escaped;
+                    } else {
+                        stream << c;
+                    }
+            }
+        }
+        stream << '"';
+    }
+
+    /**
+     * Append the shortest text that reads back as the same number
+     */
+    void write_json_number(std::ostream& stream, double value) {
+        char number[32];
+        auto result = std::to_chars(number, number + sizeof(number), value);
+        stream << std::string_view(number, result.ptr - number);
+    }
+
+    /**
+     * Print the same facts as write_analysis_text as a single json object
+     */
+    void write_analysis_json(const Graph& graph, const CriticalPath& analysis, std::ostream& stream) {
+        const auto tolerance = 1e-9 * std::max(1.0, analysis.length);
+
+        stream << "{\"length\":";
+        write_json_number(stream, analysis.length);
+        stream << ",\"criticalPath\":[";
+        for (size_t i = 0; i < analysis.path.size(); i++) {
+            stream << (i ? "," : "");
+            write_json_string(stream, graph.name(analysis.path[i]));
+        }
+
+        stream << "],\"levelWidths\":[";
+        for (size_t i = 0; i < analysis.levelWidths.size(); i++) {
+            stream << (i ? "," : "") << analysis.levelWidths[i];
+        }
+
+        stream << "],\"nodes\":[";
+        auto order = _schedule_order(analysis);
+        for (size_t i = 0; i < order.size(); i++) {
+            auto node = order[i];
+            stream << (i ? ",\n" : "\n") << "{\"name\":";
+            write_json_string(stream, graph.name(node));
+            stream << ",\"cost\":";
+            write_json_number(stream, graph.costs[node]);
+            stream << ",\"earliestStart\":";
+            write_json_number(stream, analysis.earliestStart[node]);
+            stream << ",\"latestStart\":";
+            write_json_number(stream, analysis.latestStart[node]);
+            stream << ",\"slack\":";
+            write_json_number(stream, analysis.slack[node]);
+            stream << ",\"critical\":" << (analysis.slack[node] <= tolerance ? "true" : "false") << "}";
+        }
+        stream << "\n]}" << std::endl;
+    }
+}
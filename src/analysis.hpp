@@ -0,0 +1,28 @@
+#ifndef ANALYSIS_HPP
+#define ANALYSIS_HPP
+#include <ostream>
+#include <string_view>
+#include <vector>
+#include "dag.hpp"
+
+namespace dag {
+    /**
+     * Schedule of the dag with unlimited parallelism; Times are in units of the node costs
+     */
+    struct CriticalPath {
+        double length = 0;                  // Finish time of the last node
+        std::vector<double> earliestStart;
+        std::vector<double> latestStart;    // Latest start that does not delay the whole dag
+        std::vector<double> slack;
+        std::vector<bool> criticalEdges;    // Indexed like Graph::childIds
+        id_vec path;                        // One chain of critical nodes from a start node to a leaf
+        std::vector<uint32_t> levelWidths;  // Nodes per topological level
+    };
+
+    CriticalPath analyze_critical_path(const Graph& graph);
+    void write_analysis_text(const Graph& graph, const CriticalPath& analysis, std::ostream& stream);
+    void write_json_string(std::ostream& stream, std::string_view text);
+    void write_json_number(std::ostream& stream, double value);
+    void write_analysis_json(const Graph& graph, const CriticalPath& analysis, std::ostream& stream);
+}
+#endif
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.hpp"
+#include "hash.hpp"
+#include "output.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    const std::string TEMPORARY_PREFIX = "tmp-";
+    const size_t COPY_BUFFER_SIZE = 1 << 16;
+
+    std::string CacheKey::hex() const {
+        char text[33];
+        snprintf(text, sizeof(text), "%016llx%016llx", static_cast<unsigned long long>(this->high),
+            static_cast<unsigned long long>(this->low));
+        return text;
+    }
+
+    /**
+     * Key of the data as produced under the given settings; Two seeds give the two halves
+     */
+    CacheKey cache_key(std::string_view data, std::string_view context) {
+        TRACE_SCOPE("cache_key");
+        const auto seed = hash_bytes(context);
+        return CacheKey { hash_bytes(data, seed), hash_bytes(data, ~seed) };
+    }
+
+    ResultCache::ResultCache(const CacheOptions& options) : options(options) {
+        if (mkdir(options.directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw Exception("Unable to create " + options.directory);
+        }
+    }
+
+    std::string ResultCache::path(const CacheKey& key) const {
+        return this->options.directory + "/" + key.hex();
+    }
+
+    /**
+     * Copy an entry to the destination, "-" for standard output; Returns false on a miss
+     */
+    bool ResultCache::fetch(const CacheKey& key, const std::string& destination) const {
+        TRACE_SCOPE("fetch_cache");
+        auto entry = open(this->path(key).c_str(), O_RDONLY);
+        if (entry < 0) return false;
+
+        // The entry stays readable even if another process evicts it now
+        futimens(entry, nullptr);
+        auto output = destination == "-" ? STDOUT_FILENO : open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output < 0) {
+            close(entry);
+            throw Exception("Unable to open " + destination);
+        }
+
+        std::vector<char> buffer(COPY_BUFFER_SIZE);
+        try {
+            for (;;) {
+                auto count = ::read(entry, buffer.data(), buffer.size());
+                if (count < 0 && errno == EINTR) continue;
+                if (count < 0) throw Exception("Unable to read " + this->path(key));
+                if (count == 0) break;
+                write_text(output, std::string_view(buffer.data(), count));
+            }
+        } catch (Exception&) {
+            close(entry);
+            if (output != STDOUT_FILENO) close(output);
+            throw;
+        }
+
+        close(entry);
+        if (output != STDOUT_FILENO) close(output);
+        return true;
+    }
+
+    /**
+     * Unique file in the cache directory to write a new entry to; Keeps the extension of the
+     * destination, since it may select the encoding
+     */
+    std::string ResultCache::temporary_path(const std::string& destination) const {
+        auto dot = destination.rfind('.');
+        auto slash = destination.rfind('/');
+        auto extension = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? "" : destination.substr(dot);
+        static std::atomic<unsigned> counter(0);
+        auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+        return this->options.directory + "/" + TEMPORARY_PREFIX + std::to_string(getpid()) + "-"
+            + std::to_string(now) + "-" + std::to_string(counter++) + extension;
+    }
+
+    /**
+     * Publish a finished temporary file under its key; Replaces an entry that another
+     * process stored in the meantime, which has the same content
+     */
+    void ResultCache::store(const std::string& temporary, const CacheKey& key) const {
+        if (rename(temporary.c_str(), this->path(key).c_str()) != 0) {
+            unlink(temporary.c_str());
+            throw Exception("Unable to store " + this->path(key));
+        }
+    }
+
+    /**
+     * Make an entry reachable under a second key; Both names share the file
+     */
+    void ResultCache::link(const CacheKey& key, const CacheKey& alias) const {
+        if (key == alias) return;
+        auto temporary = this->temporary_path("");
+        if (::link(this->path(key).c_str(), temporary.c_str()) == 0 && rename(temporary.c_str(), this->path(alias).c_str()) != 0) {
+            unlink(temporary.c_str());
+        }
+    }
+
+    /**
+     * Remove the least recently used entries until the cache fits its size; Names that
+     * share a file are removed together
+     */
+    void ResultCache::evict() const {
+        TRACE_SCOPE("evict_cache");
+        // All names of one file
+        struct Entry {
+            uint64_t bytes = 0;
+            int64_t used = 0;
+            std::vector<std::string> paths;
+        };
+
+        auto directory = opendir(this->options.directory.c_str());
+        if (!directory) return;
+
+        std::unordered_map<ino_t, Entry> entries;
+        uint64_t totalBytes = 0;
+        const auto now = static_cast<int64_t>(time(nullptr));
+        while (auto item = readdir(directory)) {
+            std::string name(item->d_name);
+            auto path = this->options.directory + "/" + name;
+            struct stat info;
+            if (name[0] == '.' || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) continue;
+
+            // Left behind by a process that did not finish
+            if (name.compare(0, TEMPORARY_PREFIX.size(), TEMPORARY_PREFIX) == 0) {
+                if (now - info.st_mtime > STALE_CACHE_SECONDS) unlink(path.c_str());
+                continue;
+            }
+
+            auto& entry = entries[info.st_ino];
+            if (entry.paths.empty()) totalBytes += info.st_size;
+            entry.bytes = info.st_size;
+            entry.used = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+            entry.paths.push_back(path);
+        }
+        closedir(directory);
+
+        if (totalBytes <= this->options.maxBytes) return;
+
+        std::vector<const Entry*> byAge;
+        for (const auto& [inode, entry]: entries) byAge.push_back(&entry);
+        std::sort(byAge.begin(), byAge.end(), [](const Entry* a, const Entry* b) {
+            return a->used < b->used;
+        });
+
+        for (auto entry: byAge) {
+            if (totalBytes <= this->options.maxBytes) break;
+            for (const auto& path: entry->paths) unlink(path.c_str());
+            totalBytes -= entry->bytes;
+        }
+    }
+}
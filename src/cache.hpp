@@ -0,0 +1,53 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace dag {
+    const uint64_t DEFAULT_CACHE_BYTES = uint64_t(512) << 20;
+    const unsigned STALE_CACHE_SECONDS = 3600;      // Unfinished entries older than this are removed
+
+    /**
+     * Settings for the result cache
+     */
+    struct CacheOptions {
+        std::string directory;          // No caching if empty
+        uint64_t maxBytes = DEFAULT_CACHE_BYTES;
+    };
+
+    /**
+     * 128 bit name of a cache entry
+     */
+    struct CacheKey {
+        uint64_t high = 0;
+        uint64_t low = 0;
+
+        bool operator==(const CacheKey& other) const { return high == other.high && low == other.low; }
+        std::string hex() const;
+    };
+
+    /**
+     * Directory of finished outputs named by the hash of what produced them. Entries are
+     * written to a temporary file and renamed, so parallel processes only ever see whole
+     * entries. Every hit touches the entry; Eviction removes the least recently used ones
+     */
+    class ResultCache {
+        protected:
+        CacheOptions options;
+
+        std::string path(const CacheKey& key) const;
+
+        public:
+        ResultCache(const CacheOptions& options);
+
+        bool fetch(const CacheKey& key, const std::string& destination) const;
+        std::string temporary_path(const std::string& destination) const;
+        void store(const std::string& temporary, const CacheKey& key) const;
+        void link(const CacheKey& key, const CacheKey& alias) const;
+        void evict() const;
+    };
+
+    CacheKey cache_key(std::string_view data, std::string_view context);
+}
+#endif
@@ -1,22 +1,21 @@
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <numeric>
 #include <sstream>
 #include <string>
 #include <unordered_set>
 #include <vector>
 #include "dag.hpp"
+#include "layout.hpp"
 #include "stdafx.hpp"
+#include "trace.hpp"
 
 namespace dag {
-    /**
-     * Instantiate a new dag node; Calculate and store name hash
-     */
-    DagNode::DagNode(const std::string& name) {
-        this->name = name;
-        this->x = -1;
-        this->y = -1;
-    }
-
     /**
      * Convert single line to dependency
      */
@@ -42,6 +41,7 @@ namespace dag {
      * Convert list of lines into dependency structs
      */
     std::vector<Dependency> convert_dependencies(const std::vector<std::string>& lines) {
+        TRACE_SCOPE("convert_dependencies");
         std::vector<Dependency> dependencies;
 
         for (auto line: lines) {
@@ -63,226 +63,1366 @@ namespace dag {
     }
 
     /**
-     * Find a particular node in the dag
+     * Edge between two interned nodes; key orders the edge among its parent's children
      */
-    void _find_node(const std::string& needle, const node_vec& nodes, node_ptr* found) {
-        // Loop over all nodes
-        for (auto node: nodes) {
-            // Is the current node the one we're looking for?
-            if (node->name == needle) {
-                *found = node;
-                return;
+    struct _IndexedEdge {
+        node_id from;
+        node_id to;
+        size_t key;
+    };
+
+    /**
+     * Per node facts and unique edges, collected in a single pass over the interned dependencies
+     */
+    struct _DependencyIndex {
+        std::vector<node_id> upstreamOrder;     // Nodes in order of their first upstream record
+        std::vector<size_t> firstRecord;    // First dependency that names the node as upstream
+        std::vector<bool> hasDownstream;    // Node has at least one outgoing edge
+        std::vector<size_t> inDegree;
+        std::vector<_IndexedEdge> edges;
+    };
+
+    const size_t NO_RECORD = static_cast<size_t>(-1);
+
+    /**
+     * Open addressing set of edges in a single allocation; Sized for the number of records up front
+     */
+    struct _EdgeSet {
+        const uint64_t EMPTY = UINT64_MAX;      // Never a valid edge, as NO_NODE is not a target
+        std::vector<uint64_t> slots;
+        uint64_t mask;
+
+        _EdgeSet(size_t capacity) {
+            size_t size = 16;
+            while (size < 2 * capacity) size *= 2;
+            this->slots.assign(size, EMPTY);
+            this->mask = size - 1;
+        }
+
+        bool insert(node_id from, node_id to) {
+            const uint64_t edge = static_cast<uint64_t>(from) << 32 | to;
+            auto slot = (edge * 0x9E3779B97F4A7C15ull) >> 32 & this->mask;
+
+            while (this->slots[slot] != EMPTY) {
+                if (this->slots[slot] == edge) return false;
+                slot = (slot + 1) & this->mask;
             }
 
-            // Search in child nodes
-            _find_node(needle, node->children, found);
-            if (*found != nullptr) {
-                return;
+            this->slots[slot] = edge;
+            return true;
+        }
+    };
+
+    /**
+     * Look up the id for the given name; Assigns the next free id on first sight
+     */
+    node_id intern_name(name_index& ids, std::vector<std::string_view>& names, std::string_view name) {
+        // Keep the table at most half full; Doubling it only moves the stored hashes
+        if (2 * (names.size() + 1) > ids.slots.size()) {
+            std::vector<NameIndex::Slot> slots(std::max<size_t>(16, 2 * ids.slots.size()));
+            const auto mask = slots.size() - 1;
+
+            for (const auto& slot: ids.slots) {
+                if (slot.id == NO_NODE) continue;
+
+                auto next = slot.hash & mask;
+                while (slots[next].id != NO_NODE) next = (next + 1) & mask;
+                slots[next] = slot;
+            }
+            ids.slots.swap(slots);
+        }
+
+        const auto mask = ids.slots.size() - 1;
+        const auto hash = static_cast<uint32_t>(std::hash<std::string_view>()(name));
+
+        for (auto next = hash & mask;; next = (next + 1) & mask) {
+            auto& slot = ids.slots[next];
+
+            if (slot.id == NO_NODE) {
+                slot.id = static_cast<node_id>(names.size());
+                slot.hash = hash;
+                names.push_back(name);
+                return slot.id;
+            }
+            if (slot.hash == hash && names[slot.id] == name) {
+                return slot.id;
             }
         }
     }
 
     /**
-     * Loop over all dependencies and find the upstream node; Returns a pointer to the found node that references the dependency
+     * Look up the id for the given name without interning it; Returns NO_NODE for unknown names
      */
-    void _find_upstream_dependencies(const Dependency& needle, dependency_vec& dependencies, dependency_vec& found) {
-        for (auto dependency: dependencies) {
-            if (dependency.downstream == needle.name) {
-                found.push_back(dependency);
+    node_id find_name(const name_index& ids, const std::vector<std::string_view>& names, std::string_view name) {
+        if (ids.slots.empty()) return NO_NODE;
+
+        const auto mask = ids.slots.size() - 1;
+        const auto hash = static_cast<uint32_t>(std::hash<std::string_view>()(name));
+
+        for (auto next = hash & mask; ids.slots[next].id != NO_NODE; next = (next + 1) & mask) {
+            const auto& slot = ids.slots[next];
+            if (slot.hash == hash && names[slot.id] == name) {
+                return slot.id;
             }
         }
+
+        return NO_NODE;
     }
 
     /**
-     * Add leaf node, if no other dependencies require the given node
+     * Strip a trailing `[cost]` from the name; Brackets that do not hold a number stay part of the name
      */
-    bool _append_leaf_node(node_vec& startNodes, node_ptr node, const dependency_vec& dependencies, const Dependency& upstreamDependency) {
-        // Find a dependency that has the given dependency as a downstream
-        for (auto dependency: dependencies) {
-            // Is downstream to given dependency and has further downstreams
-            if (dependency.name == upstreamDependency.downstream && dependency.downstream != "") {
-                // No leaf added - return false
-                return false;
+    bool split_cost(std::string_view& name, double& cost) {
+        if (name.size() < 3 || name.back() != ']') return false;
+
+        auto open = name.rfind('[');
+        if (open == std::string_view::npos || open == 0) return false;
+
+        auto number = name.substr(open + 1, name.size() - open - 2);
+        while (!number.empty() && std::isspace(static_cast<unsigned char>(number.front()))) number.remove_prefix(1);
+        while (!number.empty() && std::isspace(static_cast<unsigned char>(number.back()))) number.remove_suffix(1);
+
+        double value;
+        auto result = std::from_chars(number.data(), number.data() + number.size(), value);
+        if (number.empty() || result.ec != std::errc() || result.ptr != number.data() + number.size()) return false;
+
+        if (!std::isfinite(value) || value < 0) {
+            throw Exception("Invalid cost for " + std::string(name));
+        }
+
+        auto stripped = name.substr(0, open);
+        while (!stripped.empty() && std::isspace(static_cast<unsigned char>(stripped.back()))) stripped.remove_suffix(1);
+        if (stripped.empty()) return false;
+
+        name = stripped;
+        cost = value;
+        return true;
+    }
+
+    /**
+     * Intern a name with an optional cost suffix; The last cost given for a name wins
+     */
+    node_id _intern_costed_name(name_index& ids, InternedDependencies& interned, std::string_view name) {
+        double cost;
+        bool hasCost = split_cost(name, cost);
+
+        auto id = intern_name(ids, interned.names, name);
+        if (interned.costs.size() < interned.names.size()) {
+            interned.costs.resize(interned.names.size(), NO_COST);
+        }
+        if (hasCost) {
+            interned.costs[id] = cost;
+        }
+
+        return id;
+    }
+
+    /**
+     * Replace all names with ids; Ids are assigned in order of first appearance
+     */
+    InternedDependencies intern_dependencies(const dependency_view_vec& dependencies) {
+        TRACE_SCOPE("intern_dependencies");
+        InternedDependencies interned;
+        name_index ids;
+        size_t lookups = 0;
+        interned.dependencies.reserve(dependencies.size());
+
+        for (const auto& dependency: dependencies) {
+            // Records without a name do not describe a node
+            if (dependency.name.empty()) continue;
+
+            auto name = _intern_costed_name(ids, interned, dependency.name);
+            auto downstream = dependency.downstream.empty() ? NO_NODE : _intern_costed_name(ids, interned, dependency.downstream);
+            interned.dependencies.push_back(IdDependency { name, downstream });
+            lookups += downstream == NO_NODE ? 1 : 2;
+        }
+
+        TRACE_COUNT(NodeLookups, lookups);
+
+        return interned;
+    }
+
+    /**
+     * Records of every node, grouped by one end of the record
+     */
+    struct _RecordIndex {
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> records;
+    };
+
+    /**
+     * Group the record numbers by their upstream or downstream node with a counting sort
+     */
+    void _index_records(const InternedDependencies& interned, bool downstream, _RecordIndex& index) {
+        const auto nodeCount = interned.names.size();
+        index.offsets.assign(nodeCount + 2, 0);
+
+        for (const auto& dependency: interned.dependencies) {
+            auto node = downstream ? dependency.downstream : dependency.name;
+            if (node != NO_NODE) index.offsets[node + 2]++;
+        }
+        for (size_t i = 2; i < index.offsets.size(); i++) {
+            index.offsets[i] += index.offsets[i - 1];
+        }
+
+        index.records.resize(index.offsets.back());
+        for (uint32_t i = 0; i < interned.dependencies.size(); i++) {
+            auto node = downstream ? interned.dependencies[i].downstream : interned.dependencies[i].name;
+            if (node != NO_NODE) index.records[index.offsets[node + 1]++] = i;
+        }
+        index.offsets.pop_back();
+    }
+
+    /**
+     * Mark the nodes within the given number of levels from the roots; Returns the marked nodes
+     */
+    id_vec _visit_levels(const InternedDependencies& interned, const _RecordIndex& index, bool downstream,
+        const id_vec& roots, uint32_t levels, std::vector<bool>& selected) {
+
+        id_vec visited(roots);
+        std::vector<bool> seen(interned.names.size(), false);
+        for (auto root: roots) {
+            seen[root] = true;
+        }
+
+        // Breadth first, one level at a time
+        size_t levelStart = 0;
+        for (uint32_t level = 0; level < levels && levelStart < visited.size(); level++) {
+            const auto levelEnd = visited.size();
+
+            for (auto i = levelStart; i < levelEnd; i++) {
+                const auto node = visited[i];
+                for (auto r = index.offsets[node]; r < index.offsets[node + 1]; r++) {
+                    const auto& dependency = interned.dependencies[index.records[r]];
+                    const auto next = downstream ? dependency.downstream : dependency.name;
+                    if (next == NO_NODE || seen[next]) continue;
+
+                    seen[next] = true;
+                    visited.push_back(next);
+                }
             }
+            levelStart = levelEnd;
         }
 
-        // If we reach this point, then there are no further dependencies for upstream dependency
-        // - add leaf node
+        TRACE_COUNT(EdgesVisited, visited.size());
+        for (auto node: visited) {
+            selected[node] = true;
+        }
+        return visited;
+    }
 
-        // Find the leaf node in the dag - make sure it has not been added before
-        node_ptr downstreamNode(nullptr);
-        _find_node(upstreamDependency.downstream, startNodes, &downstreamNode);
+    /**
+     * Keep only the neighbourhood of the focus roots. Apart from indexing the records once,
+     * the work is proportional to the records of the kept nodes. Ids are renumbered densely
+     * in their original order; Throws if a root does not exist
+     */
+    InternedDependencies focus_dependencies(const InternedDependencies& interned, const FocusOptions& focus) {
+        TRACE_SCOPE("focus_dependencies");
+        const auto nodeCount = interned.names.size();
 
-        if (downstreamNode == nullptr) {
-            downstreamNode = std::make_shared<DagNode>(upstreamDependency.downstream);
+        // A scan is cheaper than hashing every name for a handful of roots
+        id_vec roots(focus.roots.size(), NO_NODE);
+        for (node_id id = 0; id < nodeCount; id++) {
+            for (size_t i = 0; i < focus.roots.size(); i++) {
+                if (roots[i] == NO_NODE && interned.names[id] == focus.roots[i]) roots[i] = id;
+            }
+        }
+        for (size_t i = 0; i < focus.roots.size(); i++) {
+            if (roots[i] == NO_NODE) {
+                throw Exception("Unknown node " + focus.roots[i]);
+            }
         }
 
-        node->children.push_back(downstreamNode);
-        downstreamNode->ancestors.push_back(node);
+        _RecordIndex upstreamRecords, downstreamRecords;
+        _index_records(interned, false, upstreamRecords);
+        _index_records(interned, true, downstreamRecords);
 
-        // Leaf added - return true
-        return true;
+        std::vector<bool> selected(nodeCount, false);
+        auto kept = _visit_levels(interned, upstreamRecords, true, roots, focus.down, selected);
+        auto above = _visit_levels(interned, downstreamRecords, false, roots, focus.up, selected);
+        kept.insert(kept.end(), above.begin(), above.end());
+        std::sort(kept.begin(), kept.end());
+        kept.erase(std::unique(kept.begin(), kept.end()), kept.end());
+
+        // Records between kept nodes, in input order
+        std::vector<uint32_t> records;
+        for (auto node: kept) {
+            for (auto r = upstreamRecords.offsets[node]; r < upstreamRecords.offsets[node + 1]; r++) {
+                const auto downstream = interned.dependencies[upstreamRecords.records[r]].downstream;
+                if (downstream == NO_NODE || selected[downstream]) {
+                    records.push_back(upstreamRecords.records[r]);
+                }
+            }
+        }
+        std::sort(records.begin(), records.end());
+
+        id_vec newIds(nodeCount, NO_NODE);
+        InternedDependencies focused;
+        focused.names.reserve(kept.size());
+        for (auto node: kept) {
+            newIds[node] = static_cast<node_id>(focused.names.size());
+            focused.names.push_back(interned.names[node]);
+            if (node < interned.costs.size()) {
+                focused.costs.resize(focused.names.size(), NO_COST);
+                focused.costs.back() = interned.costs[node];
+            }
+        }
+
+        focused.dependencies.reserve(records.size());
+        std::vector<bool> mentioned(kept.size(), false);
+        for (auto record: records) {
+            const auto& dependency = interned.dependencies[record];
+            const auto downstream = dependency.downstream == NO_NODE ? NO_NODE : newIds[dependency.downstream];
+            focused.dependencies.push_back(IdDependency { newIds[dependency.name], downstream });
+            mentioned[newIds[dependency.name]] = true;
+            if (downstream != NO_NODE) mentioned[downstream] = true;
+        }
+
+        // Nodes whose only records lead outside the focus still appear
+        for (node_id id = 0; id < kept.size(); id++) {
+            if (!mentioned[id]) focused.dependencies.push_back(IdDependency { id, NO_NODE });
+        }
+
+        return focused;
     }
 
     /**
-     * Append direct child nodes to the current node
-     */ 
-    void _append_child_nodes(node_vec& startNodes, node_ptr parentNode, dependency_vec& dependencies) {
-        // Find all dependencies that have the current node as a parent
-        int i = 0;
-        for (auto dependency: dependencies) {
-            // Find upstream nodes that point to the current dependency
-            dependency_vec upstreams;
-            _find_upstream_dependencies(dependency, dependencies, upstreams);
-            bool leafAdded = false;
+     * Drop repeated edges and bare records of nodes that already had a record as upstream.
+     * The kept records stay in input order, so the graph comes out exactly as before. Sorted
+     * output is canonical: names are numbered alphabetically, records are ordered by name and
+     * only nodes without any edge keep a bare record
+     */
+    InternedDependencies canonicalize_dependencies(const InternedDependencies& interned, bool sorted) {
+        TRACE_SCOPE("canonicalize_dependencies");
+        const auto nodeCount = interned.names.size();
+        _EdgeSet seenEdges(interned.dependencies.size());
+        std::vector<bool> upstream(nodeCount, false);
+        std::vector<bool> connected(nodeCount, false);
 
-            if (dependency.name == parentNode->name && dependency.downstream != "") {
-                // Check if we need to add the current downstream as a leaf node 
-                leafAdded = _append_leaf_node(startNodes, parentNode, dependencies, dependency);
+        InternedDependencies canonical;
+        canonical.dependencies.reserve(interned.dependencies.size());
+        for (const auto& dependency: interned.dependencies) {
+            if (dependency.downstream == NO_NODE) {
+                if (upstream[dependency.name]) continue;
+            } else {
+                if (!seenEdges.insert(dependency.name, dependency.downstream)) continue;
+                connected[dependency.name] = true;
+                connected[dependency.downstream] = true;
             }
 
-            // Check if any of the upstreams points to the current node
-            bool hasMatchingUpstream = false;
-            for (auto upstream: upstreams) {
-                if (upstream.name == parentNode->name) {
-                    hasMatchingUpstream = true;
-                    break;
+            upstream[dependency.name] = true;
+            canonical.dependencies.push_back(dependency);
+        }
+        TRACE_COUNT(EdgesVisited, interned.dependencies.size());
+
+        if (!sorted) {
+            canonical.names = interned.names;
+            canonical.costs = interned.costs;
+            return canonical;
+        }
+
+        id_vec order(nodeCount);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](node_id a, node_id b) {
+            return interned.names[a] < interned.names[b];
+        });
+
+        id_vec newIds(nodeCount);
+        canonical.names.reserve(nodeCount);
+        for (node_id id = 0; id < nodeCount; id++) {
+            newIds[order[id]] = id;
+            canonical.names.push_back(interned.names[order[id]]);
+            if (order[id] < interned.costs.size()) {
+                canonical.costs.resize(id + 1, NO_COST);
+                canonical.costs[id] = interned.costs[order[id]];
+            }
+        }
+
+        // Bare records only matter for nodes that no edge mentions
+        auto kept = std::remove_if(canonical.dependencies.begin(), canonical.dependencies.end(), [&](IdDependency& dependency) {
+            if (dependency.downstream == NO_NODE && connected[dependency.name]) return true;
+            dependency.name = newIds[dependency.name];
+            if (dependency.downstream != NO_NODE) dependency.downstream = newIds[dependency.downstream];
+            return false;
+        });
+        canonical.dependencies.erase(kept, canonical.dependencies.end());
+        std::sort(canonical.dependencies.begin(), canonical.dependencies.end(), [](const IdDependency& a, const IdDependency& b) {
+            return a.name != b.name ? a.name < b.name : a.downstream < b.downstream;
+        });
+
+        return canonical;
+    }
+
+    /**
+     * Collect node facts and the unique edges in one pass over the dependencies
+     */
+    void _index_dependencies(const InternedDependencies& interned, _DependencyIndex& index) {
+        TRACE_SCOPE("_index_dependencies");
+        const auto nodeCount = interned.names.size();
+        _EdgeSet seenEdges(interned.dependencies.size());
+
+        index.firstRecord.assign(nodeCount, NO_RECORD);
+        index.hasDownstream.assign(nodeCount, false);
+        index.inDegree.assign(nodeCount, 0);
+
+        for (size_t i = 0; i < interned.dependencies.size(); i++) {
+            const auto& dependency = interned.dependencies[i];
+            auto from = dependency.name;
+
+            if (index.firstRecord[from] == NO_RECORD) {
+                index.firstRecord[from] = i;
+                index.upstreamOrder.push_back(from);
+            }
+
+            if (dependency.downstream == NO_NODE) continue;
+
+            auto to = dependency.downstream;
+            // Repeated edges are only connected once
+            if (!seenEdges.insert(from, to)) continue;
+
+            index.hasDownstream[from] = true;
+            index.inDegree[to]++;
+            index.edges.push_back(_IndexedEdge { from, to, i });
+        }
+    }
+
+    /**
+     * Copy the interned names into the graph's name table
+     */
+    void _append_names(const InternedDependencies& interned, Graph& graph) {
+        TRACE_SCOPE("_append_names");
+        size_t length = 0;
+        for (auto name: interned.names) {
+            length += name.size();
+        }
+
+        graph.nameData.reserve(length);
+        graph.nameOffsets.reserve(interned.names.size() + 1);
+
+        for (auto name: interned.names) {
+            graph.nameOffsets.push_back(static_cast<uint32_t>(graph.nameData.size()));
+            graph.nameData.insert(graph.nameData.end(), name.begin(), name.end());
+        }
+        graph.nameOffsets.push_back(static_cast<uint32_t>(graph.nameData.size()));
+    }
+
+    /**
+     * Resolve the cost of every node; Nodes without one take the default
+     */
+    void _append_costs(const InternedDependencies& interned, Graph& graph) {
+        graph.costs.assign(interned.names.size(), DEFAULT_COST);
+
+        for (size_t id = 0; id < interned.costs.size() && id < interned.names.size(); id++) {
+            if (interned.costs[id] != NO_COST) {
+                graph.costs[id] = interned.costs[id];
+            }
+        }
+    }
+
+    /**
+     * Point in a node's pass over the records at which the dependency walk connects an edge or
+     * descends into a child; Early leaves of a child come before the edge to it, which comes
+     * before the descent
+     */
+    struct _WalkEvent {
+        size_t record;
+        uint32_t kind;      // 0 early leaf, 1 edge, 2 descent
+        node_id from;
+        uint32_t target;    // Position in childIds, or the child to descend into
+    };
+
+    /**
+     * Fill the ancestor rows in the order the dependency walk connects the edges. A node's pass
+     * connects its own edges, the leaves its children reach before the walk descends into them,
+     * and descends into every child at its first record with further downstreams
+     */
+    void _append_ancestor_nodes(const _DependencyIndex& index, size_t recordCount, const std::vector<size_t>& firstBranch,
+        const std::vector<size_t>& childKeys, Graph& graph) {
+
+        TRACE_SCOPE("_append_ancestor_nodes");
+        const auto nodeCount = index.firstRecord.size();
+        const auto edgeCount = graph.childIds.size();
+        std::vector<bool> attached(edgeCount, false), expanded(nodeCount, false), leavesDone(nodeCount, false);
+        graph.ancestorIds.resize(edgeCount);
+        std::vector<uint32_t> ancestorFill(graph.ancestorOffsets.begin(), graph.ancestorOffsets.end() - 1);
+
+        auto attach = [&](uint32_t position, node_id from) {
+            if (!attached[position]) {
+                attached[position] = true;
+                graph.ancestorIds[ancestorFill[graph.childIds[position]]++] = from;
+            }
+        };
+
+        // Passes are nested, so their events share one buffer like a stack
+        struct Pass {
+            node_id node;
+            size_t first;
+            size_t next;
+        };
+        std::vector<_WalkEvent> events;
+        std::vector<Pass> stack;
+
+        auto enter = [&](node_id node) {
+            expanded[node] = true;
+            const auto first = events.size();
+            for (auto i = graph.childOffsets[node]; i < graph.childOffsets[node + 1]; i++) {
+                if (childKeys[i] >= recordCount) {
+                    events.push_back(_WalkEvent { childKeys[i] - recordCount, 1, node, i });
                 }
+
+                auto child = graph.childIds[i];
+                if (!index.hasDownstream[child]) continue;
+                if (firstBranch[child] != NO_RECORD && !expanded[child]) {
+                    events.push_back(_WalkEvent { firstBranch[child], 2, node, child });
+                }
+                // Early leaves sort first in the child's row
+                if (leavesDone[child]) continue;
+                for (auto j = graph.childOffsets[child]; j < graph.childOffsets[child + 1] && childKeys[j] < recordCount; j++) {
+                    events.push_back(_WalkEvent { childKeys[j], 0, child, j });
+                }
+            }
+            std::sort(events.begin() + first, events.end(), [](const _WalkEvent& a, const _WalkEvent& b) {
+                return a.record != b.record ? a.record < b.record : a.kind < b.kind;
+            });
+            stack.push_back(Pass { node, first, first });
+        };
+
+        for (auto start: graph.startNodes) {
+            enter(start);
+            while (!stack.empty()) {
+                auto& pass = stack.back();
+                if (pass.next == events.size()) {
+                    // All leaves of the children are connected by now
+                    for (auto child: graph.children(pass.node)) leavesDone[child] = true;
+                    events.resize(pass.first);
+                    stack.pop_back();
+                    continue;
+                }
+
+                auto event = events[pass.next++];
+                if (event.kind != 2) {
+                    attach(event.target, event.from);
+                } else if (!expanded[event.target]) {
+                    enter(event.target);
+                }
+            }
+        }
+
+        // Every edge of a dag is reached from a start node; This only guards the row sizes
+        for (node_id node = 0; node < nodeCount; node++) {
+            for (auto i = graph.childOffsets[node]; i < graph.childOffsets[node + 1]; i++) attach(i, node);
+        }
+    }
+
+    /**
+     * Connect all indexed edges; Children keep the order in which the dependency walk first reaches them,
+     * ancestors the order in which it connects them
+     */
+    void _append_child_nodes(_DependencyIndex& index, size_t recordCount, Graph& graph) {
+        TRACE_SCOPE("_append_child_nodes");
+        const auto nodeCount = index.firstRecord.size();
+
+        // The walk enters a child at its first record with further downstreams. Leaf records
+        // of that child which come earlier are attached before it, all others in walk order.
+        std::vector<size_t> firstBranch(nodeCount, NO_RECORD);
+        for (const auto& edge: index.edges) {
+            if (index.hasDownstream[edge.to] && firstBranch[edge.from] == NO_RECORD) {
+                firstBranch[edge.from] = edge.key;
             }
+        }
 
-            // Dependency has no ancestor - it's a root dependency
-            if (!hasMatchingUpstream) {
-                i++;
+        for (auto& edge: index.edges) {
+            if (index.hasDownstream[edge.to]) {
+                // Child with own downstreams is attached at its first record
+                edge.key = recordCount + index.firstRecord[edge.to];
+            } else if (index.inDegree[edge.from] && edge.key < firstBranch[edge.from]) {
+                // Leaf reached before the walk descends into the parent
                 continue;
+            } else {
+                edge.key = recordCount + std::min(edge.key, index.firstRecord[edge.to]);
             }
+        }
+
+        // Stable counting sort by key keeps the whole pass linear
+        std::vector<size_t> offsets(2 * recordCount + 1, 0);
+        for (const auto& edge: index.edges) {
+            offsets[edge.key + 1]++;
+        }
+        for (size_t i = 1; i < offsets.size(); i++) {
+            offsets[i] += offsets[i - 1];
+        }
+
+        std::vector<const _IndexedEdge*> sorted(index.edges.size());
+        for (const auto& edge: index.edges) {
+            sorted[offsets[edge.key]++] = &edge;
+        }
+
+        // Distribute the sorted edges into the forward and reverse rows
+        graph.childOffsets.assign(nodeCount + 1, 0);
+        graph.ancestorOffsets.assign(nodeCount + 1, 0);
+        for (const auto& edge: index.edges) {
+            graph.childOffsets[edge.from + 1]++;
+            graph.ancestorOffsets[edge.to + 1]++;
+        }
+        for (size_t i = 1; i <= nodeCount; i++) {
+            graph.childOffsets[i] += graph.childOffsets[i - 1];
+            graph.ancestorOffsets[i] += graph.ancestorOffsets[i - 1];
+        }
 
-            // Check if the current node has a child node for the given upstream yet
-            node_ptr childNode(nullptr);
-            _find_node(dependency.name, startNodes, &childNode);
+        TRACE_COUNT(EdgesVisited, index.edges.size());
+        graph.childIds.resize(index.edges.size());
+        std::vector<size_t> childKeys(index.edges.size());
+        std::vector<uint32_t> childFill(graph.childOffsets.begin(), graph.childOffsets.end() - 1);
 
-            if (childNode == nullptr) {
-                childNode = std::make_shared<DagNode>(dependency.name);
+        for (auto edge: sorted) {
+            childKeys[childFill[edge->from]] = edge->key;
+            graph.childIds[childFill[edge->from]++] = edge->to;
+        }
+
+        _append_ancestor_nodes(index, recordCount, firstBranch, childKeys, graph);
+    }
+
+    /**
+     * Find all start nodes in the graph and add then to the collection
+     */
+    void _append_start_nodes(const _DependencyIndex& index, Graph& graph) {
+        TRACE_SCOPE("_append_start_nodes");
+        // Every node that is not a child node is automatically a start node - in order of first appearance
+        for (auto id: index.upstreamOrder) {
+            if (index.inDegree[id] == 0) {
+                graph.startNodes.push_back(id);
             }
+        }
+    }
+
+    /**
+     * Compute the topological order, the layer of every node and the overall depth
+     */
+    void assign_layers(Graph& graph) {
+        TRACE_SCOPE("assign_layers");
+        const auto nodeCount = graph.size();
+        std::vector<uint32_t> pending(nodeCount);
+
+        graph.topologicalOrder.clear();
+        graph.topologicalOrder.reserve(nodeCount);
+        graph.layers.assign(nodeCount, 0);
+        graph.depth = 0;
+        TRACE_COUNT(EdgesVisited, graph.edge_count());
 
-            if (!leafAdded) {
-                leafAdded = _append_leaf_node(startNodes, childNode, dependencies, dependency);
+        // Kahn's algorithm - a node is ready once all its ancestors are placed
+        for (node_id id = 0; id < nodeCount; id++) {
+            pending[id] = static_cast<uint32_t>(graph.ancestors(id).size());
+            if (pending[id] == 0) {
+                graph.topologicalOrder.push_back(id);
             }
+        }
 
-            // Append new node to parent
-            parentNode->children.push_back(childNode);
-            childNode->ancestors.push_back(parentNode);
+        for (size_t i = 0; i < graph.topologicalOrder.size(); i++) {
+            auto node = graph.topologicalOrder[i];
+            graph.depth = std::max(graph.depth, graph.layers[node] + 1);
 
-            if (!leafAdded) {
-                // Other nodes are referencing the downstream dependency - enter recursion
-                _append_child_nodes(startNodes, childNode, dependencies);
+            // The layer is the longest path from any start node
+            for (auto child: graph.children(node)) {
+                graph.layers[child] = std::max(graph.layers[child], graph.layers[node] + 1);
+                if (--pending[child] == 0) {
+                    graph.topologicalOrder.push_back(child);
+                }
             }
+        }
+    }
+
+    /**
+     * Find the edges that are implied by longer paths. Reachability is computed with one bitset
+     * row per node over a block of target columns at a time, so memory stays within the budget.
+     * Columns are topological positions - only earlier nodes can reach a block
+     */
+    std::vector<bool> _find_redundant_edges(const Graph& graph, size_t maxBlockBytes) {
+        const auto nodeCount = graph.size();
+        std::vector<bool> redundant(graph.edge_count(), false);
+        if (nodeCount == 0) return redundant;
 
-            i++;
+        std::vector<uint32_t> position(nodeCount);
+        for (uint32_t i = 0; i < nodeCount; i++) {
+            position[graph.topologicalOrder[i]] = i;
         }
+
+        // Children by position, so every block reads the edges front to back
+        std::vector<uint32_t> childPositions;
+        std::vector<uint32_t> childOffsets(1, 0);
+        childPositions.reserve(graph.edge_count());
+        childOffsets.reserve(nodeCount + 1);
+        for (auto node: graph.topologicalOrder) {
+            for (auto child: graph.children(node)) {
+                childPositions.push_back(position[child]);
+            }
+            childOffsets.push_back(static_cast<uint32_t>(childPositions.size()));
+        }
+
+        const size_t blockWords = std::max<size_t>(1, std::min(maxBlockBytes / (nodeCount * sizeof(uint64_t)), (nodeCount + 63) / 64));
+        const size_t blockColumns = blockWords * 64;
+        std::vector<uint64_t> rows(nodeCount * blockWords);     // Strict descendants inside the block, by position
+        std::vector<uint32_t> firstWord(nodeCount);             // Words of a row outside [first, last) are zero
+        std::vector<uint32_t> lastWord(nodeCount);
+        std::vector<uint64_t> below(blockWords);                // Everything below the children of the current node
+
+        for (size_t first = 0; first < nodeCount; first += blockColumns) {
+            const auto last = std::min(nodeCount, first + blockColumns);
+            TRACE_COUNT(EdgesVisited, childOffsets[last]);
+
+            for (auto i = last; i-- > 0;) {
+                auto row = &rows[i * blockWords];
+                uint32_t low = static_cast<uint32_t>(blockWords);
+                uint32_t high = 0;
+
+                // Children behind the block cannot reach into it
+                for (auto edge = childOffsets[i]; edge < childOffsets[i + 1]; edge++) {
+                    const auto child = childPositions[edge];
+                    if (child >= last || firstWord[child] >= lastWord[child]) continue;
+
+                    if (low >= high) {
+                        std::fill(below.begin(), below.end(), 0);
+                    }
+                    low = std::min(low, firstWord[child]);
+                    high = std::max(high, lastWord[child]);
+
+                    const auto childRow = &rows[child * blockWords];
+                    for (auto word = firstWord[child]; word < lastWord[child]; word++) {
+                        below[word] |= childRow[word];
+                    }
+                }
+                if (low >= high) {
+                    std::fill(below.begin(), below.end(), 0);
+                }
+
+                // Widen the span to the direct children inside the block
+                for (auto edge = childOffsets[i]; edge < childOffsets[i + 1]; edge++) {
+                    const auto column = childPositions[edge];
+                    if (column < first || column >= last) continue;
+
+                    const auto word = static_cast<uint32_t>(column - first) / 64;
+                    low = std::min(low, word);
+                    high = std::max(high, word + 1);
+                }
+
+                if (low < high) {
+                    std::copy(below.begin() + low, below.begin() + high, row + low);
+                }
+                for (auto edge = childOffsets[i]; edge < childOffsets[i + 1]; edge++) {
+                    const auto column = childPositions[edge];
+                    if (column < first || column >= last) continue;
+
+                    const auto bit = column - first;
+                    if (below[bit / 64] >> (bit % 64) & 1) {
+                        // Another child already leads to this one
+                        redundant[graph.childOffsets[graph.topologicalOrder[i]] + edge - childOffsets[i]] = true;
+                    }
+                    row[bit / 64] |= uint64_t(1) << (bit % 64);
+                }
+
+                firstWord[i] = low;
+                lastWord[i] = high;
+            }
+        }
+
+        return redundant;
     }
 
     /**
-     * Find all start nodes in the graph and add then to the collection
+     * Remove every edge that is implied by a longer path; Keeps the order of the remaining
+     * children and ancestors. Layers and topological order stay valid, as a longest path
+     * never uses an implied edge. Returns the number of removed edges
      */
-    void _append_start_nodes(dependency_vec& dependencies, node_vec& startNodes) {
-        // 1. Every node that is not a child node is automatically a start node
-        int i = 0;
-        for (auto dependency: dependencies) {
-            dependency_vec upstreams;
-            _find_upstream_dependencies(dependency, dependencies, upstreams);
-            // Dependency has upstream nodes - it's not a start node 
-            if (upstreams.size()) {
-                i++;
-                continue;
+    size_t reduce_transitive(Graph& graph, size_t maxBlockBytes) {
+        TRACE_SCOPE("reduce_transitive");
+        const auto nodeCount = graph.size();
+        auto redundant = _find_redundant_edges(graph, maxBlockBytes);
+
+        // Group the removed edges by target, so every ancestor row can be filtered with one mark pass
+        std::vector<uint32_t> removedOffsets(nodeCount + 1, 0);
+        for (size_t edge = 0; edge < redundant.size(); edge++) {
+            if (redundant[edge]) removedOffsets[graph.childIds[edge] + 1]++;
+        }
+        for (size_t i = 1; i <= nodeCount; i++) {
+            removedOffsets[i] += removedOffsets[i - 1];
+        }
+
+        const size_t removed = removedOffsets[nodeCount];
+        if (removed == 0) return 0;
+
+        id_vec removedSources(removed);
+        std::vector<uint32_t> fill(removedOffsets.begin(), removedOffsets.end() - 1);
+        for (node_id node = 0; node < nodeCount; node++) {
+            for (auto edge = graph.childOffsets[node]; edge < graph.childOffsets[node + 1]; edge++) {
+                if (redundant[edge]) removedSources[fill[graph.childIds[edge]]++] = node;
+            }
+        }
+
+        // Compact both rows in place
+        uint32_t nextChild = 0;
+        for (node_id node = 0; node < nodeCount; node++) {
+            const auto first = graph.childOffsets[node];
+            graph.childOffsets[node] = nextChild;
+            for (auto edge = first; edge < graph.childOffsets[node + 1]; edge++) {
+                if (!redundant[edge]) graph.childIds[nextChild++] = graph.childIds[edge];
+            }
+        }
+        graph.childOffsets[nodeCount] = nextChild;
+        graph.childIds.resize(nextChild);
+
+        std::vector<node_id> marks(nodeCount, NO_NODE);
+        uint32_t nextAncestor = 0;
+        for (node_id node = 0; node < nodeCount; node++) {
+            for (auto i = removedOffsets[node]; i < removedOffsets[node + 1]; i++) {
+                marks[removedSources[i]] = node;
+            }
+
+            const auto first = graph.ancestorOffsets[node];
+            graph.ancestorOffsets[node] = nextAncestor;
+            for (auto edge = first; edge < graph.ancestorOffsets[node + 1]; edge++) {
+                const auto ancestor = graph.ancestorIds[edge];
+                if (marks[ancestor] != node) graph.ancestorIds[nextAncestor++] = ancestor;
+            }
+        }
+        graph.ancestorOffsets[nodeCount] = nextAncestor;
+        graph.ancestorIds.resize(nextAncestor);
+
+        return removed;
+    }
+
+    /**
+     * Build a forward adjacency over the indexed edges
+     */
+    void _index_adjacency(const _DependencyIndex& index, std::vector<uint32_t>& offsets, id_vec& targets) {
+        const auto nodeCount = index.firstRecord.size();
+
+        offsets.assign(nodeCount + 1, 0);
+        for (const auto& edge: index.edges) {
+            offsets[edge.from + 1]++;
+        }
+        for (size_t i = 1; i <= nodeCount; i++) {
+            offsets[i] += offsets[i - 1];
+        }
+
+        targets.resize(index.edges.size());
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (const auto& edge: index.edges) {
+            targets[fill[edge.from]++] = edge.to;
+        }
+    }
+
+    /**
+     * Iterative Tarjan pass; Stores the strongly connected component of every node and returns the component count
+     */
+    size_t _find_components(const std::vector<uint32_t>& offsets, const id_vec& targets, id_vec& component) {
+        TRACE_SCOPE("_find_components");
+        const auto nodeCount = offsets.size() - 1;
+        const node_id UNVISITED = NO_NODE;
+
+        id_vec order(nodeCount, UNVISITED);     // Discovery index
+        id_vec low(nodeCount, 0);
+        std::vector<bool> onStack(nodeCount, false);
+        id_vec stack;
+        std::vector<std::pair<node_id, uint32_t>> frames;   // Node and next edge to follow
+        node_id counter = 0;
+        size_t componentCount = 0;
+
+        component.assign(nodeCount, NO_NODE);
+        TRACE_COUNT(EdgesVisited, targets.size());
+
+        for (node_id root = 0; root < nodeCount; root++) {
+            if (order[root] != UNVISITED) continue;
+
+            frames.emplace_back(root, offsets[root]);
+            order[root] = low[root] = counter++;
+            stack.push_back(root);
+            onStack[root] = true;
+
+            while (!frames.empty()) {
+                auto& frame = frames.back();
+                auto node = frame.first;
+
+                if (frame.second < offsets[node + 1]) {
+                    auto next = targets[frame.second++];
+
+                    if (order[next] == UNVISITED) {
+                        // Descend into the unvisited child
+                        order[next] = low[next] = counter++;
+                        stack.push_back(next);
+                        onStack[next] = true;
+                        frames.emplace_back(next, offsets[next]);
+                    } else if (onStack[next]) {
+                        low[node] = std::min(low[node], order[next]);
+                    }
+                    continue;
+                }
+
+                // All children visited - close the component if the node is its root
+                frames.pop_back();
+                if (!frames.empty()) {
+                    auto parent = frames.back().first;
+                    low[parent] = std::min(low[parent], low[node]);
+                }
+
+                if (low[node] != order[node]) continue;
+
+                node_id member;
+                do {
+                    member = stack.back();
+                    stack.pop_back();
+                    onStack[member] = false;
+                    component[member] = static_cast<node_id>(componentCount);
+                } while (member != node);
+                componentCount++;
+            }
+        }
+
+        return componentCount;
+    }
+
+    /**
+     * Find one closed path through every cyclic component
+     */
+    std::vector<id_vec> _find_cycle_paths(const std::vector<uint32_t>& offsets, const id_vec& targets,
+        const id_vec& component, size_t componentCount) {
+
+        const auto nodeCount = offsets.size() - 1;
+        std::vector<bool> done(componentCount, false);
+        id_vec parent(nodeCount, NO_NODE);
+        std::vector<id_vec> cycles;
+        id_vec queue;
+
+        for (node_id root = 0; root < nodeCount; root++) {
+            auto rootComponent = component[root];
+            if (done[rootComponent]) continue;
+            done[rootComponent] = true;
+
+            // Breadth first search inside the component until an edge leads back to the root
+            queue.assign(1, root);
+            parent[root] = root;
+            node_id last = NO_NODE;
+
+            for (size_t head = 0; head < queue.size() && last == NO_NODE; head++) {
+                auto node = queue[head];
+
+                for (auto i = offsets[node]; i < offsets[node + 1]; i++) {
+                    auto next = targets[i];
+                    if (component[next] != rootComponent) continue;
+
+                    if (next == root) {
+                        last = node;
+                        break;
+                    }
+                    if (parent[next] == NO_NODE) {
+                        parent[next] = node;
+                        queue.push_back(next);
+                    }
+                }
+            }
+
+            // Singleton components without a self reference are acyclic
+            if (last == NO_NODE) continue;
+
+            id_vec path { root };
+            for (auto node = last; node != root; node = parent[node]) {
+                path.push_back(node);
             }
+            std::reverse(path.begin() + 1, path.end());
+            path.push_back(root);
+            cycles.push_back(path);
+        }
+
+        return cycles;
+    }
 
-            // We have two dependencies a>b and a>c - both qualify as start nodes. We only want to add one start node for 'a'
-            // Check if a start node with the same name exists, before adding a new one.
-            bool found = false;
-            for (auto node: startNodes) {
-                if (node->name == dependency.name) {
-                    found = true;
+    /**
+     * Replace every cyclic component with a single node; Super nodes are named after their members
+     */
+    InternedDependencies _condense_components(const InternedDependencies& interned, const id_vec& component,
+        size_t componentCount, std::deque<std::string>& superNames) {
+
+        InternedDependencies condensed;
+        id_vec componentIds(componentCount, NO_NODE);
+        std::vector<id_vec> members(componentCount);
+
+        for (node_id id = 0; id < component.size(); id++) {
+            members[component[id]].push_back(id);
+        }
+
+        // Components are numbered by their first member to keep the order of first appearance
+        id_vec ids(component.size());
+        for (node_id id = 0; id < component.size(); id++) {
+            auto& componentId = componentIds[component[id]];
+
+            if (componentId == NO_NODE) {
+                componentId = static_cast<node_id>(condensed.names.size());
+                const auto& group = members[component[id]];
+
+                auto memberCost = [&](node_id member) {
+                    return member < interned.costs.size() ? interned.costs[member] : NO_COST;
+                };
+
+                if (group.size() == 1) {
+                    condensed.names.push_back(interned.names[id]);
+                    condensed.costs.push_back(memberCost(id));
+                } else {
+                    // Merged nodes take as long as all their members together
+                    std::string name;
+                    double cost = 0;
+                    for (auto member: group) {
+                        name += (name.empty() ? "" : " | ") + std::string(interned.names[member]);
+                        cost += memberCost(member) == NO_COST ? DEFAULT_COST : memberCost(member);
+                    }
+                    superNames.push_back(name);
+                    condensed.names.push_back(superNames.back());
+                    condensed.costs.push_back(cost);
                 }
             }
 
-            // Start node already added - skip
-            if (found) continue;
-                
-            node_ptr startNode = std::make_shared<DagNode>(dependency.name);
-            startNodes.push_back(startNode);
+            ids[id] = componentId;
+        }
+
+        // Edges inside a component disappear, but the record still declares the node
+        condensed.dependencies.reserve(interned.dependencies.size());
+        for (const auto& dependency: interned.dependencies) {
+            auto name = ids[dependency.name];
+            auto downstream = dependency.downstream == NO_NODE ? NO_NODE : ids[dependency.downstream];
 
-            i++;
+            condensed.dependencies.push_back(IdDependency { name, downstream == name ? NO_NODE : downstream });
         }
+
+        return condensed;
     }
 
     /**
-     * Assign positions to child nodes
+     * Assemble the error message for the given cycles
      */
-    void _calculate_child_positions(node_ptr parentNode, int x, int y) {
-        // Update all child nodes
-        for (auto node: parentNode->children) {
-            if (node->x == -1) {
-                node->x = x;
-                node->y = y++;
+    std::string _format_cycles(const std::vector<std::vector<std::string>>& cycles) {
+        const size_t MAX_REPORTED_CYCLES = 10;
+        std::string message = "Circular dependencies found:";
+
+        for (size_t i = 0; i < cycles.size() && i < MAX_REPORTED_CYCLES; i++) {
+            message += "\n  ";
+            for (size_t j = 0; j < cycles[i].size(); j++) {
+                message += (j ? " > " : "") + cycles[i][j];
             }
+        }
 
-            //std::cout << "set " << node->name << " to " << node->x << "/" << node->y << std::endl;
-            _calculate_child_positions(node, x + 1, y);
+        if (cycles.size() > MAX_REPORTED_CYCLES) {
+            message += "\n  ... and " + std::to_string(cycles.size() - MAX_REPORTED_CYCLES) + " more";
         }
+
+        return message;
     }
 
     /**
-     * Assign x and y positions to dag nodes
+     * Collect the offending cycles as lists of names
      */
-    void _calculate_positions(node_vec& startNodes) {
-        // Iterate over the dag and compute the node indentations. 
-        // If the indentation is greater than before, update it.
-        int x = 0, y = 0;
+    CycleError::CycleError(const std::vector<std::vector<std::string>>& cycles)
+        : Exception(_format_cycles(cycles)), cycles(cycles) {
+    }
 
-        for (auto startNode: startNodes) {
-            startNode->x = x;
-            startNode->y = y;
+    const std::vector<std::vector<std::string>>& CycleError::getCycles() const {
+        return this->cycles;
+    }
 
-            // Assign coordinates for nodes
-            _calculate_child_positions(startNode, x + 1, y);
-            y++;
+    /**
+     * Cluster of a name: everything up to the given number of separators, followed by a wildcard.
+     * Names with fewer separators are their own cluster
+     */
+    std::string_view _cluster_prefix(std::string_view name, uint32_t depth, char separator) {
+        size_t end = 0;
+        for (uint32_t i = 0; i < depth; i++) {
+            end = name.find(separator, end);
+            if (end == std::string_view::npos) return name;
+            end++;
         }
+        return name.substr(0, end);
     }
 
     /**
-     * Relocate node if it has a downstream with greater x
+     * Intern the cluster of every node; Returns the cluster names
      */
-    void _shift_positions(node_vec& nodes) {
-        for (auto node: nodes) {
-            // Check all child nodes
-            for (auto child: node->children) {
-                if (child->x <= node->x) {
-                    child->x = node->x + 1;
+    std::vector<std::string_view> _assign_clusters(const Graph& graph, uint32_t depth, char separator, id_vec& clusters) {
+        name_index ids;
+        std::vector<std::string_view> prefixes;
+        clusters.resize(graph.size());
+
+        for (node_id node = 0; node < graph.size(); node++) {
+            clusters[node] = intern_name(ids, prefixes, _cluster_prefix(graph.name(node), depth, separator));
+        }
+        return prefixes;
+    }
+
+    /**
+     * Deepest prefix depth that still gives at most the maximum number of clusters; 0 if the
+     * graph is small enough already
+     */
+    uint32_t _choose_collapse_depth(const Graph& graph, const CollapseOptions& options) {
+        TRACE_SCOPE("_choose_collapse_depth");
+        if (graph.size() <= options.maxNodes) return 0;
+
+        id_vec clusters;
+        size_t previousCount = 0;
+        for (uint32_t depth = 1;; depth++) {
+            const auto count = _assign_clusters(graph, depth, options.separator, clusters).size();
+            if (depth > 1 && (count > options.maxNodes || count == previousCount)) {
+                // Clusters of single nodes would only repeat the graph
+                return previousCount < graph.size() ? depth - 1 : 0;
+            }
+            previousCount = count;
+        }
+    }
+
+    /**
+     * Replace every cluster by a single node and lay out only the clusters. Clusters that
+     * depend on each other in a cycle are merged. Keeps the full graph for drill downs
+     */
+    Graph _collapse_graph(Graph graph, uint32_t depth, const BuildOptions& options) {
+        TRACE_SCOPE("_collapse_graph");
+        id_vec clusters;
+        auto prefixes = _assign_clusters(graph, depth, options.collapse.separator, clusters);
+        const auto clusterCount = prefixes.size();
+
+        // Every cluster is declared in order, then every edge between two clusters once
+        std::deque<std::string> clusterNames;
+        InternedDependencies clustered;
+        clustered.costs.assign(clusterCount, 0);
+        for (node_id cluster = 0; cluster < clusterCount; cluster++) {
+            const auto prefix = prefixes[cluster];
+            if (!prefix.empty() && prefix.back() == options.collapse.separator) {
+                clusterNames.push_back(std::string(prefix) + "*");
+                clustered.names.push_back(clusterNames.back());
+            } else {
+                clustered.names.push_back(prefix);
+            }
+            clustered.dependencies.push_back(IdDependency { cluster, NO_NODE });
+        }
+
+        std::vector<uint64_t> pairs;
+        for (node_id node = 0; node < graph.size(); node++) {
+            clustered.costs[clusters[node]] += graph.costs[node];
+            for (auto child: graph.children(node)) {
+                if (clusters[node] != clusters[child]) {
+                    pairs.push_back(uint64_t(clusters[node]) << 32 | clusters[child]);
+                }
+            }
+        }
+        std::sort(pairs.begin(), pairs.end());
+        for (size_t i = 0; i < pairs.size(); i++) {
+            if (i == 0 || pairs[i] != pairs[i - 1]) {
+                clustered.dependencies.push_back(IdDependency { static_cast<node_id>(pairs[i] >> 32), static_cast<node_id>(pairs[i]) });
+            }
+        }
+
+        // Merge cycles between clusters; Merged nodes are numbered by their first cluster
+        _DependencyIndex index;
+        std::vector<uint32_t> offsets;
+        id_vec targets, component;
+        _index_dependencies(clustered, index);
+        _index_adjacency(index, offsets, targets);
+        auto componentCount = _find_components(offsets, targets, component);
+
+        id_vec finalIds(clusterCount);
+        if (componentCount < clusterCount) {
+            clustered = _condense_components(clustered, component, componentCount, clusterNames);
+
+            id_vec componentIds(componentCount, NO_NODE);
+            node_id next = 0;
+            for (node_id cluster = 0; cluster < clusterCount; cluster++) {
+                if (componentIds[component[cluster]] == NO_NODE) componentIds[component[cluster]] = next++;
+                finalIds[cluster] = componentIds[component[cluster]];
+            }
+        } else {
+            std::iota(finalIds.begin(), finalIds.end(), 0);
+        }
+
+        auto clusterOptions = options;
+        clusterOptions.collapse = CollapseOptions();
+        auto collapsed = build_graph(clustered, clusterOptions);
+
+        // Count the edges behind every collapsed edge
+        for (auto& cluster: clusters) {
+            cluster = finalIds[cluster];
+        }
+        pairs.clear();
+        for (node_id node = 0; node < graph.size(); node++) {
+            for (auto child: graph.children(node)) {
+                if (clusters[node] != clusters[child]) {
+                    pairs.push_back(uint64_t(clusters[node]) << 32 | clusters[child]);
                 }
+            }
+        }
+        std::sort(pairs.begin(), pairs.end());
 
-                _shift_positions(node->children);
+        collapsed.edgeWeights.resize(collapsed.edge_count());
+        for (node_id node = 0; node < collapsed.size(); node++) {
+            for (auto i = collapsed.childOffsets[node]; i < collapsed.childOffsets[node + 1]; i++) {
+                const auto key = uint64_t(node) << 32 | collapsed.childIds[i];
+                auto range = std::equal_range(pairs.begin(), pairs.end(), key);
+                collapsed.edgeWeights[i] = static_cast<uint32_t>(range.second - range.first);
             }
         }
+
+        collapsed.clusterSizes.assign(collapsed.size(), 0);
+        for (auto cluster: clusters) {
+            collapsed.clusterSizes[cluster]++;
+        }
+        collapsed.clusters = std::move(clusters);
+        collapsed.expanded = std::make_shared<const Graph>(std::move(graph));
+
+        return collapsed;
     }
 
     /**
-     * Construct dag from the given dependencies
-     */ 
-    void build_dag(dependency_vec& dependencies, node_vec& startNodes) {
-        // 1. Every node that is not a child node is automatically a start node
-        _append_start_nodes(dependencies, startNodes);
-        
-        // Construct dags for all start nodes
-        for (auto startNode: startNodes) {
-            // Pass in the current dag - add all nodes to the end nodes
-            // dag, current node, dependencies
-            _append_child_nodes(startNodes, startNode, dependencies);
+     * Build the graph induced by the given nodes with its own layers and layout
+     */
+    Graph extract_subgraph(const Graph& graph, const id_vec& nodes, const BuildOptions& options) {
+        TRACE_SCOPE("extract_subgraph");
+        id_vec ids(graph.size(), NO_NODE);
+        InternedDependencies extracted;
+
+        for (auto node: nodes) {
+            ids[node] = static_cast<node_id>(extracted.names.size());
+            extracted.names.push_back(graph.name(node));
+            extracted.costs.push_back(graph.costs[node]);
+            extracted.dependencies.push_back(IdDependency { ids[node], NO_NODE });
         }
+        for (auto node: nodes) {
+            for (auto child: graph.children(node)) {
+                if (ids[child] != NO_NODE) extracted.dependencies.push_back(IdDependency { ids[node], ids[child] });
+            }
+        }
+
+        return build_graph(extracted, options);
+    }
+
+    /**
+     * Construct the compressed dag from the given interned dependencies
+     */
+    Graph build_graph(const InternedDependencies& interned, const BuildOptions& options) {
+        TRACE_SCOPE("build_graph");
+        Graph graph;
+
+        if (!options.focus.roots.empty()) {
+            auto unfocused = options;
+            unfocused.focus.roots.clear();
+            return build_graph(focus_dependencies(interned, options.focus), unfocused);
+        }
+
+        // Collect edges in a single pass
+        _DependencyIndex index;
+        _index_dependencies(interned, index);
 
-        // TODO: Detect circular dependencies
         // 2. Every node that references an ancestor node is invalid
-        _calculate_positions(startNodes);
-        _shift_positions(startNodes);
+        std::vector<uint32_t> offsets;
+        id_vec targets, component;
+        _index_adjacency(index, offsets, targets);
+        auto componentCount = _find_components(offsets, targets, component);
+
+        auto cycles = _find_cycle_paths(offsets, targets, component, componentCount);
+        if (!cycles.empty()) {
+            if (!options.condenseCycles) {
+                std::vector<std::vector<std::string>> names;
+                for (const auto& cycle: cycles) {
+                    names.emplace_back();
+                    for (auto id: cycle) {
+                        names.back().emplace_back(interned.names[id]);
+                    }
+                }
+                throw CycleError(names);
+            }
+
+            // Build again with every cycle merged into a single node
+            std::deque<std::string> superNames;
+            return build_graph(_condense_components(interned, component, componentCount, superNames), options);
+        }
+
+        _append_names(interned, graph);
+        _append_costs(interned, graph);
+
+        // 1. Every node that is not a child node is automatically a start node
+        _append_start_nodes(index, graph);
+
+        // Connect all nodes to their children
+        _append_child_nodes(index, interned.dependencies.size(), graph);
+
+        assign_layers(graph);
+        if (options.reduce) {
+            graph.removedEdges = reduce_transitive(graph);
+        }
+
+        // Large graphs are only laid out as clusters
+        const auto& collapse = options.collapse;
+        const auto collapseDepth = collapse.automatic ? _choose_collapse_depth(graph, collapse) : collapse.depth;
+        if (collapseDepth > 0) {
+            return _collapse_graph(std::move(graph), collapseDepth, options);
+        }
+
+        layout_graph(graph, options.layout);
+
+        return graph;
+    }
+
+    /**
+     * Construct the compressed dag from the given dependencies
+     */
+    Graph build_graph(const dependency_view_vec& dependencies, const BuildOptions& options) {
+        return build_graph(intern_dependencies(dependencies), options);
+    }
+
+    /**
+     * Construct the compressed dag from the given owned dependencies
+     */
+    Graph build_graph(const dependency_vec& dependencies, const BuildOptions& options) {
+        dependency_view_vec views;
+        views.reserve(dependencies.size());
+
+        for (const auto& dependency: dependencies) {
+            views.push_back(DependencyView { dependency.name, dependency.downstream });
+        }
+
+        return build_graph(views, options);
+    }
+
+    /**
+     * Construct dag from the given dependencies; Replaces the handles in startNodes
+     */
+    void build_dag(dependency_vec& dependencies, node_vec& startNodes) {
+        TRACE_SCOPE("build_dag");
+        auto graph = build_graph(dependencies);
+        auto arena = std::make_shared<NodeArena>();
+
+        // The arena takes over the name bytes and mirrors the compressed rows, so the
+        // whole dag lives in three allocations no matter how many nodes and edges it has
+        arena->nameData = std::move(graph.nameData);
+        arena->nodes.resize(graph.size());
+        arena->edges.resize(2 * graph.edge_count());
+
+        auto& nodes = arena->nodes;
+        const auto ancestorStart = graph.edge_count();
+        for (node_id id = 0; id < graph.size(); id++) {
+            auto& node = nodes[id];
+            node.name = std::string_view(arena->nameData.data() + graph.nameOffsets[id], graph.nameOffsets[id + 1] - graph.nameOffsets[id]);
+            node.x = graph.x[id];
+            node.y = graph.y[id];
+            // Pointer arithmetic, since the last bound lies one past the edges
+            const auto edges = arena->edges.data();
+            node.children = NodeRange { edges + graph.childOffsets[id], edges + graph.childOffsets[id + 1] };
+            node.ancestors = NodeRange { edges + ancestorStart + graph.ancestorOffsets[id],
+                edges + ancestorStart + graph.ancestorOffsets[id + 1] };
+        }
+
+        for (size_t i = 0; i < graph.edge_count(); i++) {
+            arena->edges[i] = &nodes[graph.childIds[i]];
+            arena->edges[ancestorStart + i] = &nodes[graph.ancestorIds[i]];
+        }
+
+        startNodes.nodes.clear();
+        startNodes.nodes.reserve(graph.startNodes.size());
+        for (auto startNode: graph.startNodes) {
+            startNodes.push_back(&nodes[startNode]);
+        }
+        startNodes.arena = arena;
     }
 
     /**
@@ -312,6 +1452,33 @@ namespace dag {
         return accumulator.size();
     }
 
+    /**
+     * Count the number of nodes reachable from the start nodes of the compressed dag
+     */
+    size_t get_node_count(const Graph& graph) {
+        TRACE_SCOPE("get_node_count");
+        std::vector<bool> visited(graph.size(), false);
+        id_vec stack(graph.startNodes.begin(), graph.startNodes.end());
+        size_t count = 0;
+
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            if (visited[node]) continue;
+
+            visited[node] = true;
+            count++;
+
+            for (auto child: graph.children(node)) {
+                if (!visited[child]) {
+                    stack.push_back(child);
+                }
+            }
+        }
+
+        return count;
+    }
+
     /**
      * Recursively print node and its child nodes
      */
@@ -326,9 +1493,67 @@ namespace dag {
     /**
      * Print a text representation of the dag
      */
-    void print_nodes(node_vec nodes) {
+    void print_nodes(const node_vec& nodes) {
         for (auto node: nodes) {
             _print_child_nodes(node, 0);
         }
     }
+
+    /**
+     * Write the records as input lines; A cost is attached to the first mention of its name
+     */
+    void write_dependencies(const InternedDependencies& interned, std::ostream& stream) {
+        TRACE_SCOPE("write_dependencies");
+        std::vector<bool> written(interned.names.size(), false);
+
+        auto write_name = [&](node_id id) {
+            stream << interned.names[id];
+            if (written[id]) return;
+            written[id] = true;
+
+            if (id < interned.costs.size() && interned.costs[id] != NO_COST) {
+                // The shortest text that reads back as the same number
+                char number[32];
+                auto result = std::to_chars(number, number + sizeof(number), interned.costs[id]);
+                stream << '[' << std::string_view(number, result.ptr - number) << ']';
+            }
+        };
+
+        for (const auto& dependency: interned.dependencies) {
+            write_name(dependency.name);
+            if (dependency.downstream != NO_NODE) {
+                stream << '>';
+                write_name(dependency.downstream);
+            }
+            stream << '\n';
+        }
+    }
+
+    /**
+     * Print the compressed dag in the same format as the node tree; Shared nodes only list
+     * their children below the first parent that reaches them
+     */
+    void print_nodes(const Graph& graph, std::ostream& stream) {
+        std::vector<bool> printed(graph.size(), false);
+        std::vector<std::pair<node_id, uint32_t>> stack;   // Node and indentation
+
+        for (auto i = graph.startNodes.size(); i-- > 0;) {
+            stack.emplace_back(graph.startNodes[i], 0);
+        }
+
+        while (!stack.empty()) {
+            const auto [node, level] = stack.back();
+            stack.pop_back();
+
+            const auto children = graph.children(node);
+            stream << std::string(level, '\t') << graph.name(node) << "[" << children.size() << "]("
+                << graph.x[node] << "|" << graph.y[node] << ")\n";
+            if (printed[node]) continue;
+            printed[node] = true;
+
+            for (auto i = children.size(); i-- > 0;) {
+                stack.emplace_back(children[i], level + 1);
+            }
+        }
+    }
 }
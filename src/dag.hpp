@@ -1,36 +1,263 @@
 #ifndef DAG_HPP
 #define DAG_HPP
+#include <cstdint>
 #include <memory>
+#include <ostream>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
+#include "stdafx.hpp"
 
 namespace dag {
     struct DagNode;
+    struct NodeArena;
+    struct NodeList;
     struct Dependency;
-    typedef std::shared_ptr<DagNode> node_ptr;
-    typedef std::vector<node_ptr> node_vec;
+    struct DependencyView;
+    struct IdDependency;
+    struct Graph;
+    typedef DagNode* node_ptr;          // Non-owning handle; The NodeArena owns the node
+    typedef NodeList node_vec;
     typedef std::vector<Dependency> dependency_vec;
+    typedef std::vector<DependencyView> dependency_view_vec;
+    typedef uint32_t node_id;
+    typedef std::vector<node_id> id_vec;
+
+    const node_id NO_NODE = static_cast<node_id>(-1);
+    const double NO_COST = -1;          // The input gave no cost for the node
+    const double DEFAULT_COST = 1;
+    const size_t MAX_REDUCTION_BYTES = size_t(64) << 20;     // Reachability rows kept at once by the transitive reduction
+
+    /**
+     * Open addressing table from names to ids; The names themselves stay in the caller's name list
+     */
+    struct NameIndex {
+        struct Slot {
+            node_id id = NO_NODE;
+            uint32_t hash = 0;
+        };
+        std::vector<Slot> slots;
+    };
+    typedef NameIndex name_index;
 
     struct Dependency {
         std::string name;
         std::string downstream;
     };
 
+    /**
+     * Dependency whose names point into an input buffer owned by the caller
+     */
+    struct DependencyView {
+        std::string_view name;
+        std::string_view downstream;
+    };
+
+    /**
+     * Dependency between two interned names; downstream is NO_NODE for a bare node
+     */
+    struct IdDependency {
+        node_id name;
+        node_id downstream;
+    };
+
+    /**
+     * Dependencies with all names replaced by ids; The names point into the caller's input
+     */
+    struct InternedDependencies {
+        std::vector<std::string_view> names;
+        std::vector<IdDependency> dependencies;
+        std::vector<double> costs;      // Cost from a `name[cost]` suffix per name or NO_COST; May be empty
+    };
+
+    /**
+     * Contiguous slice of node handles inside a NodeArena
+     */
+    struct NodeRange {
+        const node_ptr* first = nullptr;
+        const node_ptr* last = nullptr;
+
+        const node_ptr* begin() const { return first; }
+        const node_ptr* end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+        node_ptr operator[](size_t i) const { return first[i]; }
+    };
+
     struct DagNode {
-        std::string name;
-        node_vec ancestors;
-        node_vec children;
-        int x;
-        int y;
+        std::string_view name;      // Points into the arena's name bytes
+        NodeRange ancestors;
+        NodeRange children;
+        int x = -1;
+        int y = -1;
+    };
+
+    /**
+     * Owns all nodes, names and edge lists of a materialized dag; Freed in one shot
+     */
+    struct NodeArena {
+        std::vector<char> nameData;
+        std::vector<DagNode> nodes;
+        std::vector<node_ptr> edges;        // Children of all nodes followed by their ancestors
+    };
+
+    /**
+     * Handles to start nodes; Keeps the arena alive as long as any copy of the list exists
+     */
+    struct NodeList {
+        std::shared_ptr<const NodeArena> arena;
+        std::vector<node_ptr> nodes;
+
+        std::vector<node_ptr>::const_iterator begin() const { return nodes.begin(); }
+        std::vector<node_ptr>::const_iterator end() const { return nodes.end(); }
+        size_t size() const { return nodes.size(); }
+        bool empty() const { return nodes.empty(); }
+        node_ptr operator[](size_t i) const { return nodes[i]; }
+        void push_back(node_ptr node) { nodes.push_back(node); }
+
+        operator NodeRange() const { return NodeRange { nodes.data(), nodes.data() + nodes.size() }; }
+    };
+
+    /**
+     * Contiguous slice of node ids inside a graph
+     */
+    struct IdRange {
+        const node_id* first;
+        const node_id* last;
+
+        const node_id* begin() const { return first; }
+        const node_id* end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+        node_id operator[](size_t i) const { return first[i]; }
+    };
+
+    /**
+     * Algorithm that assigns node positions
+     */
+    enum class LayoutEngine {
+        Tree,           // Depth first rows, columns by layer
+        Layered         // Sugiyama style layers with crossing reduction
+    };
+
+    /**
+     * Settings for the layout pass
+     */
+    struct LayoutOptions {
+        LayoutEngine engine = LayoutEngine::Tree;
+        unsigned maxSweeps = 24;            // Crossing reduction sweeps
+        unsigned timeBudgetMs = 2000;       // Stop crossing reduction after this time
+    };
+
+    /**
+     * Neighbourhood of a few nodes; An empty root list keeps the whole graph
+     */
+    struct FocusOptions {
+        std::vector<std::string> roots;
+        uint32_t up = 1;                // Levels of ancestors to keep
+        uint32_t down = 1;              // Levels of descendants to keep
+    };
+
+    /**
+     * Grouping of nodes by name prefix before layout
+     */
+    struct CollapseOptions {
+        uint32_t depth = 0;             // Name segments that form a cluster; 0 keeps every node
+        bool automatic = false;         // Choose the deepest depth with at most maxNodes clusters
+        uint32_t maxNodes = 500;
+        char separator = '/';
+    };
+
+    /**
+     * Settings for constructing a graph
+     */
+    struct BuildOptions {
+        bool condenseCycles = false;    // Merge every cycle into a single node instead of failing
+        bool reduce = false;            // Drop edges that are implied by longer paths
+        FocusOptions focus;
+        CollapseOptions collapse;
+        LayoutOptions layout;
+    };
+
+    /**
+     * Raised when the dependencies contain cycles; Each cycle starts and ends with the same name
+     */
+    class CycleError : public Exception {
+        protected:
+        std::vector<std::vector<std::string>> cycles;
+
+        public:
+        CycleError(const std::vector<std::vector<std::string>>& cycles);
+
+        const std::vector<std::vector<std::string>>& getCycles() const;
+    };
+
+    /**
+     * View over all ids of the given list
+     */
+    inline IdRange make_range(const id_vec& ids) {
+        return IdRange { ids.data(), ids.data() + ids.size() };
+    }
+
+    /**
+     * Compressed sparse row dag; Nodes are addressed by 32 bit ids
+     */
+    struct Graph {
+        std::vector<char> nameData;             // All names, back to back
+        std::vector<uint32_t> nameOffsets;      // Start of each name in nameData; size() + 1 entries
+        std::vector<uint32_t> childOffsets;     // Start of each node's children in childIds; size() + 1 entries
+        id_vec childIds;
+        std::vector<uint32_t> ancestorOffsets;  // Start of each node's ancestors in ancestorIds; size() + 1 entries
+        id_vec ancestorIds;
+        std::vector<double> costs;              // Duration of every node for the critical path
+        id_vec startNodes;
+        id_vec topologicalOrder;
+        std::vector<uint32_t> layers;           // Longest path from any start node
+        uint32_t depth = 0;                     // Number of layers
+        size_t removedEdges = 0;                // Edges dropped by the transitive reduction
+        std::vector<uint32_t> edgeWeights;      // Collapsed edges per edge, indexed like childIds; Empty unless collapsed
+        std::vector<uint32_t> clusterSizes;     // Collapsed nodes per node; Empty unless collapsed
+        std::shared_ptr<const Graph> expanded;  // Graph before collapsing
+        id_vec clusters;                        // Node of every expanded node
+        std::vector<int> x;
+        std::vector<int> y;
+
+        size_t size() const { return childOffsets.empty() ? 0 : childOffsets.size() - 1; }
+        size_t edge_count() const { return childIds.size(); }
+
+        std::string_view name(node_id id) const {
+            return std::string_view(nameData.data() + nameOffsets[id], nameOffsets[id + 1] - nameOffsets[id]);
+        }
+
+        IdRange children(node_id id) const {
+            return IdRange { childIds.data() + childOffsets[id], childIds.data() + childOffsets[id + 1] };
+        }
 
-        DagNode(const std::string& name);
+        IdRange ancestors(node_id id) const {
+            return IdRange { ancestorIds.data() + ancestorOffsets[id], ancestorIds.data() + ancestorOffsets[id + 1] };
+        }
     };
 
     Dependency convert_dependency(const std::string& line);
     std::vector<Dependency> convert_dependencies(const std::vector<std::string>& lines);
+    node_id intern_name(name_index& ids, std::vector<std::string_view>& names, std::string_view name);
+    node_id find_name(const name_index& ids, const std::vector<std::string_view>& names, std::string_view name);
+    bool split_cost(std::string_view& name, double& cost);
+    InternedDependencies intern_dependencies(const dependency_view_vec& dependencies);
+    InternedDependencies canonicalize_dependencies(const InternedDependencies& interned, bool sorted = false);
+    InternedDependencies focus_dependencies(const InternedDependencies& interned, const FocusOptions& focus);
+    Graph build_graph(const dependency_vec& dependencies, const BuildOptions& options = BuildOptions());
+    Graph build_graph(const dependency_view_vec& dependencies, const BuildOptions& options = BuildOptions());
+    Graph build_graph(const InternedDependencies& interned, const BuildOptions& options = BuildOptions());
+    Graph extract_subgraph(const Graph& graph, const id_vec& nodes, const BuildOptions& options = BuildOptions());
+    void assign_layers(Graph& graph);
+    size_t reduce_transitive(Graph& graph, size_t maxBlockBytes = MAX_REDUCTION_BYTES);
     void build_dag(dependency_vec& dependencies, node_vec& startNodes);
     size_t get_node_count(const node_vec& startNodes);
-    void print_nodes(node_vec nodes);
+    size_t get_node_count(const Graph& graph);
+    void print_nodes(const node_vec& nodes);
+    void print_nodes(const Graph& graph, std::ostream& stream);
+    void write_dependencies(const InternedDependencies& interned, std::ostream& stream);
 }
-#endif
\ No newline at end of file
+#endif
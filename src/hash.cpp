@@ -0,0 +1,42 @@
+#include <cstring>
+#include "hash.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    const uint64_t HASH_MULTIPLIER = 0x9e3779b97f4a7c15;
+
+    /**
+     * Mix one word into a hash lane
+     */
+    inline uint64_t _mix(uint64_t lane, uint64_t word) {
+        lane = (lane ^ word) * HASH_MULTIPLIER;
+        return lane ^ (lane >> 29);
+    }
+
+    /**
+     * Fast 64 bit hash for checksums and cache keys, not for untrusted input; Four
+     * independent lanes keep the multipliers busy. Different seeds give unrelated hashes
+     */
+    uint64_t hash_bytes(std::string_view data, uint64_t seed) {
+        TRACE_SCOPE("hash_bytes");
+        uint64_t lanes[4] = { seed ^ 1, seed ^ 2, seed ^ 3, seed ^ 4 };
+        const auto blocks = data.size() / 32;
+
+        for (size_t block = 0; block < blocks; block++) {
+            uint64_t words[4];
+            std::memcpy(words, data.data() + block * 32, sizeof(words));
+            for (int i = 0; i < 4; i++) {
+                lanes[i] = _mix(lanes[i], words[i]);
+            }
+        }
+
+        uint64_t hash = data.size() ^ seed;
+        for (auto lane: lanes) {
+            hash = _mix(hash, lane);
+        }
+        for (size_t i = blocks * 32; i < data.size(); i++) {
+            hash = _mix(hash, static_cast<unsigned char>(data[i]));
+        }
+        return hash;
+    }
+}
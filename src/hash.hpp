@@ -0,0 +1,9 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+#include <cstdint>
+#include <string_view>
+
+namespace dag {
+    uint64_t hash_bytes(std::string_view data, uint64_t seed = 0);
+}
+#endif
@@ -0,0 +1,447 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "incremental.hpp"
+#include "input.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    /**
+     * Take over the names, edges, order and layers of a built graph; Rows are numbered per
+     * layer in topological order
+     */
+    IncrementalGraph::IncrementalGraph(const Graph& graph) {
+        TRACE_SCOPE("build_incremental_graph");
+        const auto size = static_cast<node_id>(graph.size());
+
+        for (node_id node = 0; node < size; node++) {
+            this->nameStorage.emplace_back(graph.name(node));
+            intern_name(this->ids, this->names, this->nameStorage.back());
+            this->childLists.emplace_back(graph.children(node).begin(), graph.children(node).end());
+            this->ancestorLists.emplace_back(graph.ancestors(node).begin(), graph.ancestors(node).end());
+        }
+
+        this->costs = graph.costs;
+        this->removed.assign(size, false);
+        this->nodeCount = size;
+        this->edgeCount = graph.edge_count();
+        this->order = graph.topologicalOrder;
+        this->positions.resize(size);
+        for (uint32_t i = 0; i < size; i++) {
+            this->positions[this->order[i]] = i;
+        }
+
+        this->layers = graph.layers;
+        this->rows.resize(size);
+        this->columns.resize(graph.depth);
+        for (auto node: this->order) {
+            this->rows[node] = this->take_row(this->layers[node]);
+        }
+        this->visited.assign(size, 0);
+    }
+
+    node_id IncrementalGraph::find(std::string_view name) const {
+        auto id = find_name(this->ids, this->names, name);
+        return this->contains(id) ? id : NO_NODE;
+    }
+
+    bool IncrementalGraph::contains_edge(node_id from, node_id to) const {
+        const auto& children = this->childLists[from];
+        return std::find(children.begin(), children.end(), to) != children.end();
+    }
+
+    /**
+     * Start a new search; Clears the visited marks when the counter wraps
+     */
+    uint32_t IncrementalGraph::next_epoch() const {
+        if (++this->epoch == 0) {
+            std::fill(this->visited.begin(), this->visited.end(), 0);
+            this->epoch = 1;
+        }
+        return this->epoch;
+    }
+
+    /**
+     * Lowest free row of the layer
+     */
+    uint32_t IncrementalGraph::take_row(uint32_t layer) {
+        if (layer >= this->columns.size()) {
+            this->columns.resize(layer + 1);
+        }
+
+        auto& column = this->columns[layer];
+        if (column.free.empty()) {
+            return column.next++;
+        }
+
+        auto row = column.free.top();
+        column.free.pop();
+        return row;
+    }
+
+    void IncrementalGraph::release_row(uint32_t layer, uint32_t row) {
+        this->columns[layer].free.push(row);
+    }
+
+    /**
+     * Add a node without edges at the end of the topological order; Revives removed nodes.
+     * Returns the existing id if the node is present
+     */
+    node_id IncrementalGraph::add_node(std::string_view name, id_vec* moved) {
+        auto id = find_name(this->ids, this->names, name);
+        if (this->contains(id)) return id;
+
+        if (id == NO_NODE) {
+            this->nameStorage.emplace_back(name);
+            id = intern_name(this->ids, this->names, this->nameStorage.back());
+            this->childLists.emplace_back();
+            this->ancestorLists.emplace_back();
+            this->costs.push_back(DEFAULT_COST);
+            this->removed.push_back(false);
+            this->positions.push_back(static_cast<uint32_t>(this->order.size()));
+            this->order.push_back(id);
+            this->layers.push_back(0);
+            this->rows.push_back(0);
+            this->visited.push_back(0);
+        }
+
+        // A node without edges may stay at any position, also the one it had before
+        this->removed[id] = false;
+        this->nodeCount++;
+        this->layers[id] = 0;
+        this->rows[id] = this->take_row(0);
+        if (moved) moved->push_back(id);
+
+        return id;
+    }
+
+    /**
+     * Pearce-Kelly reordering for a new edge against the order. Only nodes between the two
+     * positions are searched: the descendants of the target and the ancestors of the source
+     * swap places, keeping their relative order. Throws if the target reaches the source
+     */
+    void IncrementalGraph::reorder(node_id from, node_id to) {
+        const auto lower = this->positions[to];
+        const auto upper = this->positions[from];
+        id_vec forward, backward, stack;
+        std::unordered_map<node_id, node_id> parents;
+
+        const auto forwardMark = this->next_epoch();
+        this->visited[to] = forwardMark;
+        stack.push_back(to);
+        while (!stack.empty()) {
+            const auto node = stack.back();
+            stack.pop_back();
+            forward.push_back(node);
+
+            for (auto child: this->childLists[node]) {
+                if (child == from) {
+                    // Report the cycle that the edge would close
+                    std::vector<std::string> cycle { std::string(this->names[from]) };
+                    id_vec path { node };
+                    while (path.back() != to) path.push_back(parents[path.back()]);
+                    for (auto i = path.size(); i-- > 0;) cycle.emplace_back(this->names[path[i]]);
+                    cycle.emplace_back(this->names[from]);
+                    throw CycleError({ cycle });
+                }
+                if (this->visited[child] == forwardMark || this->positions[child] > upper) continue;
+
+                this->visited[child] = forwardMark;
+                parents[child] = node;
+                stack.push_back(child);
+            }
+        }
+
+        const auto backwardMark = this->next_epoch();
+        this->visited[from] = backwardMark;
+        stack.push_back(from);
+        while (!stack.empty()) {
+            const auto node = stack.back();
+            stack.pop_back();
+            backward.push_back(node);
+
+            for (auto ancestor: this->ancestorLists[node]) {
+                if (this->visited[ancestor] == backwardMark || this->positions[ancestor] < lower) continue;
+
+                this->visited[ancestor] = backwardMark;
+                stack.push_back(ancestor);
+            }
+        }
+        TRACE_COUNT(EdgesVisited, forward.size() + backward.size());
+
+        // The ancestors take the lowest of the freed positions, the descendants the rest
+        auto byPosition = [&](node_id a, node_id b) {
+            return this->positions[a] < this->positions[b];
+        };
+        std::sort(forward.begin(), forward.end(), byPosition);
+        std::sort(backward.begin(), backward.end(), byPosition);
+
+        std::vector<uint32_t> freed;
+        for (auto node: backward) freed.push_back(this->positions[node]);
+        for (auto node: forward) freed.push_back(this->positions[node]);
+        std::sort(freed.begin(), freed.end());
+
+        size_t next = 0;
+        for (auto node: backward) {
+            this->positions[node] = freed[next];
+            this->order[freed[next++]] = node;
+        }
+        for (auto node: forward) {
+            this->positions[node] = freed[next];
+            this->order[freed[next++]] = node;
+        }
+    }
+
+    /**
+     * Recompute the layers below the given nodes in topological order; Every node is visited
+     * once, and only the children of nodes whose layer changed. Returns the moved nodes
+     */
+    id_vec IncrementalGraph::update_layers(const id_vec& seeds) {
+        id_vec moved;
+        auto later = [&](node_id a, node_id b) {
+            return this->positions[a] > this->positions[b];
+        };
+        std::priority_queue<node_id, id_vec, decltype(later)> pending(later);
+
+        const auto mark = this->next_epoch();
+        for (auto seed: seeds) {
+            if (this->visited[seed] == mark || this->removed[seed]) continue;
+            this->visited[seed] = mark;
+            pending.push(seed);
+        }
+
+        while (!pending.empty()) {
+            const auto node = pending.top();
+            pending.pop();
+
+            uint32_t layer = 0;
+            for (auto ancestor: this->ancestorLists[node]) {
+                layer = std::max(layer, this->layers[ancestor] + 1);
+            }
+            if (layer == this->layers[node]) continue;
+
+            // Keep the row of every other node; The moved node takes the lowest free row
+            this->release_row(this->layers[node], this->rows[node]);
+            this->layers[node] = layer;
+            this->rows[node] = this->take_row(layer);
+            moved.push_back(node);
+
+            for (auto child: this->childLists[node]) {
+                if (this->visited[child] == mark) continue;
+                this->visited[child] = mark;
+                pending.push(child);
+            }
+        }
+
+        return moved;
+    }
+
+    /**
+     * Connect two nodes, adding them if needed; Throws a CycleError and leaves the graph as
+     * it was if the edge would close a cycle
+     */
+    id_vec IncrementalGraph::add_edge(std::string_view from, std::string_view to) {
+        TRACE_SCOPE("add_edge");
+        if (from == to) {
+            throw CycleError({ { std::string(from), std::string(to) } });
+        }
+
+        auto fromId = this->find(from);
+        auto toId = this->find(to);
+        // The new edge may require a new order before anything changes
+        if (fromId != NO_NODE && toId != NO_NODE) {
+            if (this->contains_edge(fromId, toId)) return {};
+            if (this->positions[fromId] > this->positions[toId]) {
+                this->reorder(fromId, toId);
+            }
+        }
+
+        id_vec moved;
+        fromId = this->add_node(from, &moved);
+        toId = this->add_node(to, &moved);
+        if (this->positions[fromId] > this->positions[toId]) {
+            this->reorder(fromId, toId);
+        }
+
+        this->childLists[fromId].push_back(toId);
+        this->ancestorLists[toId].push_back(fromId);
+        this->edgeCount++;
+
+        // A new target may move again right away
+        for (auto node: this->update_layers({ toId })) {
+            if (std::find(moved.begin(), moved.end(), node) == moved.end()) moved.push_back(node);
+        }
+        return moved;
+    }
+
+    /**
+     * Disconnect two nodes; Nothing happens if they are not connected
+     */
+    id_vec IncrementalGraph::remove_edge(std::string_view from, std::string_view to) {
+        TRACE_SCOPE("remove_edge");
+        auto fromId = this->find(from);
+        auto toId = this->find(to);
+        if (fromId == NO_NODE || toId == NO_NODE || !this->contains_edge(fromId, toId)) return {};
+
+        auto& children = this->childLists[fromId];
+        children.erase(std::find(children.begin(), children.end(), toId));
+        auto& ancestors = this->ancestorLists[toId];
+        ancestors.erase(std::find(ancestors.begin(), ancestors.end(), fromId));
+        this->edgeCount--;
+
+        // The order stays valid with fewer edges
+        return this->update_layers({ toId });
+    }
+
+    /**
+     * Remove a node with all its edges; Its children may move to lower layers
+     */
+    id_vec IncrementalGraph::remove_node(std::string_view name) {
+        TRACE_SCOPE("remove_node");
+        auto id = this->find(name);
+        if (id == NO_NODE) return {};
+
+        for (auto child: this->childLists[id]) {
+            auto& ancestors = this->ancestorLists[child];
+            ancestors.erase(std::find(ancestors.begin(), ancestors.end(), id));
+        }
+        for (auto ancestor: this->ancestorLists[id]) {
+            auto& children = this->childLists[ancestor];
+            children.erase(std::find(children.begin(), children.end(), id));
+        }
+
+        this->edgeCount -= this->childLists[id].size() + this->ancestorLists[id].size();
+        this->ancestorLists[id].clear();
+        auto seeds = std::move(this->childLists[id]);
+        this->childLists[id].clear();
+
+        this->removed[id] = true;
+        this->nodeCount--;
+        this->release_row(this->layers[id], this->rows[id]);
+
+        return this->update_layers(seeds);
+    }
+
+    /**
+     * Snapshot of the present nodes as a compressed graph; Positions are the layers and rows
+     */
+    Graph IncrementalGraph::to_graph() const {
+        TRACE_SCOPE("to_graph");
+        Graph graph;
+        id_vec newIds(this->names.size(), NO_NODE);
+        id_vec oldIds;
+
+        for (node_id node = 0; node < this->names.size(); node++) {
+            if (this->removed[node]) continue;
+            newIds[node] = static_cast<node_id>(oldIds.size());
+            oldIds.push_back(node);
+        }
+
+        graph.nameOffsets.push_back(0);
+        graph.childOffsets.push_back(0);
+        graph.ancestorOffsets.push_back(0);
+        for (auto node: oldIds) {
+            const auto name = this->names[node];
+            graph.nameData.insert(graph.nameData.end(), name.begin(), name.end());
+            graph.nameOffsets.push_back(static_cast<uint32_t>(graph.nameData.size()));
+
+            for (auto child: this->childLists[node]) graph.childIds.push_back(newIds[child]);
+            graph.childOffsets.push_back(static_cast<uint32_t>(graph.childIds.size()));
+            for (auto ancestor: this->ancestorLists[node]) graph.ancestorIds.push_back(newIds[ancestor]);
+            graph.ancestorOffsets.push_back(static_cast<uint32_t>(graph.ancestorIds.size()));
+
+            if (this->ancestorLists[node].empty()) graph.startNodes.push_back(newIds[node]);
+            graph.costs.push_back(this->costs[node]);
+            graph.layers.push_back(this->layers[node]);
+            graph.depth = std::max(graph.depth, this->layers[node] + 1);
+            graph.x.push_back(static_cast<int>(this->layers[node]));
+            graph.y.push_back(static_cast<int>(this->rows[node]));
+        }
+
+        for (auto node: this->order) {
+            if (!this->removed[node]) graph.topologicalOrder.push_back(newIds[node]);
+        }
+
+        return graph;
+    }
+
+    /**
+     * Bring the graph in line with a new version of the dependency text. Records are counted,
+     * so a dependency disappears with its last line. New edges that would close a cycle are
+     * reported and skipped
+     */
+    WatchSummary apply_dependencies(IncrementalGraph& graph, WatchRecords& records, std::string_view text,
+        std::ostream& errors) {
+
+        TRACE_SCOPE("apply_dependencies");
+        auto interned = parse_dependencies(text);
+        WatchRecords next;
+        for (const auto& dependency: interned.dependencies) {
+            next.nodes[std::string(interned.names[dependency.name])]++;
+            if (dependency.downstream == NO_NODE) continue;
+
+            next.nodes[std::string(interned.names[dependency.downstream])]++;
+            next.edges[std::string(interned.names[dependency.name]) + '\n' + std::string(interned.names[dependency.downstream])]++;
+        }
+
+        WatchSummary summary;
+        auto track = [&](const id_vec& moved) {
+            summary.moved.insert(summary.moved.end(), moved.begin(), moved.end());
+        };
+        auto split = [](const std::string& edge) {
+            auto separator = edge.find('\n');
+            return std::make_pair(std::string_view(edge).substr(0, separator), std::string_view(edge).substr(separator + 1));
+        };
+
+        for (const auto& [edge, count]: records.edges) {
+            if (next.edges.count(edge)) continue;
+            auto [from, to] = split(edge);
+            track(graph.remove_edge(from, to));
+            summary.removedEdges++;
+        }
+
+        // New names and edges in the order of the text
+        for (auto name: interned.names) {
+            if (records.nodes.count(std::string(name))) continue;
+            id_vec moved;
+            graph.add_node(name, &moved);
+            track(moved);
+            summary.addedNodes++;
+        }
+        for (const auto& dependency: interned.dependencies) {
+            if (dependency.downstream == NO_NODE) continue;
+            auto from = interned.names[dependency.name];
+            auto to = interned.names[dependency.downstream];
+            auto key = std::string(from) + '\n' + std::string(to);
+            if (records.edges.count(key)) continue;
+
+            try {
+                records.edges[key] = 0;        // Every new edge is applied once
+                track(graph.add_edge(from, to));
+                summary.addedEdges++;
+            } catch (CycleError& e) {
+                errors << "Error: " << e.getMessage() << std::endl;
+                next.edges.erase(key);         // Tried again with the next version
+                summary.rejectedEdges++;
+            }
+        }
+
+        for (const auto& [name, count]: records.nodes) {
+            if (next.nodes.count(name)) continue;
+            track(graph.remove_node(name));
+            summary.removedNodes++;
+        }
+
+        // Nodes that moved several times or were removed afterwards count once
+        std::sort(summary.moved.begin(), summary.moved.end());
+        summary.moved.erase(std::unique(summary.moved.begin(), summary.moved.end()), summary.moved.end());
+        summary.moved.erase(std::remove_if(summary.moved.begin(), summary.moved.end(), [&](node_id node) {
+            return !graph.contains(node);
+        }), summary.moved.end());
+
+        records = std::move(next);
+        return summary;
+    }
+}
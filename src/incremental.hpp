@@ -0,0 +1,101 @@
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "dag.hpp"
+
+namespace dag {
+    /**
+     * Dag that is changed a few nodes and edges at a time. The topological order is kept
+     * with the Pearce-Kelly online algorithm, so an edge only reorders the nodes between its
+     * ends. Layers follow the longest path and every node keeps its row in the layer until
+     * it moves to another layer. Mutations return the nodes whose position changed.
+     * Removed nodes keep their id, but no longer appear in the graph
+     */
+    class IncrementalGraph {
+        protected:
+        std::deque<std::string> nameStorage;
+        name_index ids;
+        std::vector<std::string_view> names;
+        std::vector<id_vec> childLists;
+        std::vector<id_vec> ancestorLists;
+        std::vector<double> costs;
+        std::vector<bool> removed;
+        size_t nodeCount = 0;
+        size_t edgeCount = 0;
+
+        id_vec order;                           // Nodes by topological position; Removed nodes leave a gap
+        std::vector<uint32_t> positions;        // Topological position of every node
+        std::vector<uint32_t> layers;           // Longest path from any start node
+        std::vector<uint32_t> rows;             // Row inside the layer
+
+        /**
+         * Rows of one layer; Freed rows are reused lowest first
+         */
+        struct Column {
+            uint32_t next = 0;
+            std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> free;
+        };
+        std::vector<Column> columns;
+
+        mutable std::vector<uint32_t> visited;  // Epoch of the last search that reached the node
+        mutable uint32_t epoch = 0;
+
+        uint32_t next_epoch() const;
+        uint32_t take_row(uint32_t layer);
+        void release_row(uint32_t layer, uint32_t row);
+        void reorder(node_id from, node_id to);
+        id_vec update_layers(const id_vec& seeds);
+
+        public:
+        IncrementalGraph() = default;
+        IncrementalGraph(const Graph& graph);
+
+        node_id find(std::string_view name) const;
+        bool contains(node_id node) const { return node < this->removed.size() && !this->removed[node]; }
+        bool contains_edge(node_id from, node_id to) const;
+        size_t size() const { return this->nodeCount; }
+        size_t edge_count() const { return this->edgeCount; }
+        std::string_view name(node_id node) const { return this->names[node]; }
+        double cost(node_id node) const { return this->costs[node]; }
+        uint32_t layer(node_id node) const { return this->layers[node]; }
+        uint32_t row(node_id node) const { return this->rows[node]; }
+        uint32_t position(node_id node) const { return this->positions[node]; }
+
+        node_id add_node(std::string_view name, id_vec* moved = nullptr);
+        id_vec add_edge(std::string_view from, std::string_view to);
+        id_vec remove_edge(std::string_view from, std::string_view to);
+        id_vec remove_node(std::string_view name);
+        Graph to_graph() const;
+    };
+
+    /**
+     * Records of the last applied dependency text; Edges are keyed by both names joined with a newline
+     */
+    struct WatchRecords {
+        std::unordered_map<std::string, uint32_t> nodes;
+        std::unordered_map<std::string, uint32_t> edges;
+    };
+
+    /**
+     * Changes made by one call to apply_dependencies
+     */
+    struct WatchSummary {
+        size_t addedNodes = 0;
+        size_t removedNodes = 0;
+        size_t addedEdges = 0;
+        size_t removedEdges = 0;
+        size_t rejectedEdges = 0;       // New edges that would close a cycle
+        id_vec moved;                   // Present nodes whose layer or row changed
+    };
+
+    WatchSummary apply_dependencies(IncrementalGraph& graph, WatchRecords& records, std::string_view text,
+        std::ostream& errors);
+}
+#endif
@@ -0,0 +1,425 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "input.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    const size_t READ_CHUNK_SIZE = 1 << 20;
+
+    /**
+     * Map the given file into memory
+     */
+    MappedFile::MappedFile(const std::string& filename) {
+        TRACE_SCOPE("map_file");
+        this->data = nullptr;
+        this->length = 0;
+
+        auto fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw Exception("Unable to open " + filename);
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            close(fd);
+            throw Exception("Unable to stat " + filename);
+        }
+
+        // Empty files cannot be mapped - they simply have no text
+        if (info.st_size > 0) {
+            auto mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw Exception("Unable to map " + filename);
+            }
+
+            madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+            this->data = static_cast<const char*>(mapping);
+            this->length = info.st_size;
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+
+    /**
+     * Release the mapping
+     */
+    MappedFile::~MappedFile() {
+        if (this->data != nullptr) {
+            munmap(const_cast<char*>(this->data), this->length);
+        }
+    }
+
+    /**
+     * Consume the whole descriptor in large chunks
+     */
+    std::string read_input(int fd) {
+        TRACE_SCOPE("read_input");
+        std::string buffer;
+        size_t used = 0;
+
+        while (true) {
+            buffer.resize(used + READ_CHUNK_SIZE);
+            auto count = read(fd, &buffer[used], READ_CHUNK_SIZE);
+
+            if (count < 0) {
+                throw Exception("Unable to read input");
+            }
+            if (count == 0) break;
+
+            used += count;
+        }
+
+        buffer.resize(used);
+        return buffer;
+    }
+
+    /**
+     * Check for the characters removed by trim
+     */
+    static inline bool _is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    /**
+     * Narrow the view to exclude surrounding whitespace
+     */
+    static inline std::string_view _trim_view(std::string_view s) {
+        size_t first = 0;
+        size_t last = s.size();
+
+        while (first < last && _is_space(s[first])) first++;
+        while (last > first && _is_space(s[last - 1])) last--;
+
+        return s.substr(first, last - first);
+    }
+
+    /**
+     * Bitmask of all newline, separator and arrow positions in a 64 byte block
+     */
+    typedef uint64_t (*_block_scanner)(const char* block);
+
+    const size_t BLOCK_SIZE = 64;
+
+    /**
+     * Portable block scanner
+     */
+    uint64_t _scan_block_scalar(const char* block) {
+        uint64_t mask = 0;
+
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            const char c = block[i];
+            if (c == '\n' || c == ',' || c == '>') {
+                mask |= uint64_t(1) << i;
+            }
+        }
+
+        return mask;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    /**
+     * Block scanner comparing 16 bytes at a time
+     */
+    __attribute__((target("sse2")))
+    uint64_t _scan_block_sse2(const char* block) {
+        const auto newline = _mm_set1_epi8('\n');
+        const auto separator = _mm_set1_epi8(',');
+        const auto arrow = _mm_set1_epi8('>');
+        uint64_t mask = 0;
+
+        for (size_t i = 0; i < BLOCK_SIZE; i += 16) {
+            auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+            auto matches = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, separator)),
+                _mm_cmpeq_epi8(bytes, arrow));
+            mask |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(matches))) << i;
+        }
+
+        return mask;
+    }
+
+    /**
+     * Block scanner comparing 32 bytes at a time
+     */
+    __attribute__((target("avx2")))
+    uint64_t _scan_block_avx2(const char* block) {
+        const auto newline = _mm256_set1_epi8('\n');
+        const auto separator = _mm256_set1_epi8(',');
+        const auto arrow = _mm256_set1_epi8('>');
+        uint64_t mask = 0;
+
+        for (size_t i = 0; i < BLOCK_SIZE; i += 32) {
+            auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+            auto matches = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline), _mm256_cmpeq_epi8(bytes, separator)),
+                _mm256_cmpeq_epi8(bytes, arrow));
+            mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(matches))) << i;
+        }
+
+        return mask;
+    }
+#endif
+
+    /**
+     * Check whether the running cpu can execute the given kernel
+     */
+    bool scan_kernel_supported(ScanKernel kernel) {
+        switch (kernel) {
+            case ScanKernel::Auto:
+            case ScanKernel::Scalar:
+                return true;
+#if defined(__x86_64__) || defined(__i386__)
+            case ScanKernel::SSE2:
+                return __builtin_cpu_supports("sse2");
+            case ScanKernel::AVX2:
+                return __builtin_cpu_supports("avx2");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Pick the block scanner; Auto selects the widest one the cpu supports
+     */
+    _block_scanner _select_block_scanner(ScanKernel kernel) {
+        if (kernel == ScanKernel::Auto) {
+            if (scan_kernel_supported(ScanKernel::AVX2)) {
+                kernel = ScanKernel::AVX2;
+            } else if (scan_kernel_supported(ScanKernel::SSE2)) {
+                kernel = ScanKernel::SSE2;
+            }
+        }
+
+        if (!scan_kernel_supported(kernel)) {
+            throw Exception("Scan kernel not supported on this cpu");
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        if (kernel == ScanKernel::AVX2) return _scan_block_avx2;
+        if (kernel == ScanKernel::SSE2) return _scan_block_sse2;
+#endif
+        return _scan_block_scalar;
+    }
+
+    /**
+     * Position of the tokenizer between two delimiters
+     */
+    struct _ScanState {
+        std::string_view text;
+        dependency_view_vec* dependencies;
+        size_t tokenStart;
+        size_t arrow;           // First arrow in the current token or npos
+        bool comment;           // Current line is a comment
+    };
+
+    /**
+     * Start a new line at the given position; Comments are detected by their first non blank character
+     */
+    static inline void _begin_line(_ScanState& state, size_t pos) {
+        state.tokenStart = pos;
+        state.arrow = std::string_view::npos;
+
+        while (pos < state.text.size() && state.text[pos] != '\n' && _is_space(state.text[pos])) pos++;
+        state.comment = pos < state.text.size() && state.text[pos] == '#';
+    }
+
+    /**
+     * Emit the token that ends at the given position
+     */
+    static inline void _emit_token(_ScanState& state, size_t end) {
+        auto token = state.text.substr(state.tokenStart, end - state.tokenStart);
+        DependencyView dependency;
+
+        if (state.arrow != std::string_view::npos) {
+            // Item has a child dependency
+            const auto pos = state.arrow - state.tokenStart;
+            dependency.name = _trim_view(token.substr(0, pos));
+            dependency.downstream = _trim_view(token.substr(pos + 1));
+        } else {
+            dependency.name = _trim_view(token);
+        }
+
+        // Records without a name do not describe a node
+        if (!dependency.name.empty()) {
+            state.dependencies->push_back(dependency);
+        }
+    }
+
+    /**
+     * Advance the tokenizer over a single delimiter
+     */
+    static inline void _consume_delimiter(_ScanState& state, size_t pos) {
+        const char c = state.text[pos];
+
+        if (c == '\n') {
+            if (!state.comment) {
+                _emit_token(state, pos);
+            }
+            _begin_line(state, pos + 1);
+        } else if (state.comment) {
+            // Delimiters inside comments carry no meaning
+            return;
+        } else if (c == ',') {
+            _emit_token(state, pos);
+            state.tokenStart = pos + 1;
+            state.arrow = std::string_view::npos;
+        } else if (state.arrow == std::string_view::npos) {
+            state.arrow = pos;
+        }
+    }
+
+    /**
+     * Split the input text into dependencies; The views point into the given text
+     */
+    dependency_view_vec scan_dependencies(std::string_view text, ScanKernel kernel) {
+        TRACE_SCOPE("scan_dependencies");
+        dependency_view_vec dependencies;
+        auto scanBlock = _select_block_scanner(kernel);
+
+        _ScanState state;
+        state.text = text;
+        state.dependencies = &dependencies;
+        _begin_line(state, 0);
+
+        for (size_t blockStart = 0; blockStart < text.size(); blockStart += BLOCK_SIZE) {
+            uint64_t mask;
+
+            if (blockStart + BLOCK_SIZE <= text.size()) {
+                mask = scanBlock(text.data() + blockStart);
+            } else {
+                // Pad the last partial block with blanks
+                char tail[BLOCK_SIZE];
+                std::memset(tail, ' ', BLOCK_SIZE);
+                std::memcpy(tail, text.data() + blockStart, text.size() - blockStart);
+                mask = scanBlock(tail);
+            }
+
+            // Visit the delimiters in order of their position
+            while (mask) {
+                _consume_delimiter(state, blockStart + __builtin_ctzll(mask));
+                mask &= mask - 1;
+            }
+        }
+
+        // Last line without trailing newline
+        if (!state.comment && state.tokenStart < text.size()) {
+            _emit_token(state, text.size());
+        }
+
+        return dependencies;
+    }
+
+    /**
+     * Split the text into roughly equal chunks that start at line boundaries
+     */
+    std::vector<std::string_view> _split_chunks(std::string_view text, size_t count) {
+        std::vector<std::string_view> chunks;
+        size_t chunkStart = 0;
+
+        for (size_t i = 1; i <= count && chunkStart < text.size(); i++) {
+            size_t chunkEnd = text.size();
+
+            if (i < count) {
+                // Move the cut behind the next newline
+                chunkEnd = text.find('\n', std::max(chunkStart, text.size() * i / count));
+                chunkEnd = chunkEnd == std::string_view::npos ? text.size() : chunkEnd + 1;
+            }
+
+            chunks.push_back(text.substr(chunkStart, chunkEnd - chunkStart));
+            chunkStart = chunkEnd;
+        }
+
+        return chunks;
+    }
+
+    /**
+     * Run the work for every index on its own thread; The calling thread takes index 0
+     */
+    void _run_parallel(size_t count, const std::function<void(size_t)>& work) {
+        std::vector<std::thread> workers;
+
+        for (size_t i = 1; i < count; i++) {
+            workers.emplace_back(work, i);
+        }
+
+        if (count) {
+            work(0);
+        }
+
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Scan and intern the input text; Chunks are processed in parallel and merged in input order
+     */
+    InternedDependencies parse_dependencies(std::string_view text, unsigned threads) {
+        TRACE_SCOPE("parse_dependencies");
+        if (threads <= 1) {
+            return intern_dependencies(scan_dependencies(text));
+        }
+
+        // 1. Every chunk gets its own edge list and name interner
+        auto chunks = _split_chunks(text, threads);
+        std::vector<InternedDependencies> locals(chunks.size());
+        _run_parallel(chunks.size(), [&](size_t i) {
+            locals[i] = intern_dependencies(scan_dependencies(chunks[i]));
+        });
+
+        // 2. Merging the names in chunk order reproduces the serial first-appearance ids
+        InternedDependencies merged;
+        name_index ids;
+        std::vector<id_vec> remaps(chunks.size());
+        std::vector<size_t> offsets(chunks.size() + 1, 0);
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            TRACE_COUNT(NodeLookups, locals[i].names.size());
+            remaps[i].reserve(locals[i].names.size());
+            for (auto name: locals[i].names) {
+                remaps[i].push_back(intern_name(ids, merged.names, name));
+            }
+            offsets[i + 1] = offsets[i] + locals[i].dependencies.size();
+
+            // Later chunks override the costs of earlier ones, as in a serial parse
+            merged.costs.resize(merged.names.size(), NO_COST);
+            for (size_t local = 0; local < locals[i].costs.size(); local++) {
+                if (locals[i].costs[local] != NO_COST) {
+                    merged.costs[remaps[i][local]] = locals[i].costs[local];
+                }
+            }
+        }
+
+        // 3. Translate every chunk's dependencies into the global id space
+        merged.dependencies.resize(offsets.back());
+        _run_parallel(chunks.size(), [&](size_t i) {
+            TRACE_SCOPE("_remap_chunk");
+            const auto& remap = remaps[i];
+            auto target = merged.dependencies.begin() + offsets[i];
+
+            for (const auto& dependency: locals[i].dependencies) {
+                auto downstream = dependency.downstream == NO_NODE ? NO_NODE : remap[dependency.downstream];
+                *target++ = IdDependency { remap[dependency.name], downstream };
+            }
+        });
+
+        return merged;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef INPUT_HPP
+#define INPUT_HPP
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include "dag.hpp"
+
+namespace dag {
+    /**
+     * Read-only memory mapping of a whole file; Unmapped when it goes out of scope
+     */
+    class MappedFile {
+        protected:
+        const char* data;
+        size_t length;
+
+        public:
+        MappedFile(const std::string& filename);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        std::string_view text() const {
+            return std::string_view(this->data, this->length);
+        }
+    };
+
+    /**
+     * Instruction set used to locate delimiters in the input
+     */
+    enum class ScanKernel {
+        Auto,
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    std::string read_input(int fd);
+    bool scan_kernel_supported(ScanKernel kernel);
+    dependency_view_vec scan_dependencies(std::string_view text, ScanKernel kernel = ScanKernel::Auto);
+    InternedDependencies parse_dependencies(std::string_view text, unsigned threads = 1);
+}
+#endif
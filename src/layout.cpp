@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "layout.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    /**
+     * Graph in which every edge connects two neighbouring layers; Long edges run through virtual nodes
+     */
+    struct _ProperGraph {
+        size_t realCount;                   // Ids below realCount are graph nodes, all others are virtual
+        std::vector<uint32_t> layer;
+        std::vector<uint32_t> downOffsets;
+        id_vec down;
+        std::vector<uint32_t> upOffsets;
+        id_vec up;
+        std::vector<id_vec> layers;         // Node order within every layer
+        std::vector<uint32_t> position;     // Index of every node within its layer
+    };
+
+    const size_t VIRTUAL_NODES_PER_ELEMENT = 2;     // Budget of virtual nodes per node and edge
+
+    /**
+     * Look up the layout engine by its command line name
+     */
+    LayoutEngine parse_layout_engine(const std::string& name) {
+        if (name == "tree") return LayoutEngine::Tree;
+        if (name == "layered") return LayoutEngine::Layered;
+
+        throw Exception("Unknown layout " + name);
+    }
+
+    /**
+     * Assign x and y positions to dag nodes
+     */
+    void _calculate_positions(Graph& graph) {
+        TRACE_SCOPE("_calculate_positions");
+        // Walk the dag depth first. Every node gets the next free row below its parent
+        // when it is reached for the first time - later visits would not move it again.
+        graph.x.assign(graph.size(), -1);
+        graph.y.assign(graph.size(), -1);
+        TRACE_COUNT(EdgesVisited, graph.edge_count());
+
+        struct Frame {
+            node_id node;
+            uint32_t next;      // Next child to visit
+            int y;              // Row for the next newly reached child
+        };
+        std::vector<Frame> frames;
+        int y = 0;
+
+        for (auto startNode: graph.startNodes) {
+            graph.x[startNode] = 0;
+            graph.y[startNode] = y;
+            frames.push_back(Frame { startNode, graph.childOffsets[startNode], y });
+
+            while (!frames.empty()) {
+                auto& frame = frames.back();
+                if (frame.next == graph.childOffsets[frame.node + 1]) {
+                    frames.pop_back();
+                    continue;
+                }
+
+                auto child = graph.childIds[frame.next++];
+                if (graph.x[child] != -1) continue;
+
+                graph.x[child] = graph.x[frame.node] + 1;
+                graph.y[child] = frame.y++;
+                frames.push_back(Frame { child, graph.childOffsets[child], frame.y });
+            }
+
+            y++;
+        }
+    }
+
+    /**
+     * Relocate every node to its layer, so no edge points to the same or a lower x
+     */
+    void _shift_positions(Graph& graph) {
+        TRACE_SCOPE("_shift_positions");
+        for (node_id id = 0; id < graph.size(); id++) {
+            graph.x[id] = static_cast<int>(graph.layers[id]);
+        }
+    }
+
+    /**
+     * Split all edges that skip layers into chains of virtual nodes
+     */
+    void _build_proper_graph(const Graph& graph, _ProperGraph& proper) {
+        TRACE_SCOPE("_build_proper_graph");
+        proper.realCount = graph.size();
+        proper.layer.assign(graph.layers.begin(), graph.layers.end());
+
+        // Sources deep in the dag can span hundreds of layers. Only the shortest edges
+        // get virtual nodes within the budget - longer ones do not take part in the sweeps.
+        const size_t MAX_VIRTUAL_NODES = VIRTUAL_NODES_PER_ELEMENT * (graph.size() + graph.edge_count());
+        std::vector<size_t> spanCounts(graph.depth + 1, 0);
+        for (node_id id = 0; id < graph.size(); id++) {
+            for (auto child: graph.children(id)) {
+                spanCounts[graph.layers[child] - graph.layers[id]]++;
+            }
+        }
+
+        uint32_t maxSpan = 1;
+        size_t virtualNodes = 0;
+        while (maxSpan + 1 < spanCounts.size() && virtualNodes + spanCounts[maxSpan + 1] * maxSpan <= MAX_VIRTUAL_NODES) {
+            maxSpan++;
+            virtualNodes += spanCounts[maxSpan] * (maxSpan - 1);
+        }
+
+        std::vector<std::pair<node_id, node_id>> edges;
+        edges.reserve(graph.edge_count() + virtualNodes);
+        proper.layer.reserve(graph.size() + virtualNodes);
+
+        for (node_id id = 0; id < graph.size(); id++) {
+            for (auto child: graph.children(id)) {
+                if (graph.layers[child] - graph.layers[id] > maxSpan) continue;
+                auto from = id;
+
+                for (auto layer = graph.layers[id] + 1; layer < graph.layers[child]; layer++) {
+                    auto virtualNode = static_cast<node_id>(proper.layer.size());
+                    proper.layer.push_back(layer);
+                    edges.emplace_back(from, virtualNode);
+                    from = virtualNode;
+                }
+
+                edges.emplace_back(from, child);
+            }
+        }
+
+        // Forward and reverse rows for the sweeps
+        const auto nodeCount = proper.layer.size();
+        proper.downOffsets.assign(nodeCount + 1, 0);
+        proper.upOffsets.assign(nodeCount + 1, 0);
+        for (const auto& edge: edges) {
+            proper.downOffsets[edge.first + 1]++;
+            proper.upOffsets[edge.second + 1]++;
+        }
+        for (size_t i = 1; i <= nodeCount; i++) {
+            proper.downOffsets[i] += proper.downOffsets[i - 1];
+            proper.upOffsets[i] += proper.upOffsets[i - 1];
+        }
+
+        proper.down.resize(edges.size());
+        proper.up.resize(edges.size());
+        std::vector<uint32_t> downFill(proper.downOffsets.begin(), proper.downOffsets.end() - 1);
+        std::vector<uint32_t> upFill(proper.upOffsets.begin(), proper.upOffsets.end() - 1);
+        for (const auto& edge: edges) {
+            proper.down[downFill[edge.first]++] = edge.second;
+            proper.up[upFill[edge.second]++] = edge.first;
+        }
+
+        // Start with the nodes in order of creation; The first sweep sorts them
+        proper.layers.assign(graph.depth, id_vec());
+        proper.position.assign(nodeCount, 0);
+        for (node_id id = 0; id < nodeCount; id++) {
+            auto& layer = proper.layers[proper.layer[id]];
+            proper.position[id] = static_cast<uint32_t>(layer.size());
+            layer.push_back(id);
+        }
+    }
+
+    /**
+     * Count the edge crossings between a layer and the next one with an accumulator tree
+     */
+    uint64_t _count_crossings(const _ProperGraph& proper, size_t layerIndex) {
+        const auto& upper = proper.layers[layerIndex];
+        const auto lowerSize = proper.layers[layerIndex + 1].size();
+        if (lowerSize < 2) return 0;
+
+        // Lower end points in order of their upper end point
+        std::vector<uint32_t> targets;
+        for (auto node: upper) {
+            auto first = targets.size();
+            for (auto i = proper.downOffsets[node]; i < proper.downOffsets[node + 1]; i++) {
+                targets.push_back(proper.position[proper.down[i]]);
+            }
+            std::sort(targets.begin() + first, targets.end());
+        }
+
+        // Every earlier edge that ends further right crosses the current one
+        size_t treeSize = 1;
+        while (treeSize < lowerSize) treeSize <<= 1;
+        std::vector<uint32_t> tree(2 * treeSize - 1, 0);
+        uint64_t crossings = 0;
+
+        for (auto target: targets) {
+            auto index = target + treeSize - 1;
+            tree[index]++;
+
+            while (index > 0) {
+                if (index % 2) {
+                    crossings += tree[index + 1];
+                }
+                index = (index - 1) / 2;
+                tree[index]++;
+            }
+        }
+
+        return crossings;
+    }
+
+    /**
+     * Count all crossings of the current order
+     */
+    uint64_t _count_all_crossings(const _ProperGraph& proper) {
+        uint64_t crossings = 0;
+
+        for (size_t i = 0; i + 1 < proper.layers.size(); i++) {
+            crossings += _count_crossings(proper, i);
+        }
+
+        return crossings;
+    }
+
+    /**
+     * Reorder a layer by the barycenter of each node's neighbours in the adjacent layer
+     */
+    void _order_layer(_ProperGraph& proper, size_t layerIndex, const std::vector<uint32_t>& offsets, const id_vec& neighbours) {
+        auto& layer = proper.layers[layerIndex];
+        std::vector<std::pair<double, node_id>> weights;
+        weights.reserve(layer.size());
+
+        for (auto node: layer) {
+            auto first = offsets[node];
+            auto last = offsets[node + 1];
+            // Nodes without neighbours keep their place
+            double weight = proper.position[node];
+
+            if (last > first) {
+                double sum = 0;
+                for (auto i = first; i < last; i++) {
+                    sum += proper.position[neighbours[i]];
+                }
+                weight = sum / (last - first);
+            }
+
+            weights.emplace_back(weight, node);
+        }
+
+        std::stable_sort(weights.begin(), weights.end(), [](const std::pair<double, node_id>& a, const std::pair<double, node_id>& b) {
+            return a.first < b.first;
+        });
+
+        for (size_t i = 0; i < weights.size(); i++) {
+            layer[i] = weights[i].second;
+            proper.position[layer[i]] = static_cast<uint32_t>(i);
+        }
+    }
+
+    /**
+     * Alternate downward and upward sweeps; Keeps the best order found within the budget
+     */
+    void _reduce_crossings(_ProperGraph& proper, const LayoutOptions& options) {
+        TRACE_SCOPE("_reduce_crossings");
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeBudgetMs);
+        const unsigned MAX_STALLED_SWEEPS = 4;
+
+        auto bestLayers = proper.layers;
+        uint64_t bestCrossings = UINT64_MAX;
+        unsigned stalled = 0;
+
+        for (unsigned sweep = 0; sweep < options.maxSweeps; sweep++) {
+            if (sweep % 2 == 0) {
+                for (size_t i = 1; i < proper.layers.size(); i++) {
+                    _order_layer(proper, i, proper.upOffsets, proper.up);
+                }
+            } else {
+                for (size_t i = proper.layers.size(); i-- > 1;) {
+                    _order_layer(proper, i - 1, proper.downOffsets, proper.down);
+                }
+            }
+
+            auto crossings = _count_all_crossings(proper);
+            TRACE_COUNT(EdgesVisited, 2 * proper.down.size());
+            if (crossings < bestCrossings) {
+                bestCrossings = crossings;
+                bestLayers = proper.layers;
+                stalled = 0;
+            } else if (++stalled >= MAX_STALLED_SWEEPS) {
+                break;
+            }
+
+            if (crossings == 0 || std::chrono::steady_clock::now() > deadline) break;
+        }
+
+        proper.layers = bestLayers;
+    }
+
+    /**
+     * Assign rows from the final order; Virtual nodes take no space and every layer is centered
+     */
+    void _assign_coordinates(const _ProperGraph& proper, Graph& graph) {
+        TRACE_SCOPE("_assign_coordinates");
+        std::vector<uint32_t> widths(proper.layers.size(), 0);
+        uint32_t maxWidth = 0;
+
+        for (size_t i = 0; i < proper.layers.size(); i++) {
+            for (auto node: proper.layers[i]) {
+                if (node < proper.realCount) widths[i]++;
+            }
+            maxWidth = std::max(maxWidth, widths[i]);
+        }
+
+        graph.x.assign(graph.size(), 0);
+        graph.y.assign(graph.size(), 0);
+
+        for (size_t i = 0; i < proper.layers.size(); i++) {
+            int row = static_cast<int>((maxWidth - widths[i]) / 2);
+
+            for (auto node: proper.layers[i]) {
+                if (node >= proper.realCount) continue;
+
+                graph.x[node] = static_cast<int>(i);
+                graph.y[node] = row++;
+            }
+        }
+    }
+
+    /**
+     * Sugiyama style layout: Layers from the longest path, crossing reduction by barycenter sweeps
+     */
+    void layout_layered(Graph& graph, const LayoutOptions& options) {
+        _ProperGraph proper;
+        _build_proper_graph(graph, proper);
+        _reduce_crossings(proper, options);
+        _assign_coordinates(proper, graph);
+    }
+
+    /**
+     * Assign positions with the selected engine; Requires the layers from assign_layers
+     */
+    void layout_graph(Graph& graph, const LayoutOptions& options) {
+        TRACE_SCOPE("layout_graph");
+        if (options.engine == LayoutEngine::Layered) {
+            layout_layered(graph, options);
+        } else {
+            _calculate_positions(graph);
+            _shift_positions(graph);
+        }
+    }
+}
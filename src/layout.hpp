@@ -0,0 +1,10 @@
+#ifndef LAYOUT_HPP
+#define LAYOUT_HPP
+#include "dag.hpp"
+
+namespace dag {
+    LayoutEngine parse_layout_engine(const std::string& name);
+    void layout_layered(Graph& graph, const LayoutOptions& options);
+    void layout_graph(Graph& graph, const LayoutOptions& options);
+}
+#endif
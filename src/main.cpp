@@ -1,30 +1,344 @@
+#include <chrono>
 #include <cstdio>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <new>
 #include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "stdafx.hpp"
+#include "analysis.hpp"
+#include "cache.hpp"
 #include "dag.hpp"
+#include "incremental.hpp"
+#include "input.hpp"
+#include "layout.hpp"
+#include "output.hpp"
+#include "reachability.hpp"
+#include "run.hpp"
+#include "server.hpp"
+#include "snapshot.hpp"
 #include "svg.hpp"
+#include "trace.hpp"
 
 /**
- * Consume all lines from stdin and return a list of verified entries
+ * What to do with the dag
  */
-std::vector<std::string> parse_stdin() {
-    std::vector<std::string> lines;
-    auto lineNumber = 1;
+enum class Mode {
+    Draw,
+    Run,            // Execute the node commands
+    Analyze,        // Print the critical path and the level widths
+    Query,          // Answer reachability questions
+    Serve           // Keep the graph in memory and answer requests on a socket
+};
 
-    for (std::string line; std::getline(std::cin, line); lineNumber++) {
-        trim(line);
-        lines.push_back(line);
+/**
+ * Settings collected from the command line
+ */
+struct Options {
+    bool showVersion = false;
+    Mode mode = Mode::Draw;
+    bool json = false;          // Print the analysis as json
+    std::vector<std::string> queries;   // Reachability queries in batch file syntax
+    std::string batchFile;      // File with one query per line
+    std::string inputFile;      // Read from stdin if empty
+    unsigned threads = 1;       // Parser and renderer threads
+    bool showStats = false;     // Print phase timings and counters to stderr
+    std::string traceFile;      // Write a Chrome trace if not empty
+    dag::BuildOptions build;
+    dag::RunOptions run;
+    dag::OutputOptions output;
+    dag::ServerOptions server;
+    std::string drillDownDirectory;     // Write an svg per collapsed node if not empty
+    std::string watchFile;      // Redraw after every change of this file if not empty
+    bool canonical = false;     // Write the sorted unique dependencies instead of drawing
+    dag::CacheOptions cache;
+    std::string saveSnapshot;   // Store the built graph in this file if not empty
+    std::string loadSnapshot;   // Take the built graph from this file instead of the input if not empty
+};
+
+const unsigned WATCH_INTERVAL_MS = 200;    // Time between two checks of the watched file
+
+/**
+ * Print command line usage to stderr
+ */
+void print_usage() {
+    std::cerr << "Usage: dag [-v] [-f FILE] [--format FORMAT] [-o FILE|-] [--compact] [--open] [--collapse N|auto [--drill-down DIR]] [--threads N] [--condense-cycles] [--reduce] [--focus NAMES [--up K] [--down K]] [--layout ENGINE] [--cache-dir DIR [--cache-size MB]] [--save-snapshot FILE] [--load-snapshot FILE] [--stats] [--trace FILE]" << std::endl;
+    std::cerr << "       dag --canonical [-f FILE] [-o FILE|-]" << std::endl;
+    std::cerr << "       dag --watch FILE -o FILE [--format FORMAT] [--compact]" << std::endl;
+    std::cerr << "       dag run [-f FILE] [-j N] [--keep-going] [--stats] [--trace FILE]" << std::endl;
+    std::cerr << "       dag analyze [-f FILE] [--json] [--condense-cycles]" << std::endl;
+    std::cerr << "       dag query [-f FILE] [--descendants X] [--ancestors X] [--depends A B] [--batch FILE]" << std::endl;
+    std::cerr << "       dag serve --socket PATH [-f FILE] [-j N] [--format FORMAT] [--compact]" << std::endl;
+    std::cerr << "  -v            Print version" << std::endl;
+    std::cerr << "  -f FILE       Read dependencies from FILE instead of stdin" << std::endl;
+    std::cerr << "  --format svg|dot|json|text" << std::endl;
+    std::cerr << "                Write the graph as svg (default), Graphviz dot, json or an indented node tree" << std::endl;
+    std::cerr << "  -o FILE|-     Write to FILE instead of standard output; Svg files ending in .svgz are compressed" << std::endl;
+    std::cerr << "  --compact     Write smaller svg markup" << std::endl;
+    std::cerr << "  --collapse N|auto" << std::endl;
+    std::cerr << "                Draw nodes that share the first N name segments as one box; auto picks N" << std::endl;
+    std::cerr << "                so at most 500 boxes remain" << std::endl;
+    std::cerr << "  --collapse-separator C" << std::endl;
+    std::cerr << "                Split names into segments at C instead of /" << std::endl;
+    std::cerr << "  --drill-down DIR" << std::endl;
+    std::cerr << "                Also write an svg with the nodes of every collapsed box to DIR" << std::endl;
+    std::cerr << "  --canonical   Write every dependency once, sorted by name, instead of drawing" << std::endl;
+    std::cerr << "  --watch FILE  Apply every change of FILE to the graph and write the output again" << std::endl;
+    std::cerr << "  --open        Show the written file in the default viewer" << std::endl;
+    std::cerr << "  --threads N   Parse the input and render the svg with N threads" << std::endl;
+    std::cerr << "  --condense-cycles" << std::endl;
+    std::cerr << "                Merge circular dependencies into single nodes instead of failing" << std::endl;
+    std::cerr << "  --reduce      Drop dependencies that are already implied by longer paths" << std::endl;
+    std::cerr << "  --focus NAMES Only build the neighbourhood of the comma separated nodes; May be repeated" << std::endl;
+    std::cerr << "  --up K, --down K" << std::endl;
+    std::cerr << "                Keep K levels of ancestors or descendants of the focus nodes (default 1)" << std::endl;
+    std::cerr << "  --layout tree|layered" << std::endl;
+    std::cerr << "                Position nodes depth first (default) or in crossing reduced layers" << std::endl;
+    std::cerr << "  --cache-dir DIR" << std::endl;
+    std::cerr << "                Reuse the output of an earlier run with the same dependencies and settings;" << std::endl;
+    std::cerr << "                The graph is built from the sorted dependencies" << std::endl;
+    std::cerr << "  --cache-size MB" << std::endl;
+    std::cerr << "                Remove the least recently used outputs above this size (default 512)" << std::endl;
+    std::cerr << "  --save-snapshot FILE" << std::endl;
+    std::cerr << "                Also store the built graph with its layout in the binary FILE" << std::endl;
+    std::cerr << "  --load-snapshot FILE" << std::endl;
+    std::cerr << "                Use the graph stored in FILE instead of reading dependencies" << std::endl;
+    std::cerr << "  --stats       Print the time spent in every phase and the counters to stderr" << std::endl;
+    std::cerr << "  --trace FILE  Write the phases of every thread as Chrome trace events" << std::endl;
+    std::cerr << "  run           Execute the commands of `name: command` lines in dependency order" << std::endl;
+    std::cerr << "  -j N          Run up to N commands at the same time" << std::endl;
+    std::cerr << "  --keep-going  Continue with unaffected nodes after a command failed" << std::endl;
+    std::cerr << "  analyze       Print the critical path, slack per node and the width of every level" << std::endl;
+    std::cerr << "                Nodes cost 1 unless given as name[cost], for example a[12.5]>b" << std::endl;
+    std::cerr << "  --json        Print the analysis as json" << std::endl;
+    std::cerr << "  query         Answer every query with one line" << std::endl;
+    std::cerr << "  --descendants X, --ancestors X" << std::endl;
+    std::cerr << "                List all nodes below or above X" << std::endl;
+    std::cerr << "  --depends A B Print true if A is below B" << std::endl;
+    std::cerr << "  --batch FILE  Read queries like `depends, A, B` or `descendants, X` from FILE" << std::endl;
+    std::cerr << "  serve         Keep the graph in memory and answer one request per line on a socket:" << std::endl;
+    std::cerr << "                render[, FORMAT], subgraph, X, UP, DOWN[, FORMAT], the queries above, order," << std::endl;
+    std::cerr << "                stats, add, A[, B] and remove, A[, B]; Every answer ends with a zero byte" << std::endl;
+    std::cerr << "  --socket PATH Listen on the unix domain socket PATH" << std::endl;
+    std::cerr << "  -j N          Serve up to N clients at the same time (default 4)" << std::endl;
+}
+
+/**
+ * Convert a positive number argument; Zero is only accepted if allowed
+ */
+unsigned parse_count(const std::string& value, bool allowZero = false) {
+    size_t end = 0;
+    unsigned long count = 0;
+
+    try {
+        count = std::stoul(value, &end);
+    } catch (std::exception&) {
+        end = 0;
+    }
+
+    if (end == 0 || end != value.size() || (count == 0 && !allowZero)) {
+        throw Exception("Expected a " + std::string(allowZero ? "" : "positive ") + "number instead of " + value);
+    }
+
+    return static_cast<unsigned>(count);
+}
+
+/**
+ * Collect options from the command line arguments
+ */
+Options parse_arguments(int argc, const char** argv) {
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument(argv[i]);
+
+        if (argument == "run" && i == 1) {
+            options.mode = Mode::Run;
+        } else if (argument == "analyze" && i == 1) {
+            options.mode = Mode::Analyze;
+        } else if (argument == "query" && i == 1) {
+            options.mode = Mode::Query;
+        } else if (argument == "serve" && i == 1) {
+            options.mode = Mode::Serve;
+        } else if (argument == "--socket" && options.mode == Mode::Serve && i + 1 < argc) {
+            options.server.socket = argv[++i];
+        } else if (argument == "-j" && options.mode == Mode::Serve && i + 1 < argc) {
+            options.server.workers = parse_count(argv[++i]);
+        } else if ((argument == "--descendants" || argument == "--ancestors") && options.mode == Mode::Query && i + 1 < argc) {
+            options.queries.push_back(argument.substr(2) + "," + argv[++i]);
+        } else if (argument == "--depends" && options.mode == Mode::Query && i + 2 < argc) {
+            options.queries.push_back("depends," + std::string(argv[i + 1]) + "," + argv[i + 2]);
+            i += 2;
+        } else if (argument == "--batch" && options.mode == Mode::Query && i + 1 < argc) {
+            options.batchFile = argv[++i];
+        } else if (argument == "-j" && options.mode == Mode::Run && i + 1 < argc) {
+            options.run.jobs = parse_count(argv[++i]);
+        } else if (argument == "--keep-going" && options.mode == Mode::Run) {
+            options.run.keepGoing = true;
+        } else if (argument == "--json" && options.mode == Mode::Analyze) {
+            options.json = true;
+        } else if (argument == "--format" && (options.mode == Mode::Draw || options.mode == Mode::Serve) && i + 1 < argc) {
+            options.output.format = dag::parse_output_format(argv[++i]);
+        } else if (argument == "-o" && options.mode == Mode::Draw && i + 1 < argc) {
+            options.output.file = argv[++i];
+        } else if (argument == "--collapse" && options.mode == Mode::Draw && i + 1 < argc) {
+            std::string depth(argv[++i]);
+            options.build.collapse.automatic = depth == "auto";
+            options.build.collapse.depth = depth == "auto" ? 0 : parse_count(depth);
+        } else if (argument == "--collapse-separator" && options.mode == Mode::Draw && i + 1 < argc) {
+            std::string separator(argv[++i]);
+            if (separator.size() != 1) {
+                throw Exception("Expected a single character instead of " + separator);
+            }
+            options.build.collapse.separator = separator[0];
+        } else if (argument == "--drill-down" && options.mode == Mode::Draw && i + 1 < argc) {
+            options.drillDownDirectory = argv[++i];
+        } else if (argument == "--watch" && options.mode == Mode::Draw && i + 1 < argc) {
+            options.watchFile = argv[++i];
+        } else if (argument == "--cache-dir" && options.mode == Mode::Draw && i + 1 < argc) {
+            options.cache.directory = argv[++i];
+        } else if (argument == "--cache-size" && options.mode == Mode::Draw && i + 1 < argc) {
+            options.cache.maxBytes = static_cast<uint64_t>(parse_count(argv[++i])) << 20;
+        } else if (argument == "--canonical" && options.mode == Mode::Draw) {
+            options.canonical = true;
+        } else if (argument == "--compact" && (options.mode == Mode::Draw || options.mode == Mode::Serve)) {
+            options.output.compactSvg = true;
+        } else if (argument == "--open" && options.mode == Mode::Draw) {
+            options.output.openViewer = true;
+        } else if (argument == "-v") {
+            options.showVersion = true;
+        } else if (argument == "-f" && i + 1 < argc) {
+            options.inputFile = argv[++i];
+        } else if (argument == "--threads" && i + 1 < argc) {
+            options.threads = parse_count(argv[++i]);
+        } else if (argument == "--condense-cycles") {
+            options.build.condenseCycles = true;
+        } else if (argument == "--reduce") {
+            options.build.reduce = true;
+        } else if (argument == "--focus" && i + 1 < argc) {
+            std::istringstream roots(argv[++i]);
+            for (std::string root; std::getline(roots, root, ',');) {
+                if (trim_copy(root) != "") options.build.focus.roots.push_back(trim_copy(root));
+            }
+        } else if (argument == "--up" && i + 1 < argc) {
+            options.build.focus.up = parse_count(argv[++i], true);
+        } else if (argument == "--down" && i + 1 < argc) {
+            options.build.focus.down = parse_count(argv[++i], true);
+        } else if (argument == "--layout" && i + 1 < argc) {
+            options.build.layout.engine = dag::parse_layout_engine(argv[++i]);
+        } else if (argument == "--save-snapshot" && i + 1 < argc) {
+            options.saveSnapshot = argv[++i];
+        } else if (argument == "--load-snapshot" && i + 1 < argc) {
+            options.loadSnapshot = argv[++i];
+        } else if (argument == "--stats") {
+            options.showStats = true;
+        } else if (argument == "--trace" && i + 1 < argc) {
+            options.traceFile = argv[++i];
+        } else {
+            throw Exception("Unknown argument " + argument);
+        }
+    }
+
+    // Merged nodes have no command of their own
+    if (options.mode == Mode::Run && options.build.condenseCycles) {
+        throw Exception("--condense-cycles cannot be used with run");
+    }
+    // Commands outside the focus would have no node
+    if (options.mode == Mode::Run && !options.build.focus.roots.empty()) {
+        throw Exception("--focus cannot be used with run");
+    }
+
+    // A hit skips the build, so only the main output can come from the cache
+    if (options.cache.directory != "" && (options.canonical || options.watchFile != "" || options.drillDownDirectory != ""
+        || options.saveSnapshot != "" || options.loadSnapshot != "")) {
+        throw Exception("--cache-dir cannot be used with --canonical, --watch, --drill-down or snapshots");
+    }
+    if (options.canonical && (options.loadSnapshot != "" || options.watchFile != "")) {
+        throw Exception("--canonical cannot be used with --load-snapshot or --watch");
+    }
+    // A snapshot holds the finished graph, but not the input it was built from
+    if (options.loadSnapshot != "" && (options.mode == Mode::Run || options.inputFile != "" || options.watchFile != "")) {
+        throw Exception("--load-snapshot cannot be used with run, -f or --watch");
+    }
+    if (options.loadSnapshot != "" && (options.build.condenseCycles || options.build.reduce || !options.build.focus.roots.empty()
+        || options.build.collapse.depth != 0 || options.build.collapse.automatic)) {
+        throw Exception("--load-snapshot cannot be used with --condense-cycles, --reduce, --focus or --collapse");
+    }
+
+    if (options.mode == Mode::Serve && options.server.socket == "") {
+        throw Exception("serve needs --socket");
+    }
+    // Updates go to the nodes themselves
+    if (options.mode == Mode::Serve && (options.build.collapse.depth != 0 || options.build.collapse.automatic)) {
+        throw Exception("--collapse cannot be used with serve");
+    }
+
+    if (options.drillDownDirectory != "" && options.build.collapse.depth == 0 && !options.build.collapse.automatic) {
+        throw Exception("--drill-down needs --collapse");
+    }
+    if (options.output.openViewer && options.output.file == "-") {
+        throw Exception("--open needs an output file");
     }
+    // The incremental graph only keeps the order and the layers
+    if (options.watchFile != "" && options.output.file == "-") {
+        throw Exception("--watch needs an output file");
+    }
+    if (options.watchFile != "" && (options.build.condenseCycles || options.build.reduce
+        || !options.build.focus.roots.empty() || options.build.collapse.depth != 0 || options.build.collapse.automatic)) {
+        throw Exception("--watch cannot be used with --condense-cycles, --reduce, --focus or --collapse");
+    }
+
+#ifndef DAG_INSTRUMENTATION
+    if (options.showStats || options.traceFile != "") {
+        throw Exception("Instrumentation is not available in this build");
+    }
+#endif
+
+    return options;
+}
+
+#ifdef DAG_INSTRUMENTATION
+/**
+ * Count every allocation while tracing is enabled
+ */
+void* operator new(size_t size) {
+    TRACE_COUNT(Allocations, 1);
+    if (auto pointer = malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
 
-    return lines;
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    free(pointer);
+}
+#endif
+
+/**
+ * Emit the collected phases and counters as requested on the command line
+ */
+void report_instrumentation(const Options& options) {
+    if (options.showStats) {
+        dag::print_trace_stats(std::cerr);
+    }
+    if (options.traceFile != "") {
+        dag::write_trace(options.traceFile);
+    }
 }
 
 /**
@@ -44,31 +358,330 @@ void shutdown_handler(int sig) {
     exit(EXIT_FAILURE);
 }
 
+/**
+ * Build the dag from the input text; Names are only copied once they are interned.
+ * A loaded snapshot replaces the text
+ */
+dag::Graph build_from_text(std::string_view text, const Options& options) {
+    if (options.loadSnapshot != "") {
+        return dag::load_snapshot(options.loadSnapshot);
+    }
+
+    auto dependencies = dag::canonicalize_dependencies(dag::parse_dependencies(text, options.threads));
+    auto graph = dag::build_graph(dependencies, options.build);
+
+    if (options.build.reduce) {
+        std::cerr << "Removed " << graph.removedEdges << " of " << graph.edge_count() + graph.removedEdges
+            << " edges" << std::endl;
+    }
+    if (options.saveSnapshot != "") {
+        dag::save_snapshot(graph, options.saveSnapshot);
+    }
+    return graph;
+}
+
+/**
+ * Write the canonical form of the input text to the output file
+ */
+void write_canonical(std::string_view text, const Options& options) {
+    auto canonical = dag::canonicalize_dependencies(dag::parse_dependencies(text, options.threads), true);
+    std::ostringstream stream;
+    dag::write_dependencies(canonical, stream);
+
+    if (options.output.file == "-") {
+        dag::write_text(STDOUT_FILENO, stream.str());
+        return;
+    }
+    std::ofstream file(options.output.file, std::ios::binary);
+    if (!(file << stream.str()) || !file.flush()) {
+        throw Exception("Unable to write " + options.output.file);
+    }
+}
+
+/**
+ * Every setting that changes the output bytes
+ */
+std::string cache_context(const Options& options) {
+    const auto& build = options.build;
+    const auto& file = options.output.file;
+    std::ostringstream context;
+
+    context << VERSION << "\nformat " << static_cast<int>(options.output.format)
+        << "\ncompact " << options.output.compactSvg
+        << "\ncompressed " << (file.size() > 5 && file.compare(file.size() - 5, 5, ".svgz") == 0)
+        << "\nlayout " << static_cast<int>(build.layout.engine) << " " << build.layout.maxSweeps << " " << build.layout.timeBudgetMs
+        << "\ncondense " << build.condenseCycles << "\nreduce " << build.reduce
+        << "\nfocus " << build.focus.up << " " << build.focus.down;
+    for (const auto& root: build.focus.roots) {
+        context << "\n" << root;
+    }
+    context << "\ncollapse " << build.collapse.depth << " " << build.collapse.automatic << " "
+        << build.collapse.maxNodes << " " << build.collapse.separator << "\n";
+
+    return context.str();
+}
+
+/**
+ * Draw through the result cache. The input bytes are hashed first, so an unchanged input
+ * only costs the hash and a copy. Otherwise the sorted dependencies are hashed, which also
+ * finds inputs that list the same dependencies in another order
+ */
+void draw_cached(std::string_view text, const Options& options) {
+    dag::ResultCache cache(options.cache);
+    auto output = options.output;
+    output.threads = options.threads;
+    output.openViewer = false;
+    const auto context = cache_context(options);
+
+    auto inputKey = dag::cache_key(text, context);
+    if (!cache.fetch(inputKey, output.file)) {
+        auto canonical = dag::canonicalize_dependencies(dag::parse_dependencies(text, options.threads), true);
+        std::ostringstream canonicalText;
+        dag::write_dependencies(canonical, canonicalText);
+
+        auto key = dag::cache_key(canonicalText.str(), context);
+        if (!cache.fetch(key, output.file)) {
+            auto graph = dag::build_graph(canonical, options.build);
+            auto stored = output;
+            stored.file = cache.temporary_path(output.file);
+            dag::write_output(graph, stored);
+            cache.store(stored.file, key);
+
+            // Another process may evict the entry right away
+            if (!cache.fetch(key, output.file)) {
+                dag::write_output(graph, output);
+            }
+            cache.evict();
+        }
+        cache.link(key, inputKey);
+    }
+
+    if (options.output.openViewer) {
+        dag::open_viewer(output.file);
+    }
+}
+
+/**
+ * Answer the command line queries, then the batch file; One output line per query
+ */
+void query_from_text(std::string_view text, const Options& options) {
+    auto graph = build_from_text(text, options);
+    dag::NameLookup lookup(graph);
+    dag::ReachabilityIndex index(graph);
+
+    auto queries = options.queries;
+    if (options.batchFile != "") {
+        std::ifstream batch(options.batchFile);
+        if (!batch) {
+            throw Exception("Unable to open " + options.batchFile);
+        }
+
+        std::string line;
+        while (std::getline(batch, line)) {
+            if (trim_copy(line) != "" && trim_copy(line)[0] != '#') {
+                queries.push_back(line);
+            }
+        }
+    }
+
+    TRACE_SCOPE("answer_queries");
+    std::ostringstream answers;
+    for (const auto& query: queries) {
+        dag::answer_query(graph, lookup, index, query, answers);
+    }
+    std::cout << answers.str() << std::flush;
+}
+
+/**
+ * Print the outcome of a node that has a command
+ */
+void print_task_result(const dag::Graph& graph, const std::vector<std::string>& commands, const dag::TaskResult& result) {
+    if (commands[result.node].empty()) return;
+
+    char duration[32];
+    snprintf(duration, sizeof(duration), "%.1f ms", result.durationMs);
+
+    if (result.status == dag::TaskStatus::Succeeded) {
+        std::cerr << "[ok]   " << graph.name(result.node) << " " << duration << std::endl;
+    } else if (result.status == dag::TaskStatus::Failed) {
+        std::cerr << "[fail] " << graph.name(result.node) << " exit " << result.exitCode << " " << duration << std::endl;
+    } else {
+        std::cerr << "[skip] " << graph.name(result.node) << std::endl;
+    }
+}
+
+/**
+ * Execute the node commands of the input text; Returns false if any command failed
+ */
+bool run_from_text(std::string_view text, const Options& options) {
+    auto input = dag::split_task_input(text);
+    auto graph = build_from_text(input.dependencies, options);
+    auto commands = dag::assign_commands(graph, input.commands);
+
+    auto runOptions = options.run;
+    runOptions.onFinish = [&](const dag::TaskResult& result) {
+        print_task_result(graph, commands, result);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto results = dag::run_tasks(graph, commands, runOptions);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t counts[3] = { 0, 0, 0 };
+    for (const auto& result: results) {
+        if (!commands[result.node].empty()) {
+            counts[static_cast<int>(result.status)]++;
+        }
+    }
+
+    char summary[128];
+    snprintf(summary, sizeof(summary), "%zu succeeded, %zu failed, %zu skipped in %.1f ms",
+        counts[0], counts[1], counts[2], elapsed.count());
+    std::cerr << summary << std::endl;
+
+    return counts[static_cast<int>(dag::TaskStatus::Failed)] == 0;
+}
+
+/**
+ * Redraw the output whenever the size or modification time of the watched file changes;
+ * Only the changed lines are applied to the graph. Runs until interrupted
+ */
+void watch_file(const Options& options) {
+    dag::IncrementalGraph graph;
+    dag::WatchRecords records;
+    auto output = options.output;
+    output.threads = options.threads;
+    struct stat last = {};
+
+    for (;;) {
+        struct stat current;
+        if (stat(options.watchFile.c_str(), &current) != 0) {
+            throw Exception("Unable to read " + options.watchFile);
+        }
+
+        if (current.st_size != last.st_size || current.st_mtim.tv_sec != last.st_mtim.tv_sec
+            || current.st_mtim.tv_nsec != last.st_mtim.tv_nsec) {
+
+            last = current;
+            // Read instead of mapping since the file may shrink while it is parsed
+            int fd = open(options.watchFile.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw Exception("Unable to read " + options.watchFile);
+            }
+            auto text = dag::read_input(fd);
+            close(fd);
+
+            auto start = std::chrono::steady_clock::now();
+            auto summary = dag::apply_dependencies(graph, records, text, std::cerr);
+            dag::write_output(graph.to_graph(), output);
+            output.openViewer = false;
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            char line[256];
+            snprintf(line, sizeof(line), "+%zu -%zu nodes, +%zu -%zu edges, %zu rejected, %zu moved in %.1f ms",
+                summary.addedNodes, summary.removedNodes, summary.addedEdges, summary.removedEdges,
+                summary.rejectedEdges, summary.moved.size(), elapsed.count());
+            std::cerr << line << std::endl;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_INTERVAL_MS));
+    }
+}
+
 int main(int argc, const char** argv) {
     signal(SIGSEGV, shutdown_handler);
+
     // Check for command line parameters
-    if (argc > 1 && std::string(argv[1]) == "-v") {
+    Options options;
+    try {
+        options = parse_arguments(argc, argv);
+    } catch (Exception& e) {
+        std::cerr << "Error: " << e.getMessage() << std::endl;
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (options.showVersion) {
         std::cout << VERSION << std::endl;
         return EXIT_SUCCESS;
     }
-    // Collect parsed lines
-    std::vector<std::string> lines = parse_stdin();
-    // Convert parsed lines to dependency structs
-    dag::dependency_vec dependencies = dag::convert_dependencies(lines);
-    dag::node_vec startNodes;
-    build_dag(dependencies, startNodes);
-
-    //auto nodeCount = get_node_count(startNodes);
-    //std::cout << "Created dag with " << nodeCount << " nodes" << std::endl;
-
-    //std::cout << "#######" << std::endl;
-    //std::cout << "# DAG #" << std::endl;
-    //std::cout << "#######" << std::endl;
-    //print_nodes(startNodes); 
-    //std::cout << std::endl;
-
-    write_svg(startNodes, "/tmp/dag.svg");
-    system("open /tmp/dag.svg");
-    //remove("/tmp/dag.svg");
-    return EXIT_SUCCESS;
-} 
+
+    if (options.showStats || options.traceFile != "") {
+        dag::enable_tracing();
+    }
+
+    int status = EXIT_SUCCESS;
+    try {
+        TRACE_SCOPE("dag");
+        if (options.watchFile != "") {
+            watch_file(options);
+        }
+
+        std::unique_ptr<dag::MappedFile> file;
+        std::string input;
+        std::string_view text;
+        if (options.loadSnapshot != "") {
+            // The snapshot is read when the graph is needed
+        } else if (options.inputFile != "") {
+            // Map the file and tokenize it in place
+            file = std::make_unique<dag::MappedFile>(options.inputFile);
+            text = file->text();
+        } else {
+            // Collect stdin in one buffer
+            input = dag::read_input(STDIN_FILENO);
+            text = input;
+        }
+
+        if (options.mode == Mode::Run) {
+            if (!run_from_text(text, options)) {
+                status = EXIT_FAILURE;
+            }
+        } else if (options.mode == Mode::Query) {
+            query_from_text(text, options);
+        } else if (options.mode == Mode::Serve) {
+            auto server = options.server;
+            server.layout = options.build.layout;
+            server.output = options.output;
+            server.output.threads = options.threads;
+
+            // Clients that disconnect early must not end the server
+            signal(SIGPIPE, SIG_IGN);
+            dag::GraphServer(build_from_text(text, options), server).serve();
+        } else if (options.mode == Mode::Analyze) {
+            auto graph = build_from_text(text, options);
+            auto analysis = dag::analyze_critical_path(graph);
+            if (options.json) {
+                dag::write_analysis_json(graph, analysis, std::cout);
+            } else {
+                dag::write_analysis_text(graph, analysis, std::cout);
+            }
+        } else if (options.canonical) {
+            write_canonical(text, options);
+        } else if (options.cache.directory != "") {
+            draw_cached(text, options);
+        } else {
+            auto graph = build_from_text(text, options);
+            auto output = options.output;
+            output.threads = options.threads;
+            dag::write_output(graph, output);
+
+            // Automatic collapsing leaves small graphs as they are
+            if (options.drillDownDirectory != "" && graph.expanded) {
+                dag::write_drill_downs(graph, options.drillDownDirectory, output, options.build.layout);
+            }
+        }
+    } catch (Exception& e) {
+        std::cerr << "Error: " << e.getMessage() << std::endl;
+        status = EXIT_FAILURE;
+    }
+
+    // Slow failures are reported as well
+    try {
+        report_instrumentation(options);
+    } catch (Exception& e) {
+        std::cerr << "Error: " << e.getMessage() << std::endl;
+        status = EXIT_FAILURE;
+    }
+
+    return status;
+}
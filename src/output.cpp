@@ -0,0 +1,271 @@
+#include <cctype>
+#include <cerrno>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "output.hpp"
+#include "analysis.hpp"
+#include "stdafx.hpp"
+#include "svg.hpp"
+#include "trace.hpp"
+
+extern char** environ;
+
+namespace dag {
+    const std::string SVGZ_EXTENSION = ".svgz";      // Svg files with this extension are compressed
+    const size_t MAX_DRILL_DOWN_NAME = 64;
+
+#ifdef __APPLE__
+    const char* VIEWER = "open";
+#else
+    const char* VIEWER = "xdg-open";
+#endif
+
+    OutputFormat parse_output_format(const std::string& name) {
+        if (name == "svg") return OutputFormat::Svg;
+        if (name == "dot") return OutputFormat::Dot;
+        if (name == "json") return OutputFormat::Json;
+        if (name == "text") return OutputFormat::Text;
+
+        throw Exception("Unknown format " + name);
+    }
+
+    /**
+     * Write the whole text; Continues partial writes
+     */
+    void write_text(int fd, std::string_view text) {
+        TRACE_SCOPE("write_text");
+        for (size_t written = 0; written < text.size();) {
+            auto result = ::write(fd, text.data() + written, text.size() - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) {
+                throw Exception("Unable to write output");
+            }
+            written += result;
+        }
+    }
+
+    /**
+     * Backend that formats the whole graph into a string before writing it
+     */
+    class _TextBackend : public OutputBackend {
+        protected:
+        virtual void format(const Graph& graph, std::ostream& stream) const = 0;
+
+        public:
+        void write(const Graph& graph, int fd) const override {
+            std::ostringstream stream;
+            this->format(graph, stream);
+            write_text(fd, stream.str());
+        }
+    };
+
+    /**
+     * Boxes and lines with the critical path highlighted
+     */
+    class _SvgBackend : public OutputBackend {
+        protected:
+        SvgOptions options;
+
+        public:
+        _SvgBackend(const SvgOptions& options) : options(options) {}
+
+        void write(const Graph& graph, int fd) const override {
+            write_svg(graph, fd, this->options);
+        }
+    };
+
+    /**
+     * Graphviz digraph; Every node is declared, so nodes without edges are kept
+     */
+    class _DotBackend : public _TextBackend {
+        static void write_id(std::ostream& stream, std::string_view name) {
+            stream << '"';
+            for (auto c: name) {
+                if (c == '"' || c == '\\') stream << '\\';
+                stream << c;
+            }
+            stream << '"';
+        }
+
+        protected:
+        void format(const Graph& graph, std::ostream& stream) const override {
+            TRACE_SCOPE("write_dot");
+            stream << "digraph dag {\n";
+            for (node_id node = 0; node < graph.size(); node++) {
+                stream << "  ";
+                write_id(stream, graph.name(node));
+                stream << ";\n";
+            }
+            for (node_id node = 0; node < graph.size(); node++) {
+                for (auto i = graph.childOffsets[node]; i < graph.childOffsets[node + 1]; i++) {
+                    stream << "  ";
+                    write_id(stream, graph.name(node));
+                    stream << " -> ";
+                    write_id(stream, graph.name(graph.childIds[i]));
+                    // Collapsed edges are labelled with the number of edges they stand for
+                    if (!graph.edgeWeights.empty() && graph.edgeWeights[i] > 1) {
+                        stream << " [label=\"" << graph.edgeWeights[i] << "\"]";
+                    }
+                    stream << ";\n";
+                }
+            }
+            stream << "}\n";
+        }
+    };
+
+    /**
+     * Nodes with cost, layer and position; Edges refer to nodes by index
+     */
+    class _JsonBackend : public _TextBackend {
+        protected:
+        void format(const Graph& graph, std::ostream& stream) const override {
+            TRACE_SCOPE("write_json");
+            stream << "{\"nodes\":[";
+            for (node_id node = 0; node < graph.size(); node++) {
+                stream << (node ? ",\n" : "\n") << "{\"name\":";
+                write_json_string(stream, graph.name(node));
+                stream << ",\"cost\":";
+                write_json_number(stream, graph.costs[node]);
+                stream << ",\"layer\":" << graph.layers[node]
+                    << ",\"x\":" << graph.x[node]
+                    << ",\"y\":" << graph.y[node] << "}";
+            }
+
+            stream << "\n],\"edges\":[";
+            bool first = true;
+            for (node_id node = 0; node < graph.size(); node++) {
+                for (auto child: graph.children(node)) {
+                    stream << (first ? "\n" : ",\n") << "[" << node << "," << child << "]";
+                    first = false;
+                }
+            }
+            stream << "\n]}\n";
+        }
+    };
+
+    /**
+     * Indented tree below every start node
+     */
+    class _NodeTextBackend : public _TextBackend {
+        protected:
+        void format(const Graph& graph, std::ostream& stream) const override {
+            TRACE_SCOPE("print_nodes");
+            print_nodes(graph, stream);
+        }
+    };
+
+    std::unique_ptr<OutputBackend> make_output_backend(const OutputOptions& options) {
+        switch (options.format) {
+            case OutputFormat::Dot: return std::make_unique<_DotBackend>();
+            case OutputFormat::Json: return std::make_unique<_JsonBackend>();
+            case OutputFormat::Text: return std::make_unique<_NodeTextBackend>();
+            default: {
+                SvgOptions svg;
+                svg.threads = options.threads;
+                svg.compact = options.compactSvg;
+                svg.gzip = options.file.size() > SVGZ_EXTENSION.size() && options.file.compare(options.file.size() - SVGZ_EXTENSION.size(), SVGZ_EXTENSION.size(), SVGZ_EXTENSION) == 0;
+                return std::make_unique<_SvgBackend>(svg);
+            }
+        }
+    }
+
+    /**
+     * Write the graph to the file or standard output, then open the viewer if requested
+     */
+    void write_output(const Graph& graph, const OutputOptions& options) {
+        auto backend = make_output_backend(options);
+        if (options.file == "-") {
+            backend->write(graph, STDOUT_FILENO);
+            return;
+        }
+
+        auto fd = open(options.file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            throw Exception("Unable to open " + options.file);
+        }
+
+        try {
+            backend->write(graph, fd);
+        } catch (Exception&) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+
+        if (options.openViewer) {
+            open_viewer(options.file);
+        }
+    }
+
+    /**
+     * File name for the drill down of a node; Keeps letters, digits, dots and dashes of the name
+     */
+    std::string _drill_down_filename(const Graph& graph, node_id node) {
+        std::string filename = std::to_string(node) + "-";
+        for (auto c: graph.name(node)) {
+            filename.push_back(std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-' ? c : '_');
+            if (filename.size() >= MAX_DRILL_DOWN_NAME) break;
+        }
+        return filename + ".svg";
+    }
+
+    /**
+     * Write one svg per collapsed node with the nodes it stands for into the directory;
+     * Nodes that stand for a single node are skipped
+     */
+    void write_drill_downs(const Graph& graph, const std::string& directory, const OutputOptions& options,
+        const LayoutOptions& layout) {
+
+        TRACE_SCOPE("write_drill_downs");
+        if (!graph.expanded) {
+            throw Exception("Drill downs need a collapsed graph");
+        }
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw Exception("Unable to create " + directory);
+        }
+
+        std::vector<id_vec> members(graph.size());
+        for (node_id node = 0; node < graph.clusters.size(); node++) {
+            members[graph.clusters[node]].push_back(node);
+        }
+
+        BuildOptions build;
+        build.layout = layout;
+        SvgOptions svg;
+        svg.threads = options.threads;
+        svg.compact = options.compactSvg;
+
+        for (node_id node = 0; node < graph.size(); node++) {
+            if (members[node].size() < 2) continue;
+
+            auto detail = extract_subgraph(*graph.expanded, members[node], build);
+            write_svg(detail, directory + "/" + _drill_down_filename(graph, node), svg);
+        }
+    }
+
+    /**
+     * Hand the file to the desktop's default viewer without going through a shell
+     */
+    void open_viewer(const std::string& filename) {
+        const char* arguments[] = { VIEWER, filename.c_str(), nullptr };
+        pid_t pid;
+
+        if (posix_spawnp(&pid, VIEWER, nullptr, nullptr, const_cast<char* const*>(arguments), environ) != 0) {
+            throw Exception(std::string("Unable to start ") + VIEWER);
+        }
+
+        int status;
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) return;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            throw Exception(std::string(VIEWER) + " failed for " + filename);
+        }
+    }
+}
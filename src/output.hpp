@@ -0,0 +1,47 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+#include <memory>
+#include <string>
+#include <string_view>
+#include "dag.hpp"
+
+namespace dag {
+    /**
+     * File formats for a finished graph
+     */
+    enum class OutputFormat {
+        Svg,
+        Dot,            // Graphviz input
+        Json,           // Nodes with their position and the edges between them
+        Text            // Indented node tree
+    };
+
+    /**
+     * Settings for writing a graph
+     */
+    struct OutputOptions {
+        OutputFormat format = OutputFormat::Svg;
+        std::string file = "-";         // Standard output if "-"
+        unsigned threads = 1;           // Formatting threads where the backend supports them
+        bool compactSvg = false;        // Shared node box, merged edge paths and css classes
+        bool openViewer = false;        // Show the written file in the default viewer
+    };
+
+    /**
+     * Writes a graph in one format to a file descriptor
+     */
+    class OutputBackend {
+        public:
+        virtual ~OutputBackend() = default;
+        virtual void write(const Graph& graph, int fd) const = 0;
+    };
+
+    OutputFormat parse_output_format(const std::string& name);
+    std::unique_ptr<OutputBackend> make_output_backend(const OutputOptions& options);
+    void write_text(int fd, std::string_view text);
+    void write_output(const Graph& graph, const OutputOptions& options);
+    void write_drill_downs(const Graph& graph, const std::string& directory, const OutputOptions& options,
+        const LayoutOptions& layout);
+    void open_viewer(const std::string& filename);
+}
+#endif
@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "reachability.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    /**
+     * Build the closure if it fits the budget, interval labels otherwise
+     */
+    ReachabilityIndex::ReachabilityIndex(const Graph& graph, size_t maxClosureBytes)
+        : graph(graph) {
+        TRACE_SCOPE("build_reachability_index");
+        const size_t words = (graph.size() + 63) / 64;
+
+        if (graph.size() * words * sizeof(uint64_t) <= maxClosureBytes) {
+            this->rowWords = std::max<size_t>(words, 1);
+            this->build_closure();
+        } else {
+            this->build_labels();
+        }
+
+        this->visited.assign(graph.size(), 0);
+    }
+
+    /**
+     * Every row is the union of the rows and bits of the node's children, in reverse topological order
+     */
+    void ReachabilityIndex::build_closure() {
+        this->closure.assign(this->graph.size() * this->rowWords, 0);
+        TRACE_COUNT(EdgesVisited, this->graph.edge_count());
+
+        for (auto i = this->graph.topologicalOrder.size(); i-- > 0;) {
+            const auto node = this->graph.topologicalOrder[i];
+            auto row = &this->closure[node * this->rowWords];
+
+            for (auto child: this->graph.children(node)) {
+                const auto childRow = &this->closure[child * this->rowWords];
+                for (size_t word = 0; word < this->rowWords; word++) {
+                    row[word] |= childRow[word];
+                }
+                row[child / 64] |= uint64_t(1) << (child % 64);
+            }
+        }
+    }
+
+    /**
+     * Depth first traversals with different child orders; Every node gets its post order rank
+     * and the smallest rank among its descendants, so a reachable node's interval is nested.
+     * Ranks inside a spanning tree subtree are contiguous, which proves reachability
+     */
+    void ReachabilityIndex::build_labels() {
+        const auto nodeCount = this->graph.size();
+        std::mt19937 random(0x5eed);
+        std::vector<bool> seen;
+
+        struct Frame {
+            node_id node;
+            uint32_t next;      // Next child in the traversal order
+        };
+        std::vector<Frame> frames;
+        id_vec order(this->graph.childIds);
+
+        for (size_t label = 0; label < REACH_LABEL_COUNT; label++) {
+            auto& low = this->labelLow[label];
+            auto& rank = this->labelRank[label];
+            auto& tree = this->treeLow[label];
+            low.assign(nodeCount, 0);
+            rank.assign(nodeCount, 0);
+            tree.assign(nodeCount, 0);
+            seen.assign(nodeCount, false);
+            TRACE_COUNT(EdgesVisited, this->graph.edge_count());
+
+            // First pass in input order, then reversed, then shuffled children
+            for (node_id node = 0; node < nodeCount && label > 0; node++) {
+                auto first = order.begin() + this->graph.childOffsets[node];
+                auto last = order.begin() + this->graph.childOffsets[node + 1];
+                if (label == 1) {
+                    std::reverse(first, last);
+                } else {
+                    std::shuffle(first, last, random);
+                }
+            }
+
+            uint32_t counter = 0;
+            for (size_t i = 0; i < this->graph.startNodes.size(); i++) {
+                const auto root = this->graph.startNodes[label == 1 ? this->graph.startNodes.size() - 1 - i : i];
+                frames.push_back(Frame { root, this->graph.childOffsets[root] });
+                seen[root] = true;
+                tree[root] = counter;
+
+                while (!frames.empty()) {
+                    auto& frame = frames.back();
+
+                    if (frame.next == this->graph.childOffsets[frame.node + 1]) {
+                        const auto node = frame.node;
+                        rank[node] = counter++;
+                        low[node] = rank[node];
+                        for (auto child: this->graph.children(node)) {
+                            low[node] = std::min(low[node], low[child]);
+                        }
+                        frames.pop_back();
+                        continue;
+                    }
+
+                    const auto child = order[frame.next++];
+                    if (!seen[child]) {
+                        seen[child] = true;
+                        tree[child] = counter;
+                        frames.push_back(Frame { child, this->graph.childOffsets[child] });
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * False if the labels prove that the target is not below the node
+     */
+    bool ReachabilityIndex::may_reach(node_id from, node_id to) const {
+        if (this->graph.layers[from] >= this->graph.layers[to]) return false;
+
+        for (size_t label = 0; label < REACH_LABEL_COUNT; label++) {
+            if (this->labelLow[label][to] < this->labelLow[label][from] || this->labelRank[label][to] > this->labelRank[label][from]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * True if the target lies in the node's subtree of any spanning tree
+     */
+    bool ReachabilityIndex::must_reach(node_id from, node_id to) const {
+        for (size_t label = 0; label < REACH_LABEL_COUNT; label++) {
+            const auto rank = this->labelRank[label][to];
+            if (this->treeLow[label][from] <= rank && rank < this->labelRank[label][from]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Start a new search; Clears the visited marks when the counter wraps
+     */
+    uint32_t ReachabilityIndex::next_epoch() const {
+        if (++this->epoch == 0) {
+            std::fill(this->visited.begin(), this->visited.end(), 0);
+            this->epoch = 1;
+        }
+        return this->epoch;
+    }
+
+    /**
+     * Check whether the target is a descendant of the node; A node does not reach itself
+     */
+    bool ReachabilityIndex::reaches(node_id from, node_id to) const {
+        if (this->uses_closure()) {
+            return this->closure[from * this->rowWords + to / 64] >> (to % 64) & 1;
+        }
+        if (from == to || !this->may_reach(from, to)) return false;
+        if (this->must_reach(from, to)) return true;
+
+        // Search only below nodes the labels cannot rule out; The deepest child is expanded first
+        const auto mark = this->next_epoch();
+        this->stack.assign(1, from);
+        while (!this->stack.empty()) {
+            const auto node = this->stack.back();
+            this->stack.pop_back();
+            const auto firstPushed = this->stack.size();
+
+            for (auto child: this->graph.children(node)) {
+                if (child == to) return true;
+                if (this->visited[child] == mark || !this->may_reach(child, to)) continue;
+                if (this->must_reach(child, to)) return true;
+
+                this->visited[child] = mark;
+                this->stack.push_back(child);
+                if (this->graph.layers[child] > this->graph.layers[this->stack[firstPushed]]) {
+                    std::swap(this->stack[firstPushed], this->stack.back());
+                }
+            }
+            if (this->stack.size() > firstPushed) {
+                std::swap(this->stack[firstPushed], this->stack.back());
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * All nodes below the given node in id order
+     */
+    id_vec ReachabilityIndex::descendants(node_id node) const {
+        id_vec result;
+
+        if (this->uses_closure()) {
+            const auto row = &this->closure[node * this->rowWords];
+            for (size_t word = 0; word < this->rowWords; word++) {
+                for (auto bits = row[word]; bits; bits &= bits - 1) {
+                    result.push_back(static_cast<node_id>(word * 64 + __builtin_ctzll(bits)));
+                }
+            }
+            return result;
+        }
+
+        const auto mark = this->next_epoch();
+        this->stack.assign(1, node);
+        while (!this->stack.empty()) {
+            const auto next = this->stack.back();
+            this->stack.pop_back();
+
+            for (auto child: this->graph.children(next)) {
+                if (this->visited[child] == mark) continue;
+                this->visited[child] = mark;
+                this->stack.push_back(child);
+                result.push_back(child);
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    /**
+     * All nodes above the given node in id order
+     */
+    id_vec ReachabilityIndex::ancestors(node_id node) const {
+        id_vec result;
+
+        if (this->uses_closure()) {
+            for (node_id id = 0; id < this->graph.size(); id++) {
+                if (this->closure[id * this->rowWords + node / 64] >> (node % 64) & 1) {
+                    result.push_back(id);
+                }
+            }
+            return result;
+        }
+
+        const auto mark = this->next_epoch();
+        this->stack.assign(1, node);
+        while (!this->stack.empty()) {
+            const auto next = this->stack.back();
+            this->stack.pop_back();
+
+            for (auto ancestor: this->graph.ancestors(next)) {
+                if (this->visited[ancestor] == mark) continue;
+                this->visited[ancestor] = mark;
+                this->stack.push_back(ancestor);
+                result.push_back(ancestor);
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    /**
+     * Index all node names of the graph
+     */
+    NameLookup::NameLookup(const Graph& graph) {
+        this->names.reserve(graph.size());
+        for (node_id id = 0; id < graph.size(); id++) {
+            intern_name(this->ids, this->names, graph.name(id));
+        }
+    }
+
+    node_id NameLookup::find(std::string_view name) const {
+        return find_name(this->ids, this->names, name);
+    }
+
+    /**
+     * Answer a single `descendants, X`, `ancestors, X` or `depends, A, B` query with one line;
+     * A depends on B if A is a descendant of B
+     */
+    void answer_query(const Graph& graph, const NameLookup& lookup, const ReachabilityIndex& index,
+        std::string_view query, std::ostream& stream) {
+
+        const size_t MAX_FIELDS = 3;
+        std::string_view fields[MAX_FIELDS];
+        size_t fieldCount = 0;
+        for (size_t start = 0; start <= query.size(); fieldCount++) {
+            auto end = std::min(query.find(',', start), query.size());
+            if (fieldCount == MAX_FIELDS) {
+                throw Exception("Invalid query " + std::string(query));
+            }
+
+            auto field = query.substr(start, end - start);
+            while (!field.empty() && std::isspace(static_cast<unsigned char>(field.front()))) field.remove_prefix(1);
+            while (!field.empty() && std::isspace(static_cast<unsigned char>(field.back()))) field.remove_suffix(1);
+            fields[fieldCount] = field;
+            start = end + 1;
+        }
+
+        node_id nodes[MAX_FIELDS];
+        for (size_t i = 1; i < fieldCount; i++) {
+            nodes[i - 1] = lookup.find(fields[i]);
+            if (nodes[i - 1] == NO_NODE) {
+                throw Exception("Unknown node " + std::string(fields[i]) + " in query " + std::string(query));
+            }
+        }
+
+        if (fieldCount == 3 && fields[0] == "depends") {
+            stream << (index.reaches(nodes[1], nodes[0]) ? "true" : "false") << "\n";
+        } else if (fieldCount == 2 && (fields[0] == "descendants" || fields[0] == "ancestors")) {
+            auto result = fields[0] == "descendants" ? index.descendants(nodes[0]) : index.ancestors(nodes[0]);
+            for (size_t i = 0; i < result.size(); i++) {
+                stream << (i ? ", " : "") << graph.name(result[i]);
+            }
+            stream << "\n";
+        } else {
+            throw Exception("Invalid query " + std::string(query));
+        }
+    }
+}
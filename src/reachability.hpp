@@ -0,0 +1,61 @@
+#ifndef REACHABILITY_HPP
+#define REACHABILITY_HPP
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "dag.hpp"
+
+namespace dag {
+    const size_t REACH_LABEL_COUNT = 3;                     // Interval labels per node for large graphs
+    const size_t MAX_CLOSURE_BYTES = size_t(64) << 20;     // Largest transitive closure kept as bit rows
+
+    /**
+     * Precomputed answers to reachability questions about a graph. Graphs whose closure fits
+     * the budget keep one descendant bitset per node. Larger ones keep post order interval
+     * labels and only search where the labels cannot rule the target out.
+     * Queries share scratch space, so an index must not be used by several threads at once.
+     */
+    class ReachabilityIndex {
+        protected:
+        const Graph& graph;
+        size_t rowWords = 0;                    // Words per closure row; 0 if labels are used
+        std::vector<uint64_t> closure;
+        std::vector<uint32_t> labelLow[REACH_LABEL_COUNT];     // Smallest post order rank below the node
+        std::vector<uint32_t> labelRank[REACH_LABEL_COUNT];    // Post order rank of the node
+        std::vector<uint32_t> treeLow[REACH_LABEL_COUNT];      // Smallest rank in the node's spanning tree subtree
+        mutable std::vector<uint32_t> visited;  // Epoch of the last search that reached the node
+        mutable uint32_t epoch = 0;
+        mutable id_vec stack;
+
+        void build_closure();
+        void build_labels();
+        bool may_reach(node_id from, node_id to) const;
+        bool must_reach(node_id from, node_id to) const;
+        uint32_t next_epoch() const;
+
+        public:
+        ReachabilityIndex(const Graph& graph, size_t maxClosureBytes = MAX_CLOSURE_BYTES);
+
+        bool uses_closure() const { return rowWords != 0; }
+        bool reaches(node_id from, node_id to) const;
+        id_vec descendants(node_id node) const;
+        id_vec ancestors(node_id node) const;
+    };
+
+    /**
+     * Looks up node ids by name
+     */
+    struct NameLookup {
+        name_index ids;
+        std::vector<std::string_view> names;
+
+        NameLookup(const Graph& graph);
+        node_id find(std::string_view name) const;
+    };
+
+    void answer_query(const Graph& graph, const NameLookup& lookup, const ReachabilityIndex& index,
+        std::string_view query, std::ostream& stream);
+}
+#endif
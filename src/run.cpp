@@ -0,0 +1,290 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cerrno>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "run.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+extern char** environ;
+
+namespace dag {
+    const char* SHELL = "/bin/sh";
+
+    /**
+     * Separate `name: command` lines from the dependency lines; A line is a command if its
+     * first colon comes before any arrow or comma, so commands may use redirections and lists
+     */
+    TaskInput split_task_input(std::string_view text) {
+        TaskInput input;
+        input.dependencies.reserve(text.size());
+
+        size_t lineStart = 0;
+        while (lineStart < text.size()) {
+            auto lineEnd = text.find('\n', lineStart);
+            lineEnd = lineEnd == std::string_view::npos ? text.size() : lineEnd;
+            auto line = text.substr(lineStart, lineEnd - lineStart);
+            lineStart = lineEnd + 1;
+
+            auto trimmed = trim_copy(std::string(line));
+            auto colon = line.find_first_of(":>,");
+            if (trimmed.empty() || trimmed[0] == '#' || colon == std::string_view::npos || line[colon] != ':') {
+                input.dependencies.append(line);
+                input.dependencies.push_back('\n');
+                continue;
+            }
+
+            auto name = trim_copy(std::string(line.substr(0, colon)));
+            if (name.empty()) {
+                throw Exception("Missing node name for command " + trimmed);
+            }
+
+            // The node exists even if no dependency mentions it
+            input.dependencies.append(name);
+            input.dependencies.push_back('\n');
+            input.commands.push_back(TaskCommand { name, trim_copy(std::string(line.substr(colon + 1))) });
+        }
+
+        return input;
+    }
+
+    /**
+     * Look up the node of every command; Nodes without a command succeed immediately
+     */
+    std::vector<std::string> assign_commands(const Graph& graph, const std::vector<TaskCommand>& commands) {
+        std::unordered_map<std::string_view, node_id> ids;
+        for (node_id id = 0; id < graph.size(); id++) {
+            ids.emplace(graph.name(id), id);
+        }
+
+        std::vector<std::string> assigned(graph.size());
+        std::vector<bool> seen(graph.size(), false);
+        for (const auto& command: commands) {
+            auto found = ids.find(command.name);
+            if (found == ids.end()) {
+                throw Exception("No node for command " + command.name);
+            }
+            if (seen[found->second]) {
+                throw Exception("Duplicate command for " + command.name);
+            }
+
+            seen[found->second] = true;
+            assigned[found->second] = command.command;
+        }
+
+        return assigned;
+    }
+
+    /**
+     * Run the command with the shell and wait for it; Returns the exit status
+     */
+    int _run_command(const std::string& command) {
+        const char* arguments[] = { "sh", "-c", command.c_str(), nullptr };
+        pid_t pid;
+
+        if (posix_spawn(&pid, SHELL, nullptr, nullptr, const_cast<char* const*>(arguments), environ) != 0) {
+            return 127;
+        }
+
+        int status;
+        while (waitpid(pid, &status, 0) == -1) {
+            if (errno != EINTR) return 127;
+        }
+
+        if (WIFEXITED(status)) return WEXITSTATUS(status);
+        return 128 + WTERMSIG(status);
+    }
+
+    /**
+     * Ready nodes of one worker; The owner works from the back, thieves take from the front
+     */
+    struct _WorkQueue {
+        std::mutex mutex;
+        std::deque<node_id> tasks;
+    };
+
+    /**
+     * Shared state of a single run
+     */
+    struct _Executor {
+        const Graph& graph;
+        const std::vector<std::string>& commands;
+        const RunOptions& options;
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        std::vector<std::unique_ptr<_WorkQueue>> queues;
+        std::unique_ptr<std::atomic<uint32_t>[]> pending;       // Unfinished ancestors
+        std::unique_ptr<std::atomic<bool>[]> blocked;           // Some ancestor did not succeed
+        std::atomic<bool> stopped { false };
+        std::atomic<size_t> remaining;
+
+        std::mutex idleMutex;
+        std::condition_variable idle;
+        size_t queued = 0;                  // Ready nodes in all queues; Guarded by idleMutex
+
+        std::mutex resultsMutex;
+        std::vector<TaskResult> results;
+
+        _Executor(const Graph& graph, const std::vector<std::string>& commands, const RunOptions& options)
+            : graph(graph), commands(commands), options(options),
+            pending(new std::atomic<uint32_t>[graph.size()]), blocked(new std::atomic<bool>[graph.size()]),
+            remaining(graph.size()) {
+        }
+
+        double elapsed_ms() const {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->start).count();
+        }
+    };
+
+    /**
+     * Queue a ready node on the given worker and wake an idle one; The node is counted before
+     * it is published, so a thief that takes it at once never drives the count below zero
+     */
+    void _push_task(_Executor& executor, unsigned worker, node_id node) {
+        {
+            std::lock_guard<std::mutex> lock(executor.idleMutex);
+            executor.queued++;
+        }
+        {
+            auto& queue = *executor.queues[worker];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(node);
+        }
+
+        std::lock_guard<std::mutex> lock(executor.idleMutex);
+        executor.idle.notify_one();
+    }
+
+    /**
+     * Take the newest local node or steal the oldest node of another worker
+     */
+    bool _pop_task(_Executor& executor, unsigned worker, node_id& node) {
+        const auto count = executor.queues.size();
+
+        for (size_t i = 0; i < count; i++) {
+            auto& queue = *executor.queues[(worker + i) % count];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+
+            if (i == 0) {
+                node = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                node = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+
+            std::lock_guard<std::mutex> idleLock(executor.idleMutex);
+            executor.queued--;
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Run or skip a single node, then release the children whose ancestors are all finished
+     */
+    void _execute_task(_Executor& executor, unsigned worker, node_id node) {
+        TRACE_SCOPE("run_task");
+        TaskResult result { node, TaskStatus::Skipped, -1, executor.elapsed_ms(), 0, worker };
+
+        if (!executor.blocked[node] && !executor.stopped) {
+            const auto& command = executor.commands[node];
+            result.exitCode = command.empty() ? 0 : _run_command(command);
+            result.status = result.exitCode == 0 ? TaskStatus::Succeeded : TaskStatus::Failed;
+            result.durationMs = executor.elapsed_ms() - result.startMs;
+
+            if (result.status == TaskStatus::Failed && !executor.options.keepGoing) {
+                executor.stopped = true;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(executor.resultsMutex);
+            executor.results.push_back(result);
+            if (executor.options.onFinish) {
+                executor.options.onFinish(result);
+            }
+        }
+
+        for (auto child: executor.graph.children(node)) {
+            if (result.status != TaskStatus::Succeeded) {
+                executor.blocked[child] = true;
+            }
+            if (--executor.pending[child] == 0) {
+                _push_task(executor, worker, child);
+            }
+        }
+
+        if (--executor.remaining == 0) {
+            std::lock_guard<std::mutex> lock(executor.idleMutex);
+            executor.idle.notify_all();
+        }
+    }
+
+    /**
+     * Work until every node is finished; Sleeps while no node is ready
+     */
+    void _run_worker(_Executor& executor, unsigned worker) {
+        while (executor.remaining > 0) {
+            node_id node;
+            if (_pop_task(executor, worker, node)) {
+                _execute_task(executor, worker, node);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(executor.idleMutex);
+            executor.idle.wait(lock, [&]() {
+                return executor.queued > 0 || executor.remaining == 0;
+            });
+        }
+    }
+
+    /**
+     * Execute the commands in dependency order on a work stealing pool; A node starts as soon
+     * as all its ancestors are finished. Returns the results in order of completion
+     */
+    std::vector<TaskResult> run_tasks(const Graph& graph, const std::vector<std::string>& commands, const RunOptions& options) {
+        TRACE_SCOPE("run_tasks");
+        _Executor executor(graph, commands, options);
+        const auto workerCount = std::max(options.jobs, 1u);
+
+        for (unsigned i = 0; i < workerCount; i++) {
+            executor.queues.push_back(std::make_unique<_WorkQueue>());
+        }
+
+        for (node_id id = 0; id < graph.size(); id++) {
+            executor.pending[id] = static_cast<uint32_t>(graph.ancestors(id).size());
+            executor.blocked[id] = false;
+        }
+
+        // Spread the start nodes over all workers; Queued in reverse, so the first one is taken first
+        unsigned next = 0;
+        for (node_id id = static_cast<node_id>(graph.size()); id-- > 0;) {
+            if (executor.pending[id] == 0) {
+                _push_task(executor, next++ % workerCount, id);
+            }
+        }
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < workerCount; i++) {
+            workers.emplace_back(_run_worker, std::ref(executor), i);
+        }
+        _run_worker(executor, 0);
+        for (auto& worker: workers) {
+            worker.join();
+        }
+
+        return executor.results;
+    }
+}
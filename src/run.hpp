@@ -0,0 +1,57 @@
+#ifndef RUN_HPP
+#define RUN_HPP
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "dag.hpp"
+
+namespace dag {
+    /**
+     * Shell command attached to a node by a `name: command` line
+     */
+    struct TaskCommand {
+        std::string name;
+        std::string command;
+    };
+
+    /**
+     * Input split into the dependency lines and the node commands
+     */
+    struct TaskInput {
+        std::string dependencies;
+        std::vector<TaskCommand> commands;
+    };
+
+    enum class TaskStatus {
+        Succeeded,
+        Failed,
+        Skipped         // An ancestor failed or the run was stopped
+    };
+
+    /**
+     * Outcome of a single node; Times are relative to the start of the run
+     */
+    struct TaskResult {
+        node_id node;
+        TaskStatus status;
+        int exitCode;           // -1 if the command did not run
+        double startMs;
+        double durationMs;
+        unsigned worker;
+    };
+
+    /**
+     * Settings for executing the dag
+     */
+    struct RunOptions {
+        unsigned jobs = 1;              // Commands running at the same time
+        bool keepGoing = false;         // Continue with unaffected nodes after a failure
+        std::function<void(const TaskResult&)> onFinish;    // Called for every node, one at a time
+    };
+
+    TaskInput split_task_input(std::string_view text);
+    std::vector<std::string> assign_commands(const Graph& graph, const std::vector<TaskCommand>& commands);
+    std::vector<TaskResult> run_tasks(const Graph& graph, const std::vector<std::string>& commands, const RunOptions& options);
+}
+#endif
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.hpp"
+#include "layout.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    const size_t CLIENT_BUFFER_SIZE = 1 << 16;
+
+    /**
+     * Fields of a request without surrounding whitespace
+     */
+    std::vector<std::string_view> _split_fields(std::string_view request) {
+        std::vector<std::string_view> fields;
+        for (size_t start = 0; start <= request.size();) {
+            auto end = std::min(request.find(',', start), request.size());
+            auto field = request.substr(start, end - start);
+            while (!field.empty() && std::isspace(static_cast<unsigned char>(field.front()))) field.remove_prefix(1);
+            while (!field.empty() && std::isspace(static_cast<unsigned char>(field.back()))) field.remove_suffix(1);
+            fields.push_back(field);
+            start = end + 1;
+        }
+        return fields;
+    }
+
+    /**
+     * Number of levels in a subgraph request; Signs and trailing characters are rejected
+     */
+    uint32_t _parse_levels(std::string_view field) {
+        uint32_t levels = 0;
+        auto result = std::from_chars(field.data(), field.data() + field.size(), levels);
+        if (field.empty() || result.ec != std::errc() || result.ptr != field.data() + field.size()) {
+            throw Exception("Expected a number instead of " + std::string(field));
+        }
+        return levels;
+    }
+
+    /**
+     * Nodes within the given number of levels above and below a root
+     */
+    id_vec _collect_neighbourhood(const Graph& graph, node_id root, uint32_t up, uint32_t down) {
+        std::unordered_set<node_id> kept { root };
+        id_vec nodes { root };
+
+        for (int direction = 0; direction < 2; direction++) {
+            id_vec level { root }, next;
+            for (uint32_t depth = 0; depth < (direction ? down : up) && !level.empty(); depth++) {
+                for (auto node: level) {
+                    for (auto other: direction ? graph.children(node) : graph.ancestors(node)) {
+                        if (!kept.insert(other).second) continue;
+                        nodes.push_back(other);
+                        next.push_back(other);
+                    }
+                }
+                level.swap(next);
+                next.clear();
+            }
+        }
+
+        // Keep the order of the full graph
+        std::sort(nodes.begin(), nodes.end());
+        return nodes;
+    }
+
+    GraphServer::Snapshot::Snapshot(Graph&& graph) :
+        graph(std::move(graph)),
+        lookup(this->graph),
+        index(this->graph) {
+    }
+
+    GraphServer::GraphServer(Graph graph, const ServerOptions& options) :
+        options(options),
+        incremental(graph),
+        snapshot(std::make_shared<Snapshot>(std::move(graph))) {
+    }
+
+    /**
+     * Snapshot of the latest version; Built by the first reader after an update
+     */
+    std::shared_ptr<GraphServer::Snapshot> GraphServer::current() {
+        {
+            std::shared_lock<std::shared_mutex> reading(this->lock);
+            if (this->snapshot) return this->snapshot;
+        }
+
+        std::unique_lock<std::shared_mutex> writing(this->lock);
+        if (!this->snapshot) {
+            TRACE_SCOPE("build_snapshot");
+            auto graph = this->incremental.to_graph();
+            layout_graph(graph, this->options.layout);
+            this->snapshot = std::make_shared<Snapshot>(std::move(graph));
+        }
+        return this->snapshot;
+    }
+
+    /**
+     * Add or remove a node or an edge; Prints how many nodes changed their layer or row
+     */
+    void GraphServer::update(const std::vector<std::string_view>& fields, std::ostream& stream) {
+        if (fields.size() < 2 || fields.size() > 3 || fields[1].empty() || (fields.size() == 3 && fields[2].empty())) {
+            throw Exception("Expected " + std::string(fields[0]) + ", NAME or " + std::string(fields[0]) + ", FROM, TO");
+        }
+
+        std::unique_lock<std::shared_mutex> writing(this->lock);
+        const auto nodeCount = this->incremental.size();
+        const auto edgeCount = this->incremental.edge_count();
+
+        id_vec moved;
+        if (fields[0] == "add") {
+            if (fields.size() == 2) {
+                this->incremental.add_node(fields[1], &moved);
+            } else {
+                moved = this->incremental.add_edge(fields[1], fields[2]);
+            }
+        } else {
+            moved = fields.size() == 2 ? this->incremental.remove_node(fields[1])
+                : this->incremental.remove_edge(fields[1], fields[2]);
+        }
+
+        if (this->incremental.size() != nodeCount || this->incremental.edge_count() != edgeCount || !moved.empty()) {
+            this->snapshot.reset();
+            this->version++;
+        }
+        stream << moved.size() << " moved\n";
+    }
+
+    /**
+     * Answer one request on the given descriptor, followed by a zero byte. Requests:
+     * render[, FORMAT]; subgraph, NAME, UP, DOWN[, FORMAT]; descendants, X; ancestors, X;
+     * depends, A, B; order; stats; add, NAME[, TO]; remove, NAME[, TO]
+     */
+    void GraphServer::answer(std::string_view request, int fd) {
+        TRACE_SCOPE("answer");
+        std::ostringstream stream;
+
+        try {
+            auto fields = _split_fields(request);
+            const auto command = fields[0];
+
+            if (command == "add" || command == "remove") {
+                this->update(fields, stream);
+            } else if (command == "render" || command == "subgraph") {
+                const size_t formatField = command == "render" ? 1 : 4;
+                if (fields.size() > formatField + 1 || (command == "subgraph" && fields.size() < 4)) {
+                    throw Exception("Expected render[, FORMAT] or subgraph, NAME, UP, DOWN[, FORMAT]");
+                }
+
+                auto output = this->options.output;
+                if (fields.size() > formatField) {
+                    output.format = parse_output_format(std::string(fields[formatField]));
+                }
+
+                auto snapshot = this->current();
+                auto backend = make_output_backend(output);
+                if (command == "render") {
+                    backend->write(snapshot->graph, fd);
+                } else {
+                    auto root = snapshot->lookup.find(fields[1]);
+                    if (root == NO_NODE) {
+                        throw Exception("Unknown node " + std::string(fields[1]));
+                    }
+
+                    BuildOptions build;
+                    build.layout = this->options.layout;
+                    auto nodes = _collect_neighbourhood(snapshot->graph, root, _parse_levels(fields[2]),
+                        _parse_levels(fields[3]));
+                    backend->write(extract_subgraph(snapshot->graph, nodes, build), fd);
+                }
+            } else if (command == "order" && fields.size() == 1) {
+                auto snapshot = this->current();
+                for (auto node: snapshot->graph.topologicalOrder) {
+                    stream << snapshot->graph.name(node) << "\n";
+                }
+            } else if (command == "stats" && fields.size() == 1) {
+                auto snapshot = this->current();
+                const auto& graph = snapshot->graph;
+                stream << "nodes " << graph.size() << "\nedges " << graph.edge_count() << "\nlayers " << graph.depth
+                    << "\nindex " << (snapshot->index.uses_closure() ? "closure" : "labels") << "\n";
+                std::shared_lock<std::shared_mutex> reading(this->lock);
+                stream << "version " << this->version << "\n";
+            } else {
+                auto snapshot = this->current();
+                std::lock_guard<std::mutex> querying(snapshot->indexLock);
+                answer_query(snapshot->graph, snapshot->lookup, snapshot->index, request, stream);
+            }
+        } catch (std::logic_error&) {
+            stream.str("");
+            stream << "Error: Expected a number in " << request << "\n";
+        } catch (Exception& e) {
+            stream.str("");
+            stream << "Error: " << e.getMessage() << "\n";
+        }
+
+        stream << '\0';
+        write_text(fd, stream.str());
+    }
+
+    /**
+     * Answer the requests of one client until it disconnects
+     */
+    void GraphServer::serve_client(int fd) {
+        std::vector<char> buffer(CLIENT_BUFFER_SIZE);
+        std::string pending;
+
+        for (;;) {
+            auto count = ::read(fd, buffer.data(), buffer.size());
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) return;
+
+            pending.append(buffer.data(), count);
+            size_t start = 0;
+            for (auto end = pending.find('\n'); end != std::string::npos; end = pending.find('\n', start)) {
+                auto line = std::string_view(pending).substr(start, end - start);
+                if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                if (!line.empty()) this->answer(line, fd);
+                start = end + 1;
+            }
+            pending.erase(0, start);
+        }
+    }
+
+    /**
+     * Listen on the socket and hand every connection to a worker; Returns only on failure
+     */
+    void GraphServer::serve() {
+        const auto& path = this->options.socket;
+        sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw Exception("Socket path too long: " + path);
+        }
+        address.sun_family = AF_UNIX;
+        path.copy(address.sun_path, path.size());
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            throw Exception("Unable to create a socket");
+        }
+        // A socket file left by an earlier server would block the address; Anything else is kept
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                close(listener);
+                throw Exception("Unable to listen on " + path);
+            }
+            unlink(path.c_str());
+        }
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+            close(listener);
+            throw Exception("Unable to listen on " + path);
+        }
+
+        std::deque<int> clients;
+        std::mutex queueLock;
+        std::condition_variable ready;
+        bool stopping = false;
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < this->options.workers; i++) {
+            workers.emplace_back([&]() {
+                for (;;) {
+                    std::unique_lock<std::mutex> waiting(queueLock);
+                    ready.wait(waiting, [&]() { return stopping || !clients.empty(); });
+                    if (clients.empty()) return;
+
+                    auto fd = clients.front();
+                    clients.pop_front();
+                    waiting.unlock();
+
+                    // A client that went away only ends its own connection
+                    try {
+                        this->serve_client(fd);
+                    } catch (Exception&) {
+                    }
+                    close(fd);
+                }
+            });
+        }
+
+        for (;;) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+            if (fd < 0) break;
+
+            std::lock_guard<std::mutex> queueing(queueLock);
+            clients.push_back(fd);
+            ready.notify_one();
+        }
+
+        {
+            std::lock_guard<std::mutex> queueing(queueLock);
+            stopping = true;
+            ready.notify_all();
+        }
+        for (auto& worker: workers) worker.join();
+        close(listener);
+        throw Exception("Unable to accept connections on " + path);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include "dag.hpp"
+#include "incremental.hpp"
+#include "output.hpp"
+#include "reachability.hpp"
+
+namespace dag {
+    /**
+     * Settings for a resident graph daemon
+     */
+    struct ServerOptions {
+        std::string socket;             // Path of the unix domain socket
+        unsigned workers = 4;           // Clients served at the same time
+        LayoutOptions layout;
+        OutputOptions output;           // Default format of render requests
+    };
+
+    /**
+     * Keeps a built graph with its indices in memory and answers requests about it. Requests
+     * are single lines with comma separated fields like the query batch files; Every response
+     * ends with a zero byte, and failed requests answer with a line starting with "Error: ".
+     * Readers work on an immutable snapshot, so they only hold the lock while taking it.
+     * Edge updates go to an incremental graph under the write lock; The next reader builds a
+     * new snapshot with a fresh layout and indices
+     */
+    class GraphServer {
+        protected:
+        /**
+         * Graph with the indices that answer queries
+         */
+        struct Snapshot {
+            Graph graph;
+            NameLookup lookup;
+            ReachabilityIndex index;
+            std::mutex indexLock;       // The index shares scratch space between queries
+
+            Snapshot(Graph&& graph);
+        };
+
+        ServerOptions options;
+        IncrementalGraph incremental;
+        std::shared_ptr<Snapshot> snapshot;     // Empty after an update until the next reader
+        uint64_t version = 0;                   // Updates applied since the start
+        std::shared_mutex lock;
+
+        std::shared_ptr<Snapshot> current();
+        void update(const std::vector<std::string_view>& fields, std::ostream& stream);
+        void serve_client(int fd);
+
+        public:
+        GraphServer(Graph graph, const ServerOptions& options);
+
+        void answer(std::string_view request, int fd);
+        void serve();
+    };
+}
+#endif
@@ -0,0 +1,151 @@
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "snapshot.hpp"
+#include "hash.hpp"
+#include "input.hpp"
+#include "output.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
+
+namespace dag {
+    const char SNAPSHOT_MAGIC[8] = { 'D', 'A', 'G', 'S', 'N', 'A', 'P', '\0' };
+    const size_t ANY_COUNT = static_cast<size_t>(-1);
+
+    /**
+     * Append one array at the next aligned offset of the file
+     */
+    template<typename T>
+    void _append_section(std::string& payload, SnapshotHeader& header, SnapshotSection section, const std::vector<T>& values) {
+        const auto bytes = values.size() * sizeof(T);
+        const auto offset = (sizeof(SnapshotHeader) + payload.size() + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+        payload.resize(offset - sizeof(SnapshotHeader));
+        header.sections[static_cast<size_t>(section)] = SnapshotRange { offset, bytes };
+        payload.append(reinterpret_cast<const char*>(values.data()), bytes);
+    }
+
+    /**
+     * Write the built graph with its layers and positions; Collapsed graphs are stored without
+     * the graph they were collapsed from
+     */
+    void save_snapshot(const Graph& graph, const std::string& filename) {
+        TRACE_SCOPE("save_snapshot");
+        SnapshotHeader header = {};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.nodeCount = graph.size();
+        header.edgeCount = graph.edge_count();
+        header.removedEdges = graph.removedEdges;
+        header.depth = graph.depth;
+        header.sectionCount = static_cast<uint32_t>(SnapshotSection::Count);
+
+        std::string payload;
+        _append_section(payload, header, SnapshotSection::NameData, graph.nameData);
+        _append_section(payload, header, SnapshotSection::NameOffsets, graph.nameOffsets);
+        _append_section(payload, header, SnapshotSection::ChildOffsets, graph.childOffsets);
+        _append_section(payload, header, SnapshotSection::ChildIds, graph.childIds);
+        _append_section(payload, header, SnapshotSection::AncestorOffsets, graph.ancestorOffsets);
+        _append_section(payload, header, SnapshotSection::AncestorIds, graph.ancestorIds);
+        _append_section(payload, header, SnapshotSection::Costs, graph.costs);
+        _append_section(payload, header, SnapshotSection::StartNodes, graph.startNodes);
+        _append_section(payload, header, SnapshotSection::TopologicalOrder, graph.topologicalOrder);
+        _append_section(payload, header, SnapshotSection::Layers, graph.layers);
+        _append_section(payload, header, SnapshotSection::EdgeWeights, graph.edgeWeights);
+        _append_section(payload, header, SnapshotSection::ClusterSizes, graph.clusterSizes);
+        _append_section(payload, header, SnapshotSection::Clusters, graph.clusters);
+        _append_section(payload, header, SnapshotSection::X, graph.x);
+        _append_section(payload, header, SnapshotSection::Y, graph.y);
+
+        header.fileSize = sizeof(SnapshotHeader) + payload.size();
+        header.checksum = hash_bytes(payload);
+
+        auto fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw Exception("Unable to open " + filename);
+        }
+        try {
+            write_text(fd, std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+            write_text(fd, payload);
+        } catch (Exception&) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    /**
+     * Copy one array out of the mapping; Its size must be a whole number of values
+     */
+    template<typename T>
+    void _read_section(std::string_view file, const SnapshotHeader& header, SnapshotSection section,
+        size_t expected, std::vector<T>& values) {
+
+        const auto& range = header.sections[static_cast<size_t>(section)];
+        if (range.offset % alignof(T) != 0 || range.offset > file.size() || range.bytes > file.size() - range.offset
+            || range.bytes % sizeof(T) != 0 || (expected != ANY_COUNT && range.bytes / sizeof(T) != expected)) {
+            throw Exception("Invalid snapshot section " + std::to_string(static_cast<size_t>(section)));
+        }
+
+        const auto first = reinterpret_cast<const T*>(file.data() + range.offset);
+        values.assign(first, first + range.bytes / sizeof(T));
+    }
+
+    /**
+     * Map a snapshot and take over its arrays after checking the header and checksum;
+     * Nothing is parsed or laid out again
+     */
+    Graph load_snapshot(const std::string& filename) {
+        TRACE_SCOPE("load_snapshot");
+        MappedFile mapping(filename);
+        auto file = mapping.text();
+
+        SnapshotHeader header;
+        if (file.size() < sizeof(header)) {
+            throw Exception(filename + " is not a snapshot");
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+            throw Exception(filename + " is not a snapshot");
+        }
+        if (header.version != SNAPSHOT_VERSION || header.byteOrder != SNAPSHOT_BYTE_ORDER
+            || header.sectionCount != static_cast<uint32_t>(SnapshotSection::Count)) {
+            throw Exception("Unsupported snapshot version " + std::to_string(header.version) + " in " + filename);
+        }
+        if (header.fileSize != file.size() || header.checksum != hash_bytes(file.substr(sizeof(header)))) {
+            throw Exception("Corrupt snapshot " + filename);
+        }
+
+        Graph graph;
+        const auto nodes = static_cast<size_t>(header.nodeCount);
+        const auto edges = static_cast<size_t>(header.edgeCount);
+        const auto offsets = nodes ? nodes + 1 : ANY_COUNT;     // An empty graph may have no offsets at all
+        _read_section(file, header, SnapshotSection::NameData, ANY_COUNT, graph.nameData);
+        _read_section(file, header, SnapshotSection::NameOffsets, offsets, graph.nameOffsets);
+        _read_section(file, header, SnapshotSection::ChildOffsets, offsets, graph.childOffsets);
+        _read_section(file, header, SnapshotSection::ChildIds, edges, graph.childIds);
+        _read_section(file, header, SnapshotSection::AncestorOffsets, offsets, graph.ancestorOffsets);
+        _read_section(file, header, SnapshotSection::AncestorIds, edges, graph.ancestorIds);
+        _read_section(file, header, SnapshotSection::Costs, nodes, graph.costs);
+        _read_section(file, header, SnapshotSection::StartNodes, ANY_COUNT, graph.startNodes);
+        _read_section(file, header, SnapshotSection::TopologicalOrder, nodes, graph.topologicalOrder);
+        _read_section(file, header, SnapshotSection::Layers, nodes, graph.layers);
+        _read_section(file, header, SnapshotSection::EdgeWeights, ANY_COUNT, graph.edgeWeights);
+        _read_section(file, header, SnapshotSection::ClusterSizes, ANY_COUNT, graph.clusterSizes);
+        _read_section(file, header, SnapshotSection::Clusters, ANY_COUNT, graph.clusters);
+        _read_section(file, header, SnapshotSection::X, nodes, graph.x);
+        _read_section(file, header, SnapshotSection::Y, nodes, graph.y);
+        graph.depth = header.depth;
+        graph.removedEdges = header.removedEdges;
+
+        // Offsets past the arrays would make the accessors read outside them
+        if (nodes && (graph.nameOffsets.back() != graph.nameData.size() || graph.childOffsets.back() != edges
+            || graph.ancestorOffsets.back() != edges)) {
+            throw Exception("Corrupt snapshot " + filename);
+        }
+
+        return graph;
+    }
+}
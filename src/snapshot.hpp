@@ -0,0 +1,65 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "dag.hpp"
+
+namespace dag {
+    const uint32_t SNAPSHOT_VERSION = 1;
+    const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;   // Reads differently on a machine with the other byte order
+    const size_t SNAPSHOT_ALIGNMENT = 64;               // Sections start on a cache line
+
+    /**
+     * Arrays of a graph in the order they are stored
+     */
+    enum class SnapshotSection {
+        NameData,
+        NameOffsets,
+        ChildOffsets,
+        ChildIds,
+        AncestorOffsets,
+        AncestorIds,
+        Costs,
+        StartNodes,
+        TopologicalOrder,
+        Layers,
+        EdgeWeights,
+        ClusterSizes,
+        Clusters,
+        X,
+        Y,
+        Count
+    };
+
+    /**
+     * Location of one array relative to the start of the file
+     */
+    struct SnapshotRange {
+        uint64_t offset;
+        uint64_t bytes;
+    };
+
+    /**
+     * Start of every snapshot file. The arrays follow at aligned offsets in the native byte
+     * order, so a mapped file can be addressed directly; The checksum covers all bytes after
+     * the header
+     */
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t fileSize;
+        uint64_t checksum;
+        uint64_t nodeCount;
+        uint64_t edgeCount;
+        uint64_t removedEdges;
+        uint32_t depth;
+        uint32_t sectionCount;
+        SnapshotRange sections[static_cast<size_t>(SnapshotSection::Count)];
+    };
+
+    void save_snapshot(const Graph& graph, const std::string& filename);
+    Graph load_snapshot(const std::string& filename);
+}
+#endif
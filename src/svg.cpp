@@ -1,9 +1,29 @@
+#include <algorithm>
+#include <charconv>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <numeric>
 #include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef DAG_ZLIB
+#include <zlib.h>
+#endif
 #include "svg.hpp"
+#include "analysis.hpp"
 #include "dag.hpp"
+#include "stdafx.hpp"
+#include "trace.hpp"
 
 const int OFFSET = 25;  // Offset to canvas corner
 const int WIDTH = 240;
@@ -12,35 +32,42 @@ const int XOFFSET = WIDTH + 100;
 const int YOFFSET = HEIGHT + 50;
 const int LABEL_MAX_LENGTH = 23;
 
+/**
+ * Emit the box and label for a node at the given grid position
+ */
+void _write_box(std::fstream& stream, std::string_view name, int x, int y) {
+    // Source: https://stackoverflow.com/questions/5546346/how-to-place-and-center-text-in-an-svg-rectangle/44857272#44857272
+    std::string nodeLabel(name);
+    if (nodeLabel.length() > LABEL_MAX_LENGTH) {
+        nodeLabel = nodeLabel.substr(0, LABEL_MAX_LENGTH) + "...";
+    }
+
+    stream << "<rect x=\"" << x * XOFFSET + OFFSET << "\" y=\"" << y * YOFFSET + OFFSET << "\" width=\"" << WIDTH << "\" height=\"" << HEIGHT << "\" />" << std::endl;
+    stream << "<text x=\"" << (x * XOFFSET + WIDTH / 2 - 90 + OFFSET) << "\" y=\"" << (y * YOFFSET + 5 + HEIGHT / 2 + OFFSET) << "\">" << nodeLabel << "</text>" << std::endl;
+}
+
+/**
+ * Emit a connecting line between the grid positions of two nodes
+ */
+void _write_line(std::fstream& stream, int x1, int y1, int x2, int y2) {
+    stream << "<line x1=\"" << (x1 * XOFFSET + WIDTH + OFFSET) << "\" y1=\"" << (y1 * YOFFSET + 5 + HEIGHT / 2 + OFFSET) << "\" x2=\""<< (x2 * XOFFSET + OFFSET) << "\" y2=\"" << (y2 * YOFFSET + 5 + HEIGHT / 2 + OFFSET) << "\" marker-end=\"url(#arrow)\" />" << std::endl;
+}
+
 /*
  * Emit markup for a single dependency node
  */
 bool _write_node(std::fstream& stream,
-    std::set<std::string>& renderedNodes,
+    std::set<const dag::DagNode*>& renderedNodes,
     const dag::node_ptr& node) {
 
-    if (renderedNodes.find(node->name) != renderedNodes.end()) {
+    if (renderedNodes.find(node) != renderedNodes.end()) {
         // Node already present in set
         return false;
     }
 
-    // Source: https://stackoverflow.com/questions/5546346/how-to-place-and-center-text-in-an-svg-rectangle/44857272#44857272
-    /*
-    stream << "<svg width=\"" << WIDTH << "\" height=\"" << HEIGHT << "\">" << std::endl;
-    stream << "<rect x=\"0\" y=\"0\" width=\"" << WIDTH << "\" height=\"" << HEIGHT << "\" />" << std::endl;
-    stream << "<text x=\"50%\" y=\"50%\" dominant-baseline=\"middle\" text-anchor=\"middle\">" << node->name << "</text>" << std::endl;
-    stream << "</svg>" << std::endl;
-    */
-
-    std::string nodeLabel = node->name;
-    if (nodeLabel.length() > LABEL_MAX_LENGTH) {
-        nodeLabel = nodeLabel.substr(0, LABEL_MAX_LENGTH) + "...";
-    }
-
-    stream << "<rect x=\"" << node->x * XOFFSET + OFFSET << "\" y=\"" << node->y * YOFFSET + OFFSET << "\" width=\"" << WIDTH << "\" height=\"" << HEIGHT << "\" />" << std::endl;
-    stream << "<text x=\"" << (node->x * XOFFSET + WIDTH / 2 - 90 + OFFSET) << "\" y=\"" << (node->y * YOFFSET + 5 + HEIGHT / 2 + OFFSET) << "\">" << nodeLabel << "</text>" << std::endl;
+    _write_box(stream, node->name, node->x, node->y);
 
-    renderedNodes.insert(node->name);
+    renderedNodes.insert(node);
     return true;
 }
 
@@ -52,7 +79,7 @@ void _write_edge(
     const dag::node_ptr& nodeStart,
     const dag::node_ptr& nodeEnd) {
     
-    stream << "<line x1=\"" << (nodeStart->x * XOFFSET + WIDTH + OFFSET) << "\" y1=\"" << (nodeStart->y * YOFFSET + 5 + HEIGHT / 2 + OFFSET) << "\" x2=\""<< (nodeEnd->x * XOFFSET + OFFSET) << "\" y2=\"" << (nodeEnd->y * YOFFSET + 5 + HEIGHT / 2 + OFFSET) << "\" marker-end=\"url(#arrow)\" />" << std::endl;
+    _write_line(stream, nodeStart->x, nodeStart->y, nodeEnd->x, nodeEnd->y);
 }
 
 /**
@@ -60,8 +87,8 @@ void _write_edge(
  */
 void _write_node_array(
     std::fstream& stream,
-    std::set<std::string>& renderedNodes,
-    const dag::node_vec& nodes,
+    std::set<const dag::DagNode*>& renderedNodes,
+    dag::NodeRange nodes,
     const dag::node_ptr& parentNode = nullptr) {
     
     for (auto node: nodes) {
@@ -77,54 +104,62 @@ void _write_node_array(
 }
 
 /**
- * Calculate the maximum branch length
+ * Calculate the number of nodes on the longest path starting at the given node
  */
-int _get_branch_length(const dag::node_vec& nodes, int length) {
-    if (nodes.size()) {
-        length++;
+int _get_branch_length(const dag::node_ptr& node, std::unordered_map<const dag::DagNode*, int>& lengths, int& maxY) {
+    auto found = lengths.find(node);
+    if (found != lengths.end()) {
+        return found->second;
     }
 
-    int maxLength = length;
-    for (auto node: nodes) {
-        auto branchLength = _get_branch_length(node->children, length);
+    maxY = std::max(maxY, node->y);
 
-        if (branchLength > maxLength) {
-            maxLength = branchLength;
-        }
+    int maxLength = 0;
+    for (auto child: node->children) {
+        maxLength = std::max(maxLength, _get_branch_length(child, lengths, maxY));
     }
 
-    return maxLength;
+    lengths[node] = maxLength + 1;
+    return maxLength + 1;
 }
 
 /**
- * Calculate the maximum path length in the dag
+ * Calculate the number of columns (the maximum path length) and rows in the dag; Shared branches are only measured once
  */
-int _get_dag_length(const dag::node_vec& startNodes) {
-    int length = startNodes.size() ? 1 : 0;
-    int maxLength = length;
-    for (auto startNode: startNodes) {
-        auto branchLength = _get_branch_length(startNode->children, length);
+void _get_dag_size(const dag::node_vec& startNodes, int& columns, int& rows) {
+    std::unordered_map<const dag::DagNode*, int> lengths;
+    int maxY = -1;
+    columns = 0;
 
-        if(branchLength > maxLength) {
-            maxLength = branchLength;
-        }
+    for (auto startNode: startNodes) {
+        columns = std::max(columns, _get_branch_length(startNode, lengths, maxY));
     }
 
-    return maxLength;
+    rows = maxY + 1;
 }
 
 /**
- * Creates an svg for the given dags
+ * Calculate the number of rows used by the compressed dag's layout
  */
-void write_svg(const dag::node_vec& startNodes, const std::string& filename) {
-    std::fstream stream(filename, std::ios::out);
-    auto length = _get_dag_length(startNodes);
+int _get_row_count(const dag::Graph& graph) {
+    int maxY = -1;
 
+    for (auto y: graph.y) {
+        maxY = std::max(maxY, y);
+    }
+
+    return maxY + 1;
+}
+
+/**
+ * Emit the document header, marker definitions and styles
+ */
+void _write_header(std::ostream& stream, int columns, int rows) {
     stream << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << std::endl;
     stream << "<svg xmlns=\"http://www.w3.org/2000/svg\" ";
     stream << "xmlns:xlink=\"http://www.w3.org/1999/xlink\" ";
     stream << "version=\"1.1\" baseProfile=\"full\" ";
-    stream << "viewBox=\"0 0 " << length * 350 << " " << length * 200 << "\" ";
+    stream << "viewBox=\"0 0 " << columns * XOFFSET + OFFSET << " " << rows * YOFFSET + OFFSET << "\" ";
     stream << ">" << std::endl;
 
     stream << "<title>DAG</title>" << std::endl;
@@ -143,12 +178,479 @@ void write_svg(const dag::node_vec& startNodes, const std::string& filename) {
     stream << "rect, ellipse { stroke: #888; fill: #ccc; }" << std::endl;
     stream << "text { fill: #000; font-family: Arial, Sans-serif; }" << std::endl;
     stream << "line { stroke: #f00; }" << std::endl;
+    stream << "line.critical { stroke: #00f; stroke-width: 3; }" << std::endl;
+    stream << "text.w { fill: #f00; font-size: 12px; }" << std::endl;
     stream << "</style>" << std::endl;
+}
+
+/**
+ * Emit the document header for compact output; Node boxes with and without an incoming
+ * arrow are defined once and all repeated attributes are css classes
+ */
+void _write_compact_header(std::ostream& stream, int columns, int rows) {
+    stream << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    stream << "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" ";
+    stream << "viewBox=\"0 0 " << columns * XOFFSET + OFFSET << " " << rows * YOFFSET + OFFSET << "\">\n";
+    stream << "<title>DAG</title>\n<desc>Generated using dag cli</desc>\n";
+
+    // The arrow head takes the fill of the use element
+    stream << "<defs><symbol id=\"b\" overflow=\"visible\"><rect width=\"" << WIDTH << "\" height=\"" << HEIGHT
+        << "\" fill=\"#ccc\" stroke=\"#888\"/></symbol>";
+    stream << "<symbol id=\"a\" overflow=\"visible\"><use href=\"#b\"/><path d=\"M0 " << 5 + HEIGHT / 2
+        << "l-12-5v10z\" stroke=\"none\"/></symbol></defs>\n";
+    stream << "<style type=\"text/css\">";
+    stream << "use{fill:#f00}use.c{fill:#00f}text{fill:#000;font-family:Arial,Sans-serif}";
+    stream << ".e path{fill:none;stroke:#f00;stroke-linejoin:round;vector-effect:non-scaling-stroke}.e .c{stroke:#00f;stroke-width:3}.w{fill:#f00;font-size:12px}";
+    stream << "</style>\n";
+}
 
-    std::set<std::string> renderedNodes;
+/**
+ * Creates an svg for the given dags
+ */
+void write_svg(const dag::node_vec& startNodes, const std::string& filename) {
+    TRACE_SCOPE("write_svg");
+    std::fstream stream(filename, std::ios::out);
+    int columns, rows;
+    _get_dag_size(startNodes, columns, rows);
+    _write_header(stream, columns, rows);
+
+    std::set<const dag::DagNode*> renderedNodes;
     _write_node_array(stream, renderedNodes, startNodes);
 
     stream << "</svg>";
 
     stream.close();
 }
+
+/**
+ * Output buffer with fast integer formatting
+ */
+struct _SvgBuffer {
+    std::string data;
+
+    void append(std::string_view text) {
+        this->data.append(text.data(), text.size());
+    }
+
+    void append(int value) {
+        char digits[16];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        this->data.append(digits, result.ptr - digits);
+    }
+
+    /**
+     * Append a path coordinate; Only needs a separator if it follows a number and has no sign
+     */
+    void append_coordinate(int value) {
+        if (value >= 0 && !this->data.empty() && std::isdigit(static_cast<unsigned char>(this->data.back()))) {
+            this->data.push_back(' ');
+        }
+        this->append(value);
+    }
+
+    /**
+     * Append text with the xml special characters escaped
+     */
+    void append_escaped(std::string_view text) {
+        for (auto c: text) {
+            switch (c) {
+                case '&': this->append("&amp;"); break;
+                case '<': this->append("&lt;"); break;
+                case '>': this->append("&gt;"); break;
+                case '"': this->append("&quot;"); break;
+                default: this->data.push_back(c);
+            }
+        }
+    }
+};
+
+/**
+ * Output of one node range; Compact output keeps the edge paths apart, indexed by criticality
+ */
+struct _SvgChunk {
+    _SvgBuffer nodes;
+    _SvgBuffer edges[2];
+};
+
+/**
+ * Everything the node ranges are formatted from
+ */
+struct _SvgContext {
+    const dag::Graph& graph;
+    std::vector<uint64_t> visited;          // Nodes reachable from a start node
+    std::vector<bool> criticalEdges;        // Indexed like Graph::childIds
+    std::vector<bool> criticalTargets;      // Node has a critical incoming edge; Only for compact output
+    bool compact;
+};
+
+const size_t BYTES_PER_NODE = 160;
+const size_t BYTES_PER_EDGE = 110;
+const size_t COMPACT_BYTES_PER_NODE = 80;
+const size_t COMPACT_BYTES_PER_EDGE = 12;
+const int EDGE_UNIT = std::gcd(XOFFSET, WIDTH);     // Compact edges use a grid of this many pixels
+
+/**
+ * Emit the shortened name; Collapsed nodes add the number of nodes they stand for
+ */
+void _write_label(_SvgBuffer& buffer, std::string_view name, uint32_t clusterSize) {
+    auto label = name.substr(0, LABEL_MAX_LENGTH);
+
+    buffer.append_escaped(label);
+    if (label.size() < name.size()) {
+        buffer.append("...");
+    }
+    if (clusterSize > 0) {
+        buffer.append(" (");
+        buffer.append(static_cast<int>(clusterSize));
+        buffer.append(")");
+    }
+}
+
+/**
+ * Emit the number of collapsed edges in the middle of an edge
+ */
+void _write_weight(_SvgBuffer& buffer, int x1, int y1, int x2, int y2, uint32_t weight) {
+    buffer.append("<text class=\"w\" x=\"");
+    buffer.append(((x1 + x2) * XOFFSET + WIDTH) / 2 + OFFSET);
+    buffer.append("\" y=\"");
+    buffer.append((y1 + y2) * YOFFSET / 2 + HEIGHT / 2 + OFFSET);
+    buffer.append("\">");
+    buffer.append(static_cast<int>(weight));
+    buffer.append("</text>\n");
+}
+
+/**
+ * Emit the box and label for a node of the compressed dag
+ */
+void _write_box(_SvgBuffer& buffer, std::string_view name, int x, int y, uint32_t clusterSize) {
+    buffer.append("<rect x=\"");
+    buffer.append(x * XOFFSET + OFFSET);
+    buffer.append("\" y=\"");
+    buffer.append(y * YOFFSET + OFFSET);
+    buffer.append("\" width=\"");
+    buffer.append(WIDTH);
+    buffer.append("\" height=\"");
+    buffer.append(HEIGHT);
+    buffer.append("\" />\n<text x=\"");
+    buffer.append(x * XOFFSET + WIDTH / 2 - 90 + OFFSET);
+    buffer.append("\" y=\"");
+    buffer.append(y * YOFFSET + 5 + HEIGHT / 2 + OFFSET);
+    buffer.append("\">");
+    _write_label(buffer, name, clusterSize);
+    buffer.append("</text>\n");
+}
+
+/**
+ * Emit a connecting line between two nodes of the compressed dag
+ */
+void _write_line(_SvgBuffer& buffer, int x1, int y1, int x2, int y2, bool critical) {
+    buffer.append(critical ? "<line class=\"critical\" x1=\"" : "<line x1=\"");
+    buffer.append(x1 * XOFFSET + WIDTH + OFFSET);
+    buffer.append("\" y1=\"");
+    buffer.append(y1 * YOFFSET + 5 + HEIGHT / 2 + OFFSET);
+    buffer.append("\" x2=\"");
+    buffer.append(x2 * XOFFSET + OFFSET);
+    buffer.append("\" y2=\"");
+    buffer.append(y2 * YOFFSET + 5 + HEIGHT / 2 + OFFSET);
+    buffer.append("\" marker-end=\"url(#arrow)\" />\n");
+}
+
+/**
+ * Emit a use of the shared box and the label for a node of the compressed dag
+ */
+void _write_compact_box(_SvgBuffer& buffer, std::string_view name, int x, int y, uint32_t clusterSize, bool arrow, bool critical) {
+    buffer.append(arrow ? (critical ? "<use class=\"c\" href=\"#a\" x=\"" : "<use href=\"#a\" x=\"") : "<use href=\"#b\" x=\"");
+    buffer.append(x * XOFFSET + OFFSET);
+    buffer.append("\" y=\"");
+    buffer.append(y * YOFFSET + OFFSET);
+    buffer.append("\"/><text x=\"");
+    buffer.append(x * XOFFSET + WIDTH / 2 - 90 + OFFSET);
+    buffer.append("\" y=\"");
+    buffer.append(y * YOFFSET + 5 + HEIGHT / 2 + OFFSET);
+    buffer.append("\">");
+    _write_label(buffer, name, clusterSize);
+    buffer.append("</text>\n");
+}
+
+/**
+ * Append an edge to a merged path; Coordinates are in edge units and rows, the path's
+ * transform scales them back to pixels. All edges of a node share one move and return
+ * to the start, so every further edge only adds two relative pairs
+ */
+void _write_compact_line(_SvgBuffer& buffer, bool first, int x1, int y1, int x2, int y2) {
+    const int startX = (x1 * XOFFSET + WIDTH) / EDGE_UNIT;
+    const int deltaX = x2 * XOFFSET / EDGE_UNIT - startX;
+
+    if (first) {
+        buffer.append("M");
+        buffer.append_coordinate(startX);
+        buffer.append_coordinate(y1);
+        buffer.append("l");
+    }
+    buffer.append_coordinate(deltaX);
+    buffer.append_coordinate(y2 - y1);
+    buffer.append_coordinate(-deltaX);
+    buffer.append_coordinate(y1 - y2);
+}
+
+/**
+ * Mark all nodes reachable from the start nodes in a dense bitset
+ */
+std::vector<uint64_t> _mark_reachable(const dag::Graph& graph) {
+    TRACE_SCOPE("_mark_reachable");
+    std::vector<uint64_t> visited((graph.size() + 63) / 64, 0);
+    dag::id_vec stack(graph.startNodes.begin(), graph.startNodes.end());
+
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+
+        auto& word = visited[node / 64];
+        const auto bit = uint64_t(1) << (node % 64);
+        if (word & bit) continue;
+        word |= bit;
+
+        for (auto child: graph.children(node)) {
+            if (!(visited[child / 64] & (uint64_t(1) << (child % 64)))) {
+                stack.push_back(child);
+            }
+        }
+    }
+
+    return visited;
+}
+
+/**
+ * Emit the boxes and outgoing edges for a contiguous range of node ids
+ */
+void _write_node_range(_SvgChunk& chunk, const _SvgContext& context, dag::node_id first, dag::node_id last) {
+    TRACE_SCOPE("_write_node_range");
+    const auto& graph = context.graph;
+
+    auto edges = graph.childOffsets[last] - graph.childOffsets[first];
+    if (context.compact) {
+        chunk.nodes.data.reserve((last - first) * COMPACT_BYTES_PER_NODE);
+        chunk.edges[0].data.reserve(edges * COMPACT_BYTES_PER_EDGE);
+    } else {
+        chunk.nodes.data.reserve((last - first) * BYTES_PER_NODE + edges * BYTES_PER_EDGE);
+    }
+    TRACE_COUNT(EdgesVisited, edges);
+
+    for (auto node = first; node < last; node++) {
+        if (!(context.visited[node / 64] & (uint64_t(1) << (node % 64)))) continue;
+
+        const auto clusterSize = graph.clusterSizes.empty() ? 0 : graph.clusterSizes[node];
+        if (context.compact) {
+            _write_compact_box(chunk.nodes, graph.name(node), graph.x[node], graph.y[node], clusterSize,
+                !graph.ancestors(node).empty(), context.criticalTargets[node]);
+        } else {
+            _write_box(chunk.nodes, graph.name(node), graph.x[node], graph.y[node], clusterSize);
+        }
+
+        bool started[2] = { false, false };
+        for (auto i = graph.childOffsets[node]; i < graph.childOffsets[node + 1]; i++) {
+            auto child = graph.childIds[i];
+            if (context.compact) {
+                const bool critical = context.criticalEdges[i];
+                _write_compact_line(chunk.edges[critical], !started[critical], graph.x[node], graph.y[node], graph.x[child], graph.y[child]);
+                started[critical] = true;
+            } else {
+                _write_line(chunk.nodes, graph.x[node], graph.y[node], graph.x[child], graph.y[child], context.criticalEdges[i]);
+            }
+            if (!graph.edgeWeights.empty() && graph.edgeWeights[i] > 1) {
+                _write_weight(chunk.nodes, graph.x[node], graph.y[node], graph.x[child], graph.y[child], graph.edgeWeights[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Split the node ids into ranges of roughly equal output size
+ */
+dag::id_vec _split_node_ranges(const dag::Graph& graph, unsigned count) {
+    // Weigh every node by itself plus its outgoing edges
+    const auto total = graph.size() + graph.edge_count();
+    dag::id_vec bounds { 0 };
+
+    for (unsigned i = 1; i < count; i++) {
+        const auto target = total * i / count;
+        dag::node_id low = bounds.back(), high = static_cast<dag::node_id>(graph.size());
+
+        while (low < high) {
+            auto middle = low + (high - low) / 2;
+            if (middle + graph.childOffsets[middle] < target) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        bounds.push_back(low);
+    }
+
+    bounds.push_back(static_cast<dag::node_id>(graph.size()));
+    return bounds;
+}
+
+/**
+ * Write all buffers to the file descriptor with as few system calls as possible
+ */
+void _write_buffers(int fd, const std::vector<const std::string*>& buffers) {
+    TRACE_SCOPE("_write_buffers");
+    std::vector<struct iovec> vectors;
+    for (auto buffer: buffers) {
+        if (buffer->empty()) continue;
+        vectors.push_back(iovec { const_cast<char*>(buffer->data()), buffer->size() });
+    }
+
+    size_t next = 0;
+    while (next < vectors.size()) {
+        auto count = std::min(vectors.size() - next, static_cast<size_t>(IOV_MAX));
+        auto written = writev(fd, &vectors[next], static_cast<int>(count));
+        if (written < 0) {
+            throw Exception("Unable to write svg");
+        }
+
+        // Skip everything that was written; Continue partial writes
+        while (next < vectors.size() && static_cast<size_t>(written) >= vectors[next].iov_len) {
+            written -= vectors[next].iov_len;
+            next++;
+        }
+        if (next < vectors.size()) {
+            vectors[next].iov_base = static_cast<char*>(vectors[next].iov_base) + written;
+            vectors[next].iov_len -= written;
+        }
+    }
+}
+
+/**
+ * Compress all buffers into a gzip stream on the file descriptor; The descriptor stays open
+ */
+void _write_gzip(int fd, const std::vector<const std::string*>& buffers) {
+    TRACE_SCOPE("_write_gzip");
+#ifdef DAG_ZLIB
+    const size_t MAX_GZIP_WRITE = size_t(1) << 30;
+    auto duplicate = dup(fd);
+    if (duplicate < 0) {
+        throw Exception("Unable to compress svg");
+    }
+    auto file = gzdopen(duplicate, "wb");
+    if (file == nullptr) {
+        close(duplicate);
+        throw Exception("Unable to compress svg");
+    }
+
+    bool written = true;
+    for (auto buffer: buffers) {
+        for (size_t offset = 0; offset < buffer->size() && written; offset += MAX_GZIP_WRITE) {
+            auto size = static_cast<unsigned>(std::min(buffer->size() - offset, MAX_GZIP_WRITE));
+            written = gzwrite(file, buffer->data() + offset, size) == static_cast<int>(size);
+        }
+    }
+
+    if (gzclose(file) != Z_OK || !written) {
+        throw Exception("Unable to write svg");
+    }
+#else
+    (void) fd;
+    (void) buffers;
+    throw Exception("Compressed svg needs a build with zlib");
+#endif
+}
+
+/**
+ * Creates an svg for the given compressed dag; Critical path edges are highlighted. Node ranges are formatted on separate threads
+ */
+void write_svg(const dag::Graph& graph, int fd, const SvgOptions& options) {
+    TRACE_SCOPE("write_svg");
+    std::ostringstream header;
+    if (options.compact) {
+        _write_compact_header(header, static_cast<int>(graph.depth), _get_row_count(graph));
+    } else {
+        _write_header(header, static_cast<int>(graph.depth), _get_row_count(graph));
+    }
+    const std::string headerText = header.str();
+    const std::string footerText = "</svg>";
+
+    _SvgContext context { graph, _mark_reachable(graph), dag::analyze_critical_path(graph).criticalEdges, {}, options.compact };
+    if (options.compact) {
+        context.criticalTargets.assign(graph.size(), false);
+        for (size_t i = 0; i < graph.childIds.size(); i++) {
+            if (context.criticalEdges[i]) context.criticalTargets[graph.childIds[i]] = true;
+        }
+    }
+
+    auto bounds = _split_node_ranges(graph, std::max(options.threads, 1u));
+    std::vector<_SvgChunk> chunks(bounds.size() - 1);
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunks.size(); i++) {
+        workers.emplace_back([&, i]() {
+            _write_node_range(chunks[i], context, bounds[i], bounds[i + 1]);
+        });
+    }
+    _write_node_range(chunks[0], context, bounds[0], bounds[1]);
+    for (auto& worker: workers) {
+        worker.join();
+    }
+
+    std::vector<const std::string*> buffers { &headerText };
+
+    // Compact edges are one path per kind below all boxes
+    std::ostringstream edgeGroup;
+    edgeGroup << "<g class=\"e\" transform=\"translate(" << OFFSET << " " << 5 + HEIGHT / 2 + OFFSET << ") scale("
+        << EDGE_UNIT << " " << YOFFSET << ")\">\n";
+    const std::string edgeGroupStart = edgeGroup.str();
+    const std::string pathStarts[2] = { "<path d=\"", "<path class=\"c\" d=\"" };
+    const std::string pathEnd = "\"/>\n";
+    const std::string edgeGroupEnd = "</g>\n";
+
+    if (options.compact) {
+        buffers.push_back(&edgeGroupStart);
+        for (int critical = 0; critical < 2; critical++) {
+            buffers.push_back(&pathStarts[critical]);
+            for (const auto& chunk: chunks) {
+                buffers.push_back(&chunk.edges[critical].data);
+            }
+            buffers.push_back(&pathEnd);
+        }
+        buffers.push_back(&edgeGroupEnd);
+    }
+
+    for (const auto& chunk: chunks) {
+        buffers.push_back(&chunk.nodes.data);
+    }
+    buffers.push_back(&footerText);
+
+    if (options.gzip) {
+        _write_gzip(fd, buffers);
+    } else {
+        _write_buffers(fd, buffers);
+    }
+}
+
+/**
+ * Creates an svg file for the given compressed dag
+ */
+void write_svg(const dag::Graph& graph, const std::string& filename, unsigned threads) {
+    SvgOptions options;
+    options.threads = threads;
+    write_svg(graph, filename, options);
+}
+
+/**
+ * Creates an svg file for the given compressed dag with the given settings
+ */
+void write_svg(const dag::Graph& graph, const std::string& filename, const SvgOptions& options) {
+    auto fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw Exception("Unable to open " + filename);
+    }
+
+    try {
+        write_svg(graph, fd, options);
+    } catch (Exception&) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
@@ -4,6 +4,18 @@
 #include <vector>
 #include "dag.hpp"
 
+/**
+ * Settings for writing the compressed dag
+ */
+struct SvgOptions {
+    unsigned threads = 1;       // Threads that format node ranges
+    bool compact = false;       // Shared node box, merged edge paths and css classes
+    bool gzip = false;          // Compress the output as svgz
+};
+
 void write_svg(const dag::node_vec& startNodes, const std::string& filename);
+void write_svg(const dag::Graph& graph, const std::string& filename, unsigned threads = 1);
+void write_svg(const dag::Graph& graph, const std::string& filename, const SvgOptions& options);
+void write_svg(const dag::Graph& graph, int fd, const SvgOptions& options);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "trace.hpp"
+#include "stdafx.hpp"
+
+namespace dag {
+    /**
+     * One finished scope; Times are nanoseconds since the trace epoch
+     */
+    struct _TraceEvent {
+        const char* name;
+        uint64_t start;
+        uint64_t duration;
+    };
+
+    /**
+     * Events of a single thread; Owned by the registry so they outlive the thread
+     */
+    struct _TraceThread {
+        uint32_t id;
+        std::vector<_TraceEvent> events;
+    };
+
+    const size_t COUNTER_COUNT = static_cast<size_t>(Counter::Count);
+    const char* COUNTER_NAMES[COUNTER_COUNT] = { "node_lookups", "edges_visited", "allocations" };
+
+    std::atomic<bool> _tracingEnabled { false };
+    std::atomic<uint64_t> _counters[COUNTER_COUNT];
+    const auto _traceEpoch = std::chrono::steady_clock::now();
+
+    std::mutex _threadsMutex;
+    std::vector<std::unique_ptr<_TraceThread>> _threads;
+    thread_local _TraceThread* _currentThread = nullptr;
+
+    /**
+     * Look up the event list of the calling thread; Registers the thread on first use
+     */
+    _TraceThread& _get_trace_thread() {
+        if (!_currentThread) {
+            std::lock_guard<std::mutex> lock(_threadsMutex);
+            _threads.push_back(std::make_unique<_TraceThread>());
+            _threads.back()->id = static_cast<uint32_t>(_threads.size());
+            _currentThread = _threads.back().get();
+        }
+
+        return *_currentThread;
+    }
+
+    /**
+     * Start collecting events and counters; The calling thread becomes the first track
+     */
+    void enable_tracing() {
+        _get_trace_thread();
+        _tracingEnabled.store(true, std::memory_order_relaxed);
+    }
+
+    bool tracing_enabled() {
+        return _tracingEnabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Nanoseconds since the trace epoch
+     */
+    uint64_t trace_clock() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _traceEpoch).count();
+    }
+
+    /**
+     * Append a finished scope to the track of the calling thread
+     */
+    void record_trace_event(const char* name, uint64_t start, uint64_t duration) {
+        _get_trace_thread().events.push_back(_TraceEvent { name, start, duration });
+    }
+
+    /**
+     * Add to a counter; Never allocates, so operator new can count itself
+     */
+    void count_trace_event(Counter counter, uint64_t amount) {
+        if (tracing_enabled()) {
+            _counters[static_cast<size_t>(counter)].fetch_add(amount, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t get_trace_count(Counter counter) {
+        return _counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Print calls and total time per scope name in order of first start, followed by the counters
+     */
+    void print_trace_stats(std::ostream& stream) {
+        struct Total {
+            const char* name;
+            uint64_t first;
+            uint64_t calls;
+            uint64_t duration;
+        };
+        std::vector<Total> totals;
+        std::unordered_map<std::string, size_t> index;
+
+        {
+            std::lock_guard<std::mutex> lock(_threadsMutex);
+            for (const auto& thread: _threads) {
+                for (const auto& event: thread->events) {
+                    auto inserted = index.emplace(event.name, totals.size());
+                    if (inserted.second) {
+                        totals.push_back(Total { event.name, event.start, 0, 0 });
+                    }
+
+                    auto& total = totals[inserted.first->second];
+                    total.first = std::min(total.first, event.start);
+                    total.calls++;
+                    total.duration += event.duration;
+                }
+            }
+        }
+
+        std::stable_sort(totals.begin(), totals.end(), [](const Total& a, const Total& b) {
+            return a.first < b.first;
+        });
+
+        char line[128];
+        snprintf(line, sizeof(line), "%-28s %8s %12s\n", "phase", "calls", "total ms");
+        stream << line;
+        for (const auto& total: totals) {
+            snprintf(line, sizeof(line), "%-28s %8llu %12.3f\n", total.name,
+                static_cast<unsigned long long>(total.calls), total.duration / 1e6);
+            stream << line;
+        }
+
+        for (size_t i = 0; i < COUNTER_COUNT; i++) {
+            snprintf(line, sizeof(line), "%-28s %21llu\n", COUNTER_NAMES[i],
+                static_cast<unsigned long long>(_counters[i].load(std::memory_order_relaxed)));
+            stream << line;
+        }
+    }
+
+    /**
+     * Write all events in the Chrome trace event format; Every thread is its own track
+     */
+    void write_trace(const std::string& filename) {
+        std::ofstream stream(filename, std::ios::trunc);
+        if (!stream) {
+            throw Exception("Unable to open " + filename);
+        }
+
+        char line[256];
+        const char* separator = "\n";
+        stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        {
+            std::lock_guard<std::mutex> lock(_threadsMutex);
+            for (const auto& thread: _threads) {
+                snprintf(line, sizeof(line),
+                    "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                    separator, thread->id, thread->id == 1 ? "main" : "worker", thread->id);
+                stream << line;
+                separator = ",\n";
+
+                for (const auto& event: thread->events) {
+                    snprintf(line, sizeof(line),
+                        ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                        event.name, thread->id, event.start / 1e3, event.duration / 1e3);
+                    stream << line;
+                }
+            }
+        }
+
+        // Counters show up as one sample at the end of the main track
+        snprintf(line, sizeof(line), "%s{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"args\":{",
+            separator, trace_clock() / 1e3);
+        stream << line;
+        for (size_t i = 0; i < COUNTER_COUNT; i++) {
+            stream << (i ? "," : "") << "\"" << COUNTER_NAMES[i] << "\":" << _counters[i].load(std::memory_order_relaxed);
+        }
+        stream << "}}\n]}\n";
+
+        if (!stream) {
+            throw Exception("Unable to write " + filename);
+        }
+    }
+}
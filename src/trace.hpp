@@ -0,0 +1,61 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace dag {
+    /**
+     * Totals collected across all threads while tracing is enabled
+     */
+    enum class Counter {
+        NodeLookups,        // Name to id lookups while interning
+        EdgesVisited,       // Edges walked by the graph passes
+        Allocations,        // Calls to operator new, where the executable counts them
+        Count
+    };
+
+    void enable_tracing();
+    bool tracing_enabled();
+    uint64_t trace_clock();
+    void record_trace_event(const char* name, uint64_t start, uint64_t duration);
+    void count_trace_event(Counter counter, uint64_t amount);
+    uint64_t get_trace_count(Counter counter);
+    void print_trace_stats(std::ostream& stream);
+    void write_trace(const std::string& filename);
+
+    /**
+     * Times the enclosing scope; Records nothing unless tracing is enabled
+     */
+    class TraceScope {
+        protected:
+        const char* name;
+        bool active;
+        uint64_t start;
+
+        public:
+        explicit TraceScope(const char* name)
+            : name(name), active(tracing_enabled()), start(active ? trace_clock() : 0) {
+        }
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+
+        ~TraceScope() {
+            if (this->active) {
+                record_trace_event(this->name, this->start, trace_clock() - this->start);
+            }
+        }
+    };
+}
+
+#define _TRACE_JOIN(a, b) a##b
+#define _TRACE_NAME(line) _TRACE_JOIN(_traceScope, line)
+
+#ifdef DAG_INSTRUMENTATION
+#define TRACE_SCOPE(name) dag::TraceScope _TRACE_NAME(__LINE__)(name)
+#define TRACE_COUNT(counter, amount) dag::count_trace_event(dag::Counter::counter, amount)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_COUNT(counter, amount)
+#endif
+#endif
@@ -1,9 +1,26 @@
 #include <cassert>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <set>
+#include <sstream>
 #include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../src/analysis.hpp"
+#include "../src/cache.hpp"
 #include "../src/dag.hpp"
+#include "../src/incremental.hpp"
+#include "../src/input.hpp"
+#include "../src/output.hpp"
+#include "../src/reachability.hpp"
+#include "../src/run.hpp"
+#include "../src/server.hpp"
+#include "../src/snapshot.hpp"
+#include "../src/svg.hpp"
+#include "../src/trace.hpp"
 
 void _test_convert_dependencies() {
     {
@@ -64,6 +81,72 @@ void _test_convert_dependencies() {
     }
 }
 
+void _test_scan_dependencies() {
+    {
+        // Same grammar as convert_dependencies
+        std::string text = "a>b,a>c,b>d, c> d\n\n# Just a comment\n  # Indented comment\r\n e \r\n";
+        auto dependencies = dag::scan_dependencies(text);
+        assert(dependencies.size() == 5);
+        assert(dependencies[0].name == "a");
+        assert(dependencies[0].downstream == "b");
+        assert(dependencies[3].name == "c");
+        assert(dependencies[3].downstream == "d");
+        assert(dependencies[4].name == "e");
+        assert(dependencies[4].downstream == "");
+        // Views point into the input text
+        assert(dependencies[0].name.data() == text.data());
+    }
+    {
+        // Last line without newline and empty tokens
+        auto dependencies = dag::scan_dependencies("a>b,,b>c,");
+        assert(dependencies.size() == 2);
+        assert(dependencies[1].name == "b");
+        assert(dependencies[1].downstream == "c");
+    }
+}
+
+void _test_scan_kernels() {
+    // All kernels agree across block boundaries
+    std::string text;
+    for (int i = 0; i < 50; i++) {
+        text += "node" + std::to_string(i) + " > node" + std::to_string(i + 1) + ", x>y\n#>,>\n";
+    }
+
+    auto expected = dag::scan_dependencies(text, dag::ScanKernel::Scalar);
+    assert(expected.size() == 100);
+
+    for (auto kernel: { dag::ScanKernel::SSE2, dag::ScanKernel::AVX2 }) {
+        if (!dag::scan_kernel_supported(kernel)) continue;
+
+        auto dependencies = dag::scan_dependencies(text, kernel);
+        assert(dependencies.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); i++) {
+            assert(dependencies[i].name == expected[i].name);
+            assert(dependencies[i].downstream == expected[i].downstream);
+        }
+    }
+}
+
+void _test_parallel_parse() {
+    // Chunked parsing yields the same ids and order as the serial parser
+    std::string text;
+    for (int i = 0; i < 200; i++) {
+        text += "n" + std::to_string(i % 37) + ">n" + std::to_string(i % 23) + ",n" + std::to_string(i) + "\n# comment\n";
+    }
+
+    auto expected = dag::parse_dependencies(text, 1);
+
+    for (unsigned threads = 2; threads <= 8; threads++) {
+        auto interned = dag::parse_dependencies(text, threads);
+        assert(interned.names == expected.names);
+        assert(interned.dependencies.size() == expected.dependencies.size());
+        for (size_t i = 0; i < expected.dependencies.size(); i++) {
+            assert(interned.dependencies[i].name == expected.dependencies[i].name);
+            assert(interned.dependencies[i].downstream == expected.dependencies[i].downstream);
+        }
+    }
+}
+
 void _test_add_standalone_node() {
     // Create dependencies for test with no downstream
     dag::Dependency deps[] = { dag::Dependency { "a" } };
@@ -179,14 +262,893 @@ void _test_dependency_rearrange() {
     assert(startNodes[0]->children[0]->children[0]->x == 3);
 }
 
+void _test_duplicate_dependencies() {
+    // Repeated dependencies only connect the nodes once
+    dag::Dependency deps[] = {
+        dag::Dependency { "a", "b" },
+        dag::Dependency { "a", "b" },
+        dag::Dependency { "b", "c" },
+        dag::Dependency { "a", "b" }
+    };
+    dag::dependency_vec dependencies(std::begin(deps), std::end(deps));
+    dag::node_vec startNodes;
+
+    dag::build_dag(dependencies, startNodes);
+
+    assert(startNodes.size() == 1);
+    assert(get_node_count(startNodes) == 3);
+    assert(startNodes[0]->children.size() == 1);
+    assert(startNodes[0]->children[0]->ancestors.size() == 1);
+    assert(startNodes[0]->children[0]->children[0]->name == "c");
+}
+
+void _test_ancestor_order() {
+    // Ancestors are listed in the order the walk connects them, not in record order
+    auto dependencies = dag::convert_dependencies({ "a>c", "b>d", "d>c", "e>b", "a>e", "a>b" });
+    dag::node_vec startNodes;
+
+    dag::build_dag(dependencies, startNodes);
+
+    auto a = startNodes[0];
+    assert(a->name == "a" && a->children.size() == 3);
+    auto c = a->children[0], b = a->children[1], e = a->children[2];
+    assert(c->name == "c" && b->name == "b" && e->name == "e");
+    assert(b->ancestors.size() == 2 && b->ancestors[0] == a && b->ancestors[1] == e);
+    assert(c->ancestors.size() == 2 && c->ancestors[0] == a && c->ancestors[1]->name == "d");
+}
+
+void _test_canonicalize_dependencies() {
+    auto interned = dag::parse_dependencies("c\na>b\nb>c\na\na>b\nd\nb>c\nc>a2\nd\ne[2]\n");
+    {
+        // Only records without any effect are dropped
+        auto canonical = dag::canonicalize_dependencies(interned);
+        assert(canonical.dependencies.size() == 6 && canonical.names == interned.names);
+
+        auto expected = dag::build_graph(interned);
+        auto graph = dag::build_graph(canonical);
+        assert(graph.nameData == expected.nameData && graph.startNodes == expected.startNodes);
+        assert(graph.childIds == expected.childIds && graph.x == expected.x && graph.y == expected.y);
+    }
+    {
+        // The same dependencies in any order give the same text
+        std::ostringstream first, second;
+        dag::write_dependencies(dag::canonicalize_dependencies(interned, true), first);
+        dag::write_dependencies(dag::canonicalize_dependencies(dag::parse_dependencies("d\nc>a2\ne[2]\nb>c\na>b\n"), true), second);
+        assert(first.str() == "a>b\nb>c\nc>a2\nd\ne[2]\n");
+        assert(second.str() == first.str());
+
+        // Costs read back unchanged
+        std::ostringstream costs;
+        dag::write_dependencies(dag::parse_dependencies("x[0.1]>y[1e+300]\ny>z\n"), costs);
+        assert(costs.str() == "x[0.1]>y[1e+300]\ny>z\n");
+    }
+}
+
+void _test_compressed_graph() {
+    dag::Dependency deps[] = {
+        dag::Dependency { "a", "b" },
+        dag::Dependency { "a", "c" },
+        dag::Dependency { "b", "e" },
+        dag::Dependency { "c", "d" },
+        dag::Dependency { "d", "e" }
+    };
+    dag::dependency_vec dependencies(std::begin(deps), std::end(deps));
+
+    auto graph = dag::build_graph(dependencies);
+
+    assert(graph.size() == 5);
+    assert(graph.edge_count() == 5);
+    assert(get_node_count(graph) == 5);
+    assert(graph.startNodes.size() == 1);
+    // Ids are assigned in order of first appearance
+    auto a = graph.startNodes[0];
+    assert(graph.name(a) == "a");
+    assert(graph.children(a).size() == 2);
+    auto b = graph.children(a)[0];
+    auto c = graph.children(a)[1];
+    assert(graph.name(b) == "b");
+    assert(graph.name(c) == "c");
+    auto e = graph.children(b)[0];
+    assert(graph.name(e) == "e");
+    assert(graph.ancestors(e).size() == 2);
+    // Positions match the node based dag
+    assert(graph.x[a] == 0);
+    assert(graph.x[b] == 1);
+    assert(graph.x[c] == 1);
+    assert(graph.x[e] == 3);
+}
+
+void _test_cycle_detection() {
+    {
+        // Cycles are rejected with their path
+        dag::Dependency deps[] = {
+            dag::Dependency { "x", "a" },
+            dag::Dependency { "a", "b" },
+            dag::Dependency { "b", "c" },
+            dag::Dependency { "c", "a" },
+            dag::Dependency { "d", "d" }
+        };
+        dag::dependency_vec dependencies(std::begin(deps), std::end(deps));
+        bool raised = false;
+
+        try {
+            dag::build_graph(dependencies);
+        } catch (dag::CycleError& e) {
+            raised = true;
+            auto cycles = e.getCycles();
+            assert(cycles.size() == 2);
+            assert(cycles[0] == std::vector<std::string>({ "a", "b", "c", "a" }));
+            assert(cycles[1] == std::vector<std::string>({ "d", "d" }));
+        }
+
+        assert(raised);
+    }
+    {
+        // Cycles can be merged into a single node
+        dag::Dependency deps[] = {
+            dag::Dependency { "x", "a" },
+            dag::Dependency { "a", "b" },
+            dag::Dependency { "b", "a" },
+            dag::Dependency { "b", "c" }
+        };
+        dag::dependency_vec dependencies(std::begin(deps), std::end(deps));
+        dag::BuildOptions options;
+        options.condenseCycles = true;
+
+        auto graph = dag::build_graph(dependencies, options);
+        assert(graph.size() == 3);
+        assert(graph.name(graph.startNodes[0]) == "x");
+        auto merged = graph.children(graph.startNodes[0])[0];
+        assert(graph.name(merged) == "a | b");
+        assert(graph.name(graph.children(merged)[0]) == "c");
+    }
+}
+
+void _test_layers() {
+    // A ladder of diamonds has exponentially many paths but is layered in one pass
+    dag::dependency_vec dependencies;
+    const int DIAMONDS = 40;
+    for (int i = 0; i < DIAMONDS; i++) {
+        auto top = "n" + std::to_string(i);
+        auto bottom = "n" + std::to_string(i + 1);
+        dependencies.push_back(dag::Dependency { top, "l" + std::to_string(i) });
+        dependencies.push_back(dag::Dependency { top, "r" + std::to_string(i) });
+        dependencies.push_back(dag::Dependency { "l" + std::to_string(i), bottom });
+        dependencies.push_back(dag::Dependency { "r" + std::to_string(i), bottom });
+    }
+
+    auto graph = dag::build_graph(dependencies);
+
+    assert(graph.depth == 2 * DIAMONDS + 1);
+    assert(graph.topologicalOrder.size() == graph.size());
+    for (dag::node_id id = 0; id < graph.size(); id++) {
+        assert(graph.x[id] == static_cast<int>(graph.layers[id]));
+        for (auto child: graph.children(id)) {
+            assert(graph.layers[child] > graph.layers[id]);
+        }
+    }
+}
+
+void _test_layered_layout() {
+    // Crossing edges are untangled: a>d, b>c, a>e, c>f
+    dag::Dependency deps[] = {
+        dag::Dependency { "a", "d" },
+        dag::Dependency { "b", "c" },
+        dag::Dependency { "a", "e" },
+        dag::Dependency { "c", "f" },
+        dag::Dependency { "a", "f" }
+    };
+    dag::dependency_vec dependencies(std::begin(deps), std::end(deps));
+    dag::BuildOptions options;
+    options.layout.engine = dag::LayoutEngine::Layered;
+
+    auto graph = dag::build_graph(dependencies, options);
+
+    std::set<std::pair<int, int>> positions;
+    for (dag::node_id id = 0; id < graph.size(); id++) {
+        // Columns are the layers and no two nodes share a position
+        assert(graph.x[id] == static_cast<int>(graph.layers[id]));
+        assert(positions.insert(std::make_pair(graph.x[id], graph.y[id])).second);
+    }
+
+    // No edges between the first two layers cross
+    for (dag::node_id u = 0; u < graph.size(); u++) {
+        for (dag::node_id v = 0; v < graph.size(); v++) {
+            if (graph.layers[u] != 0 || graph.layers[v] != 0 || graph.y[u] >= graph.y[v]) continue;
+            for (auto uChild: graph.children(u)) {
+                for (auto vChild: graph.children(v)) {
+                    if (graph.layers[uChild] == 1 && graph.layers[vChild] == 1) {
+                        assert(graph.y[uChild] <= graph.y[vChild]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void _test_layered_long_edges() {
+    // Edges beyond the virtual node budget skip the sweeps, but their nodes are still placed
+    std::vector<std::string> lines;
+    for (int i = 0; i < 9; i++) {
+        lines.push_back("c" + std::to_string(i) + ">c" + std::to_string(i + 1));
+    }
+    for (int i = 0; i < 20; i++) {
+        lines.push_back("s" + std::to_string(i) + ">c9");
+    }
+    auto dependencies = dag::convert_dependencies(lines);
+    dag::BuildOptions options;
+    options.layout.engine = dag::LayoutEngine::Layered;
+
+    auto graph = dag::build_graph(dependencies, options);
+
+    assert(graph.size() == 30 && graph.depth == 10);
+    std::set<std::pair<int, int>> positions;
+    for (dag::node_id id = 0; id < graph.size(); id++) {
+        assert(graph.x[id] == static_cast<int>(graph.layers[id]) && graph.y[id] >= 0);
+        assert(positions.insert(std::make_pair(graph.x[id], graph.y[id])).second);
+    }
+}
+
+/**
+ * Read a whole file into a string
+ */
+std::string _read_file(const std::string& filename) {
+    std::ifstream stream(filename);
+    std::stringstream contents;
+    contents << stream.rdbuf();
+    return contents.str();
+}
+
+/**
+ * Count the occurrences of a pattern in a string
+ */
+size_t _count_occurrences(const std::string& text, const std::string& pattern) {
+    size_t count = 0;
+    for (auto pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + 1)) {
+        count++;
+    }
+    return count;
+}
+
+void _test_write_svg() {
+    dag::dependency_vec dependencies;
+    for (int i = 0; i < 300; i++) {
+        dependencies.push_back(dag::Dependency { "n" + std::to_string(i / 3), "n" + std::to_string(i + 1) });
+    }
+    dependencies.push_back(dag::Dependency { "a<b", "n0" });
+    auto graph = dag::build_graph(dependencies);
+
+    write_svg(graph, "dag_test_serial.svg", 1);
+    write_svg(graph, "dag_test_parallel.svg", 4);
+
+    // Output does not depend on the number of threads
+    auto serial = _read_file("dag_test_serial.svg");
+    assert(serial == _read_file("dag_test_parallel.svg"));
+    assert(_count_occurrences(serial, "<rect") == graph.size());
+    assert(_count_occurrences(serial, "<line") == graph.edge_count());
+    // Labels are escaped
+    assert(serial.find(">a&lt;b</text>") != std::string::npos);
+    // The longest chain is highlighted
+    assert(_count_occurrences(serial, "<line class=\"critical\"") > 0);
+
+    // Compact markup uses the shared box and merges all edges into two paths
+    dag::OutputOptions options;
+    options.file = "dag_test_compact.svg";
+    options.compactSvg = true;
+    options.threads = 3;
+    dag::write_output(graph, options);
+    auto compact = _read_file(options.file);
+    assert(_count_occurrences(compact, "<use ") == graph.size() + 1);
+    assert(_count_occurrences(compact, "<path ") == 3);
+    assert(compact.find(">a&lt;b</text>") != std::string::npos);
+    assert(compact.size() * 3 < serial.size() * 2);
+
+#ifdef DAG_ZLIB
+    options.file = "dag_test_compact.svgz";
+    dag::write_output(graph, options);
+    auto compressed = _read_file(options.file);
+    assert(compressed.size() > 2 && compressed[0] == '\x1f' && compressed[1] == '\x8b');
+    std::remove("dag_test_compact.svgz");
+#endif
+
+    std::remove("dag_test_serial.svg");
+    std::remove("dag_test_parallel.svg");
+    std::remove("dag_test_compact.svg");
+}
+
+void _test_write_output() {
+    auto graph = dag::build_graph(dag::parse_dependencies("a>b\nb>c\na>c\nd\"e\n"));
+    dag::OutputOptions options;
+    options.file = "dag_test_output.txt";
+
+    options.format = dag::OutputFormat::Dot;
+    dag::write_output(graph, options);
+    auto dot = _read_file(options.file);
+    assert(dot.find("digraph") == 0);
+    assert(_count_occurrences(dot, " -> ") == graph.edge_count());
+    assert(dot.find("\"d\\\"e\";") != std::string::npos);
+
+    options.format = dag::OutputFormat::Json;
+    dag::write_output(graph, options);
+    auto json = _read_file(options.file);
+    assert(_count_occurrences(json, "\"name\"") == graph.size());
+    assert(json.find("[1,2]") != std::string::npos);
+    auto costly = dag::build_graph(dag::parse_dependencies("a[1234567.125]>b\n"));
+    dag::write_output(costly, options);
+    assert(_read_file(options.file).find("\"cost\":1234567.125,") != std::string::npos);
+
+    // Shared nodes are listed below every parent but expanded once
+    options.format = dag::OutputFormat::Text;
+    dag::write_output(graph, options);
+    assert(_read_file(options.file) == "a[2](0|0)\n\tb[1](1|0)\n\t\tc[0](2|1)\n\tc[0](2|1)\nd\"e[0](0|1)\n");
+
+    std::remove(options.file.c_str());
+}
+
+void _test_critical_path() {
+    {
+        // Costs are stripped from the names; Brackets without a number stay
+        auto graph = dag::build_graph(dag::parse_dependencies("a[12.5]>b\na>c\nb [3]>d\nc[20]>d\nv[i]\n"));
+        assert(graph.size() == 5);
+        assert(graph.name(0) == "a" && graph.costs[0] == 12.5);
+        assert(graph.name(2) == "c" && graph.costs[2] == 20);
+        assert(graph.name(3) == "d" && graph.costs[3] == dag::DEFAULT_COST);
+        assert(graph.name(4) == "v[i]");
+
+        auto analysis = dag::analyze_critical_path(graph);
+        assert(analysis.length == 33.5);
+        assert(analysis.earliestStart[1] == 12.5 && analysis.latestStart[1] == 29.5 && analysis.slack[1] == 17);
+        assert(analysis.slack[2] == 0 && analysis.slack[3] == 0);
+        assert((analysis.path == dag::id_vec { 0, 2, 3 }));
+        assert((analysis.levelWidths == std::vector<uint32_t> { 2, 2, 1 }));
+
+        size_t criticalEdges = 0;
+        for (bool critical: analysis.criticalEdges) criticalEdges += critical;
+        assert(criticalEdges == 2);
+    }
+    {
+        // Json numbers read back exactly
+        auto graph = dag::build_graph(dag::parse_dependencies("a[1234567.125]>b[0.1]\n"));
+        std::ostringstream json;
+        dag::write_analysis_json(graph, dag::analyze_critical_path(graph), json);
+        assert(json.str().find("\"length\":1234567.225,") != std::string::npos);
+        assert(json.str().find("\"cost\":1234567.125,") != std::string::npos);
+    }
+    {
+        // The last cost wins, also across parser chunks
+        auto serial = dag::build_graph(dag::parse_dependencies("a[1]>b\nb[2]>c\na[4]\n"));
+        auto parallel = dag::build_graph(dag::parse_dependencies("a[1]>b\nb[2]>c\na[4]\n", 3));
+        assert(serial.costs == parallel.costs);
+        assert(serial.costs[0] == 4);
+        // Legacy records take the same grammar
+        auto legacy = dag::build_graph(dag::convert_dependencies({ "a[4]>b[2],b>c" }));
+        assert(legacy.costs == serial.costs);
+    }
+    {
+        // Merged cycles cost as much as their members
+        dag::BuildOptions options;
+        options.condenseCycles = true;
+        auto graph = dag::build_graph(dag::parse_dependencies("a[2]>b\nb[3]>a\nb>c\n"), options);
+        assert(graph.size() == 2);
+        assert(graph.costs[0] == 5);
+    }
+    {
+        bool thrown = false;
+        try {
+            dag::parse_dependencies("a[-1]>b\n");
+        } catch (Exception&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void _test_reachability() {
+    {
+        auto graph = dag::build_graph(dag::parse_dependencies("a>b\nb>c\nc>d\nb>e\nd>f\ne>f\nx>e\n"));
+        dag::NameLookup lookup(graph);
+        dag::ReachabilityIndex index(graph);
+        assert(index.uses_closure());
+
+        std::ostringstream answers;
+        dag::answer_query(graph, lookup, index, "descendants, b", answers);
+        dag::answer_query(graph, lookup, index, "ancestors,f", answers);
+        dag::answer_query(graph, lookup, index, "depends, f, x", answers);
+        dag::answer_query(graph, lookup, index, "depends, x, f", answers);
+        dag::answer_query(graph, lookup, index, "depends, a, a", answers);
+        assert(answers.str() == "c, d, e, f\na, b, c, d, e, x\ntrue\nfalse\nfalse\n");
+
+        bool thrown = false;
+        try {
+            dag::answer_query(graph, lookup, index, "depends, a, missing", answers);
+        } catch (Exception&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    {
+        // Interval labels answer exactly like the closure
+        std::ostringstream text;
+        unsigned seed = 7;
+        for (int i = 1; i < 400; i++) {
+            for (int j = 0; j < 2; j++) {
+                seed = seed * 1103515245 + 12345;
+                text << "n" << (seed >> 8) % i << ">n" << i << "\n";
+            }
+        }
+        auto graph = dag::build_graph(dag::parse_dependencies(text.str()));
+        dag::ReachabilityIndex closure(graph);
+        dag::ReachabilityIndex labels(graph, 0);
+        assert(closure.uses_closure() && !labels.uses_closure());
+
+        for (dag::node_id from = 0; from < graph.size(); from++) {
+            for (dag::node_id to = 0; to < graph.size(); to++) {
+                assert(closure.reaches(from, to) == labels.reaches(from, to));
+            }
+            assert(closure.descendants(from) == labels.descendants(from));
+            assert(closure.ancestors(from) == labels.ancestors(from));
+        }
+    }
+}
+
+void _test_transitive_reduction() {
+    {
+        dag::BuildOptions options;
+        options.reduce = true;
+        auto graph = dag::build_graph(dag::parse_dependencies("a>b\nb>c\na>c\na>d\nc>d\n"), options);
+        assert(graph.removedEdges == 2);
+        assert(graph.edge_count() == 3);
+        assert((std::vector<dag::node_id>(graph.children(0).begin(), graph.children(0).end()) == dag::id_vec { 1 }));
+        assert((std::vector<dag::node_id>(graph.ancestors(3).begin(), graph.ancestors(3).end()) == dag::id_vec { 2 }));
+        assert(graph.depth == 4);
+    }
+    {
+        // Small blocks give the same result and keep the reachability of the full graph
+        std::ostringstream text;
+        unsigned seed = 11;
+        for (int i = 1; i < 300; i++) {
+            for (int j = 0; j < 3; j++) {
+                seed = seed * 1103515245 + 12345;
+                text << "n" << (seed >> 8) % i << ">n" << i << "\n";
+            }
+        }
+        auto full = dag::build_graph(dag::parse_dependencies(text.str()));
+        auto reduced = full;
+        auto blocked = full;
+        auto removed = dag::reduce_transitive(reduced);
+        assert(removed > 0 && dag::reduce_transitive(blocked, 1) == removed);
+        assert(reduced.childIds == blocked.childIds && reduced.ancestorIds == blocked.ancestorIds);
+
+        dag::ReachabilityIndex before(full);
+        dag::ReachabilityIndex after(reduced);
+        for (dag::node_id from = 0; from < full.size(); from++) {
+            assert(before.descendants(from) == after.descendants(from));
+
+            // No remaining edge is implied by another child
+            for (auto child: reduced.children(from)) {
+                for (auto other: reduced.children(from)) {
+                    assert(!after.reaches(other, child));
+                }
+            }
+        }
+    }
+}
+
+void _test_focus() {
+    auto interned = dag::parse_dependencies("a>b\nb[4]>c\nc>d\nx>b\ny>x\nb>e\ne>f\nz\nd>z\n");
+    {
+        // Two levels down and one up; The record order is kept
+        dag::FocusOptions focus;
+        focus.roots = { "b" };
+        focus.down = 2;
+        auto focused = dag::focus_dependencies(interned, focus);
+        assert((focused.names == std::vector<std::string_view> { "a", "b", "c", "d", "x", "e", "f" }));
+        assert(focused.costs[1] == 4);
+
+        auto graph = dag::build_graph(focused);
+        assert(graph.size() == 7 && graph.edge_count() == 6);
+        assert(graph.startNodes.size() == 2);
+    }
+    {
+        // Several roots; Nodes without kept edges stay
+        dag::BuildOptions options;
+        options.focus.roots = { "y", "z" };
+        options.focus.up = 0;
+        options.focus.down = 0;
+        auto graph = dag::build_graph(interned, options);
+        assert(graph.size() == 2 && graph.edge_count() == 0);
+        assert(graph.name(0) == "y" && graph.name(1) == "z");
+    }
+    {
+        bool thrown = false;
+        dag::FocusOptions focus;
+        focus.roots = { "missing" };
+        try {
+            dag::focus_dependencies(interned, focus);
+        } catch (Exception&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void _test_collapse() {
+    auto interned = dag::parse_dependencies("svc/a>svc/b\nsvc/b>db/c\nsvc/a>db/d\nweb>svc/a\nx/1>y/1\ny/2>x/2\n");
+    {
+        // Clusters that depend on each other are merged
+        dag::BuildOptions options;
+        options.collapse.depth = 1;
+        auto graph = dag::build_graph(interned, options);
+        assert(graph.size() == 4);
+        assert(graph.name(0) == "svc/*" && graph.name(1) == "db/*" && graph.name(2) == "web" && graph.name(3) == "x/* | y/*");
+        assert((graph.clusterSizes == std::vector<uint32_t> { 2, 2, 1, 4 }));
+        assert(graph.edge_count() == 2);
+        assert(graph.childIds[graph.childOffsets[0]] == 1 && graph.edgeWeights[graph.childOffsets[0]] == 2);
+        assert(graph.x.size() == 4);
+
+        // The full graph stays available for drill downs
+        assert(graph.expanded && graph.expanded->size() == 9);
+        assert(graph.clusters[graph.expanded->size() - 1] == 3);
+        auto detail = dag::extract_subgraph(*graph.expanded, { 0, 1 });
+        assert(detail.size() == 2 && detail.edge_count() == 1);
+    }
+    {
+        // Automatic collapsing keeps small graphs
+        dag::BuildOptions options;
+        options.collapse.automatic = true;
+        assert(!dag::build_graph(interned, options).expanded);
+
+        options.collapse.maxNodes = 3;
+        auto graph = dag::build_graph(interned, options);
+        assert(graph.expanded && graph.size() == 4);
+    }
+}
+
+void _test_incremental() {
+    {
+        // Edges against the order move the ancestors in front
+        dag::IncrementalGraph graph;
+        graph.add_edge("c", "d");
+        graph.add_edge("a", "b");
+        auto moved = graph.add_edge("d", "a");
+        auto a = graph.find("a"), b = graph.find("b"), c = graph.find("c"), d = graph.find("d");
+        assert(graph.position(c) < graph.position(d) && graph.position(d) < graph.position(a));
+        assert(graph.position(a) < graph.position(b));
+        assert(graph.layer(a) == 2 && graph.layer(b) == 3);
+        assert((std::set<dag::node_id>(moved.begin(), moved.end()) == std::set<dag::node_id> { a, b }));
+
+        // A cycle leaves the graph as it was
+        bool thrown = false;
+        try {
+            graph.add_edge("b", "c");
+        } catch (dag::CycleError& e) {
+            thrown = true;
+            assert((e.getCycles()[0] == std::vector<std::string> { "b", "c", "d", "a", "b" }));
+        }
+        assert(thrown && graph.edge_count() == 3 && !graph.contains_edge(b, c));
+
+        // Removing a node lowers its descendants
+        moved = graph.remove_node("d");
+        assert(graph.size() == 3 && graph.edge_count() == 1);
+        assert(graph.layer(a) == 0 && graph.layer(b) == 1);
+        assert(graph.remove_edge("a", "b").size() == 1 && graph.layer(b) == 0);
+        assert(graph.remove_edge("a", "b").empty());
+    }
+    {
+        // The layers match a full build after random changes
+        dag::IncrementalGraph graph;
+        uint32_t seed = 7;
+        auto next = [&]() { seed = seed * 1103515245 + 12345; return (seed >> 16) % 40; };
+        for (int i = 0; i < 400; i++) {
+            auto from = std::to_string(next()), to = std::to_string(next());
+            try {
+                if (i % 5 == 4) graph.remove_edge(from, to); else graph.add_edge(from, to);
+            } catch (dag::CycleError&) {
+            }
+        }
+
+        auto snapshot = graph.to_graph();
+        dag::dependency_vec dependencies;
+        for (dag::node_id node = 0; node < snapshot.size(); node++) {
+            dependencies.push_back({ std::string(snapshot.name(node)), "" });
+            for (auto child: snapshot.children(node)) {
+                dependencies.push_back({ std::string(snapshot.name(node)), std::string(snapshot.name(child)) });
+            }
+        }
+        auto full = dag::build_graph(dependencies);
+        assert(full.size() == snapshot.size() && full.edge_count() == snapshot.edge_count());
+        dag::NameLookup lookup(full);
+        for (dag::node_id node = 0; node < snapshot.size(); node++) {
+            assert(full.layers[lookup.find(snapshot.name(node))] == snapshot.layers[node]);
+        }
+
+        // Rows are unique per layer
+        std::set<std::pair<int, int>> positions;
+        for (dag::node_id node = 0; node < snapshot.size(); node++) {
+            assert(positions.insert({ snapshot.x[node], snapshot.y[node] }).second);
+        }
+    }
+    {
+        // Only the changed lines are applied
+        dag::IncrementalGraph graph;
+        dag::WatchRecords records;
+        std::ostringstream errors;
+        auto summary = dag::apply_dependencies(graph, records, "a>b\nb>c\na>b\n", errors);
+        assert(summary.addedNodes == 3 && summary.addedEdges == 2 && graph.edge_count() == 2);
+
+        summary = dag::apply_dependencies(graph, records, "a>b\nb>c\nc>a\nd\n", errors);
+        assert(summary.addedNodes == 1 && summary.rejectedEdges == 1 && errors.str() != "");
+        summary = dag::apply_dependencies(graph, records, "a>b\nc>a\nd\n", errors);
+        assert(summary.removedEdges == 1 && summary.addedEdges == 1 && graph.layer(graph.find("b")) == 2);
+
+        summary = dag::apply_dependencies(graph, records, "c>a\n", errors);
+        assert(summary.removedNodes == 2 && graph.size() == 2 && graph.find("b") == dag::NO_NODE);
+    }
+}
+
+void _test_graph_server() {
+    dag::ServerOptions options;
+    options.output.format = dag::OutputFormat::Text;
+    dag::GraphServer server(dag::build_graph(dag::parse_dependencies("a>b\nb>c\na>d\n")), options);
+
+    // Every answer ends with a zero byte
+    auto ask = [&](const std::string& request) {
+        int fds[2];
+        assert(pipe(fds) == 0);
+        server.answer(request, fds[1]);
+        close(fds[1]);
+        std::string response = dag::read_input(fds[0]);
+        close(fds[0]);
+        assert(!response.empty() && response.back() == '\0');
+        return response.substr(0, response.size() - 1);
+    };
+
+    assert(ask("descendants, a") == "b, c, d\n");
+    assert(ask("depends, c, a") == "true\n");
+    assert(ask("order") == "a\nb\nd\nc\n");
+    assert(ask("stats").find("nodes 4\nedges 3\n") == 0);
+    assert(ask("subgraph, b, 1, 0, dot") == "digraph dag {\n  \"a\";\n  \"b\";\n  \"a\" -> \"b\";\n}\n");
+
+    // Updates are visible to the next request
+    assert(ask("add, c, e") == "1 moved\n");
+    assert(ask("remove, a, d") == "1 moved\n");
+    assert(ask("ancestors, e") == "a, b, c\n");
+    assert(ask("render").find("e[0](3|") != std::string::npos);
+    assert(ask("stats").find("version 2\n") != std::string::npos);
+
+    assert(ask("add, e, a").find("Error: Circular dependencies") == 0);
+    assert(ask("render, png") == "Error: Unknown format png\n");
+    assert(ask("subgraph, x, 1, 1") == "Error: Unknown node x\n");
+    assert(ask("subgraph, a, one, 1").find("Error: Expected a number") == 0);
+    assert(ask("subgraph, a, -1, 1") == "Error: Expected a number instead of -1\n");
+}
+
+void _test_snapshot() {
+    const std::string filename = "_test_snapshot.bin";
+    dag::BuildOptions options;
+    options.collapse.depth = 1;
+    auto graph = dag::build_graph(dag::parse_dependencies("a/x[3]>b/y\nb/y>c\na/z>c\nd\n"), options);
+    dag::save_snapshot(graph, filename);
+
+    // Everything but the expanded graph comes back
+    auto loaded = dag::load_snapshot(filename);
+    assert(loaded.nameData == graph.nameData && loaded.nameOffsets == graph.nameOffsets);
+    assert(loaded.childOffsets == graph.childOffsets && loaded.childIds == graph.childIds);
+    assert(loaded.ancestorOffsets == graph.ancestorOffsets && loaded.ancestorIds == graph.ancestorIds);
+    assert(loaded.costs == graph.costs && loaded.startNodes == graph.startNodes);
+    assert(loaded.topologicalOrder == graph.topologicalOrder && loaded.layers == graph.layers);
+    assert(loaded.depth == graph.depth && loaded.edgeWeights == graph.edgeWeights);
+    assert(loaded.clusterSizes == graph.clusterSizes && loaded.clusters == graph.clusters);
+    assert(loaded.x == graph.x && loaded.y == graph.y && !loaded.expanded);
+
+    auto empty = dag::build_graph(dag::dependency_vec());
+    dag::save_snapshot(empty, filename);
+    assert(dag::load_snapshot(filename).size() == 0);
+
+    // Damaged files are refused
+    dag::save_snapshot(graph, filename);
+    std::string bytes;
+    {
+        std::ifstream file(filename, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    auto refused = [&](const std::string& content) {
+        std::ofstream(filename, std::ios::binary) << content;
+        try {
+            dag::load_snapshot(filename);
+        } catch (Exception&) {
+            return true;
+        }
+        return false;
+    };
+    auto flipped = bytes;
+    flipped[flipped.size() - 1] ^= 1;
+    assert(refused(flipped));
+    assert(refused(bytes.substr(0, bytes.size() - 8)));
+    assert(refused("a>b\n"));
+    assert(!refused(bytes));
+    std::remove(filename.c_str());
+}
+
+void _test_result_cache() {
+    const std::string directory = "_test_cache";
+    auto write_file = [](const std::string& filename, const std::string& content) {
+        std::ofstream(filename, std::ios::binary) << content;
+    };
+    auto read_file = [](const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+
+    // The settings are part of the key
+    auto first = dag::cache_key("a>b\n", "svg");
+    assert(first == dag::cache_key("a>b\n", "svg"));
+    assert(!(first == dag::cache_key("a>b\n", "dot")) && !(first == dag::cache_key("a>c\n", "svg")));
+    auto second = dag::cache_key("b>c\n", "svg");
+    auto alias = dag::cache_key("b>c\nb>c\n", "svg");
+
+    dag::CacheOptions options;
+    options.directory = directory;
+    options.maxBytes = 150;
+    dag::ResultCache cache(options);
+    options.maxBytes = 0;
+    dag::ResultCache(options).evict();
+    assert(!cache.fetch(first, "_test_cache.out"));
+
+    auto temporary = cache.temporary_path("out.svgz");
+    assert(temporary.compare(temporary.size() - 5, 5, ".svgz") == 0);
+    write_file(temporary, std::string(100, 'a'));
+    cache.store(temporary, first);
+    assert(cache.fetch(first, "_test_cache.out") && read_file("_test_cache.out") == std::string(100, 'a'));
+
+    // Linked keys share the entry and are evicted with it; The first entry was used longest ago
+    struct timespec past[2] = { { 1, 0 }, { 1, 0 } };
+    utimensat(AT_FDCWD, (directory + "/" + first.hex()).c_str(), past, 0);
+    temporary = cache.temporary_path("out.svg");
+    write_file(temporary, std::string(100, 'b'));
+    cache.store(temporary, second);
+    cache.link(second, alias);
+    cache.evict();
+    assert(!cache.fetch(first, "_test_cache.out"));
+    assert(cache.fetch(alias, "_test_cache.out") && read_file("_test_cache.out") == std::string(100, 'b'));
+
+    dag::ResultCache(options).evict();
+    assert(!cache.fetch(second, "_test_cache.out") && !cache.fetch(alias, "_test_cache.out"));
+
+    std::remove("_test_cache.out");
+    rmdir(directory.c_str());
+}
+
+void _test_run_tasks() {
+    {
+        // Commands may contain arrows and commas
+        auto input = dag::split_task_input("a>b\n# a: comment\nb: echo b > out, echo done\nc:\n");
+        assert(input.commands.size() == 2);
+        assert(input.commands[0].name == "b");
+        assert(input.commands[0].command == "echo b > out, echo done");
+        assert(input.commands[1].name == "c");
+        assert(input.commands[1].command == "");
+        assert(dag::build_graph(dag::parse_dependencies(input.dependencies)).size() == 3);
+    }
+    {
+        // Every node starts after all its ancestors
+        std::remove("dag_test_run.txt");
+        auto input = dag::split_task_input(
+            "a>b\na>c\nb>d\nc>d\n"
+            "a: echo a >> dag_test_run.txt\nb: echo b >> dag_test_run.txt\n"
+            "c: echo c >> dag_test_run.txt\nd: echo d >> dag_test_run.txt\n");
+        auto graph = dag::build_graph(dag::parse_dependencies(input.dependencies));
+        auto commands = dag::assign_commands(graph, input.commands);
+
+        dag::RunOptions options;
+        options.jobs = 3;
+        auto results = dag::run_tasks(graph, commands, options);
+        assert(results.size() == 4);
+        for (const auto& result: results) {
+            assert(result.status == dag::TaskStatus::Succeeded);
+        }
+
+        auto order = _read_file("dag_test_run.txt");
+        assert(order.size() == 8);
+        assert(order.substr(0, 2) == "a\n");
+        assert(order.substr(6, 2) == "d\n");
+        std::remove("dag_test_run.txt");
+    }
+    {
+        // Failures skip the descendants; Unaffected nodes only run with keep going
+        auto input = dag::split_task_input("a>b\nb>c\nx>y\na: false\nx: true\ny: true\n");
+        auto graph = dag::build_graph(dag::parse_dependencies(input.dependencies));
+        auto commands = dag::assign_commands(graph, input.commands);
+
+        dag::RunOptions options;
+        options.keepGoing = true;
+        std::vector<dag::TaskStatus> statuses(graph.size());
+        for (const auto& result: dag::run_tasks(graph, commands, options)) {
+            statuses[result.node] = result.status;
+        }
+        assert(statuses[0] == dag::TaskStatus::Failed);
+        assert(statuses[1] == dag::TaskStatus::Skipped);
+        assert(statuses[2] == dag::TaskStatus::Skipped);
+        assert(statuses[graph.size() - 1] == dag::TaskStatus::Succeeded);
+
+        // Fail fast starts nothing after the first failure on a single worker
+        options.keepGoing = false;
+        bool failed = false;
+        for (const auto& result: dag::run_tasks(graph, commands, options)) {
+            assert(!failed || result.status == dag::TaskStatus::Skipped);
+            failed = failed || result.status == dag::TaskStatus::Failed;
+        }
+        assert(failed);
+    }
+    {
+        // Commands need a node
+        bool thrown = false;
+        try {
+            dag::Graph graph = dag::build_graph(dag::parse_dependencies("a\n"));
+            dag::assign_commands(graph, { dag::TaskCommand { "b", "true" } });
+        } catch (Exception&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void _test_trace() {
+#ifdef DAG_INSTRUMENTATION
+    dag::enable_tracing();
+    auto lookups = dag::get_trace_count(dag::Counter::NodeLookups);
+    auto graph = dag::build_graph(dag::parse_dependencies("a>b,b>c\na>c\n", 2));
+    assert(graph.size() == 3);
+    assert(dag::get_trace_count(dag::Counter::NodeLookups) > lookups);
+    assert(dag::get_trace_count(dag::Counter::EdgesVisited) >= graph.edge_count());
+
+    std::ostringstream stats;
+    dag::print_trace_stats(stats);
+    assert(stats.str().find("_append_child_nodes") != std::string::npos);
+    assert(stats.str().find("node_lookups") != std::string::npos);
+
+    // Worker threads get their own tracks
+    dag::write_trace("dag_test_trace.json");
+    auto trace = _read_file("dag_test_trace.json");
+    assert(trace.find("\"traceEvents\"") != std::string::npos);
+    assert(trace.find("\"name\":\"build_graph\",\"ph\":\"X\"") != std::string::npos);
+    assert(trace.find("\"tid\":2") != std::string::npos);
+    std::remove("dag_test_trace.json");
+#endif
+}
+
 int main(int, char**) {
     std::cout << "Running tests" << std::endl;
     _test_convert_dependencies();
+    _test_scan_dependencies();
+    _test_scan_kernels();
+    _test_parallel_parse();
     _test_add_standalone_node();
     _test_add_single_dependency();
     _test_add_double_dependency();
     _test_add_reversed_dependency();
     _test_dependency_recombine();
     _test_dependency_rearrange();
+    _test_duplicate_dependencies();
+    _test_ancestor_order();
+    _test_canonicalize_dependencies();
+    _test_compressed_graph();
+    _test_cycle_detection();
+    _test_layers();
+    _test_layered_layout();
+    _test_layered_long_edges();
+    _test_write_svg();
+    _test_write_output();
+    _test_critical_path();
+    _test_reachability();
+    _test_transitive_reduction();
+    _test_focus();
+    _test_collapse();
+    _test_incremental();
+    _test_graph_server();
+    _test_snapshot();
+    _test_result_cache();
+    _test_run_tasks();
+    _test_trace();
     std::cout << "All tests complete" << std::endl;
 }
\ No newline at end of file